@@ -40,14 +40,31 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <limits>
+#include <stdexcept>
 #include <vector>
 
-#if (__cplusplus >= 201703L) && !(defined LBVH_NO_THREADS)
-#include <execution>
+// The memory resources of std::pmr are used where the standard library has
+// them. Older ones, such as libc++ before version 16, get a small replacement.
+
+#if !defined(LBVH_NO_MEMORY_RESOURCE) && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
+#endif
+
+#if !defined(LBVH_NO_MEMORY_RESOURCE) && defined(__cpp_lib_memory_resource)
+#define LBVH_HAS_MEMORY_RESOURCE 1
+#else
+#include <cstddef>
+#include <new>
 #endif
 
 #ifndef LBVH_NO_THREADS
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <thread>
 #endif
 
@@ -55,14 +72,196 @@
 #include <intrin.h>
 #endif
 
+#if (defined(__SSE__) || defined(_M_X64)) && !defined(LBVH_NO_SIMD)
+#include <immintrin.h>
+#endif
+
+// The float packet kernels are compiled for AVX2 and AVX-512 on x86-64 and
+// picked when the program runs, see detail::cpu_simd_level.
+
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(_MSC_VER)) && !defined(LBVH_NO_SIMD)
+#define LBVH_SIMD_DISPATCH 1
+#ifdef _MSC_VER
+#define LBVH_TARGET(isa)
+#else
+#define LBVH_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+#ifndef LBVH_NO_MMAP
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#endif
+
 #include <cmath>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 
 namespace lbvh {
 
 //! This is the type used for size values.
 using size_type = std::size_t;
 
+//! \brief The polymorphic memory resources that the library allocates from.
+//!
+//! These are the ones from @c std::pmr, unless the standard library doesn't
+//! have them or @c LBVH_NO_MEMORY_RESOURCE is defined. In that case, this
+//! is a replacement with the parts of the same interface that the library
+//! uses, and the default resource is always the one that uses new and delete.
+namespace pmr {
+
+#ifdef LBVH_HAS_MEMORY_RESOURCE
+
+using std::pmr::memory_resource;
+using std::pmr::polymorphic_allocator;
+using std::pmr::get_default_resource;
+using std::pmr::new_delete_resource;
+
+//! A vector that allocates from a memory resource.
+template <typename value_type>
+using vector = std::pmr::vector<value_type>;
+
+#else // LBVH_HAS_MEMORY_RESOURCE
+
+//! \brief The interface of a memory resource, the same as @c std::pmr::memory_resource.
+class memory_resource {
+public:
+  virtual ~memory_resource() = default;
+  //! Allocates memory from the resource.
+  //!
+  //! \param bytes The number of bytes to allocate.
+  //!
+  //! \param alignment The alignment of the memory.
+  void* allocate(size_type bytes, size_type alignment = alignof(std::max_align_t)) {
+    return do_allocate(bytes, alignment);
+  }
+  //! Gives memory back to the resource that allocated it.
+  void deallocate(void* p, size_type bytes, size_type alignment = alignof(std::max_align_t)) {
+    do_deallocate(p, bytes, alignment);
+  }
+  //! Indicates if memory allocated by one resource can be freed by the other.
+  bool is_equal(const memory_resource& other) const noexcept {
+    return do_is_equal(other);
+  }
+private:
+  //! Allocates the memory, see @ref allocate.
+  virtual void* do_allocate(size_type bytes, size_type alignment) = 0;
+  //! Frees the memory, see @ref deallocate.
+  virtual void do_deallocate(void* p, size_type bytes, size_type alignment) = 0;
+  //! Compares two resources, see @ref is_equal.
+  virtual bool do_is_equal(const memory_resource& other) const noexcept = 0;
+};
+
+//! Compares two memory resources.
+inline bool operator == (const memory_resource& a, const memory_resource& b) noexcept {
+  return (&a == &b) || a.is_equal(b);
+}
+
+//! Compares two memory resources.
+inline bool operator != (const memory_resource& a, const memory_resource& b) noexcept {
+  return !(a == b);
+}
+
+//! Gets the resource that allocates with new and frees with delete.
+inline memory_resource* new_delete_resource() noexcept {
+
+  class new_delete final : public memory_resource {
+    void* do_allocate(size_type bytes, size_type alignment) override {
+      if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        return ::operator new(bytes, std::align_val_t(alignment));
+      }
+      return ::operator new(bytes);
+    }
+    void do_deallocate(void* p, size_type, size_type alignment) override {
+      if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        ::operator delete(p, std::align_val_t(alignment));
+      } else {
+        ::operator delete(p);
+      }
+    }
+    bool do_is_equal(const memory_resource& other) const noexcept override {
+      return this == &other;
+    }
+  };
+
+  static new_delete resource;
+
+  return &resource;
+}
+
+//! Gets the resource that is used when none is given.
+inline memory_resource* get_default_resource() noexcept {
+  return new_delete_resource();
+}
+
+//! \brief An allocator that allocates from a memory resource,
+//! the same as @c std::pmr::polymorphic_allocator. It isn't final,
+//! since containers may derive from their allocator.
+//!
+//! \tparam type The type of the values to allocate.
+template <typename type>
+class polymorphic_allocator {
+public:
+  //! The type of the values to allocate.
+  using value_type = type;
+  //! Constructs an allocator for the default resource.
+  polymorphic_allocator() noexcept : res(get_default_resource()) {}
+  //! Constructs an allocator for a resource.
+  polymorphic_allocator(memory_resource* r) noexcept : res(r) {}
+  //! Constructs an allocator for the resource of another allocator.
+  template <typename other_type>
+  polymorphic_allocator(const polymorphic_allocator<other_type>& other) noexcept : res(other.resource()) {}
+  //! Allocates memory for some values.
+  type* allocate(size_type count) {
+    return static_cast<type*>(res->allocate(count * sizeof(type), alignof(type)));
+  }
+  //! Frees memory for some values.
+  void deallocate(type* p, size_type count) noexcept {
+    res->deallocate(p, count * sizeof(type), alignof(type));
+  }
+  //! Accesses the resource of the allocator.
+  memory_resource* resource() const noexcept {
+    return res;
+  }
+  //! Copies of containers go to the default resource, as they do with @c std::pmr.
+  polymorphic_allocator select_on_container_copy_construction() const noexcept {
+    return polymorphic_allocator();
+  }
+private:
+  //! The resource to allocate from.
+  memory_resource* res;
+};
+
+//! Compares the resources of two allocators.
+template <typename a_type, typename b_type>
+bool operator == (const polymorphic_allocator<a_type>& a, const polymorphic_allocator<b_type>& b) noexcept {
+  return *a.resource() == *b.resource();
+}
+
+//! Compares the resources of two allocators.
+template <typename a_type, typename b_type>
+bool operator != (const polymorphic_allocator<a_type>& a, const polymorphic_allocator<b_type>& b) noexcept {
+  return !(a == b);
+}
+
+//! A vector that allocates from a memory resource.
+template <typename value_type>
+using vector = std::vector<value_type, polymorphic_allocator<value_type>>;
+
+#endif // LBVH_HAS_MEMORY_RESOURCE
+
+} // namespace pmr
+
 //! This class is used to associate certain
 //! types with a type size.
 template <size_type type_size>
@@ -70,11 +269,19 @@ struct associated_types final { };
 
 //! \brief This class is used to describe
 //! the amount of work that a task is assigned.
+//!
+//! A scheduler may split a task into more divisions
+//! than it has threads. Tasks that keep one result per
+//! thread should index it with @ref work_division::thread,
+//! which is always less than the scheduler's max_threads().
 struct work_division final {
   //! The starting index of the work amount.
   size_type idx;
   //! The maximum divisions of the work.
   size_type max;
+  //! The index of the thread running this division.
+  //! Schedulers that issue one division per thread may leave this out.
+  size_type thread = idx;
 };
 
 //! \brief This is a task scheduler that schedules
@@ -87,7 +294,7 @@ public:
   //! In this class, the task immediately is called in the current thread.
   template <typename task_type, typename... arg_types>
   inline void operator () (task_type task, arg_types... args) noexcept {
-    task(work_division { 0, 1 }, args...);
+    task(work_division { 0, 1, 0 }, args...);
   }
   //! Indicates the maximum number of threads
   //! to be invoked at a time.
@@ -108,7 +315,8 @@ public:
 //!
 //! The only reason this thread scheduler is considered
 //! to be "naive" is because it creates and destroys threads
-//! at each call. Ideally, the threads would be in a thread pool.
+//! at each call. See @ref thread_pool_scheduler for a
+//! scheduler that keeps its threads between calls.
 class naive_thread_scheduler final {
   //! The maximum number of threads to run.
   size_type max_thread_count;
@@ -127,12 +335,12 @@ public:
 
     for (size_type i = 0; i < max_thread_count - 1; i++) {
 
-      work_division div { i, max_thread_count };
+      work_division div { i, max_thread_count, i };
 
       threads.emplace_back(task, div, args...);
     }
 
-    task(work_division { max_thread_count - 1, max_thread_count }, args...);
+    task(work_division { max_thread_count - 1, max_thread_count, max_thread_count - 1 }, args...);
 
     for (auto& th : threads) {
       th.join();
@@ -148,9 +356,398 @@ public:
   }
 };
 
+namespace detail {
+
+//! \brief A fixed set of worker threads that stay
+//! parked between dispatches. This is the shared
+//! state behind the pooled task schedulers.
+//!
+//! A dispatch is a low-latency barrier: the calling thread
+//! publishes a job, the workers wake up (spinning briefly before
+//! falling back to a condition variable), everyone runs the job
+//! and the calling thread waits for the last worker to finish.
+class thread_pool final {
+public:
+  //! The type of the type-erased job function.
+  //! It is passed the job data and the index of the calling thread.
+  using job_function_type = void (*)(void*, size_type);
+  //! Constructs a new thread pool.
+  //!
+  //! \param thread_count The total number of threads that run a job,
+  //! including the thread that dispatches it.
+  thread_pool(size_type thread_count) : max_thread_count(thread_count ? thread_count : 1) {
+    for (size_type i = 0; (i + 1) < max_thread_count; i++) {
+      workers.emplace_back(&thread_pool::work, this, i);
+    }
+  }
+  //! Stops and joins the worker threads.
+  ~thread_pool() {
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+      generation.fetch_add(1, std::memory_order_release);
+    }
+
+    wake_cond.notify_all();
+
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+  //! Indicates the number of threads that run each job.
+  inline size_type size() const noexcept {
+    return max_thread_count;
+  }
+  //! Runs a job on every thread of the pool and waits for it to complete.
+  //! The calling thread takes part in the job, using the last thread index.
+  //! This function must not be called from within a job of the same pool.
+  //!
+  //! \param job A function object taking the index of the thread it runs on.
+  template <typename job_type>
+  void run(job_type& job) {
+
+    if (workers.empty()) {
+      job(size_type(0));
+      return;
+    }
+
+    std::lock_guard<std::mutex> dispatch_guard(dispatch_lock);
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      job_function = &invoke<job_type>;
+      job_data = &job;
+      pending.store(workers.size(), std::memory_order_relaxed);
+      generation.fetch_add(1, std::memory_order_release);
+    }
+
+    wake_cond.notify_all();
+
+    job(workers.size());
+
+    wait_for(done_cond, [this]() {
+      return pending.load(std::memory_order_acquire) == 0;
+    });
+  }
+
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator = (const thread_pool&) = delete;
+private:
+  //! Calls a job through its type-erased pointer.
+  template <typename job_type>
+  static void invoke(void* data, size_type thread_index) {
+    (*static_cast<job_type*>(data))(thread_index);
+  }
+  //! Waits for a condition to become true. The condition is
+  //! polled for a short while first, so that back to back
+  //! dispatches don't have to go through the scheduler of the OS.
+  template <typename predicate_type>
+  void wait_for(std::condition_variable& cond, predicate_type pred) {
+
+    constexpr size_type spin_count = 1024;
+
+    for (size_type i = 0; i < spin_count; i++) {
+      if (pred()) {
+        return;
+      }
+      std::this_thread::yield();
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+
+    cond.wait(guard, pred);
+  }
+  //! The loop executed by each of the worker threads.
+  //!
+  //! \param thread_index The index passed to the jobs run by this worker.
+  void work(size_type thread_index) {
+
+    size_type seen_generation = 0;
+
+    for (;;) {
+
+      wait_for(wake_cond, [this, seen_generation]() {
+        return generation.load(std::memory_order_acquire) != seen_generation;
+      });
+
+      seen_generation = generation.load(std::memory_order_acquire);
+
+      if (stopping) {
+        return;
+      }
+
+      job_function(job_data, thread_index);
+
+      if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::lock_guard<std::mutex> guard(lock);
+        done_cond.notify_one();
+      }
+    }
+  }
+  //! The total number of threads, including the dispatching thread.
+  size_type max_thread_count;
+  //! The worker threads.
+  std::vector<std::thread> workers;
+  //! Serializes dispatches coming from different threads.
+  std::mutex dispatch_lock;
+  //! Protects the job data and the condition variables.
+  std::mutex lock;
+  //! Used to wake up parked workers.
+  std::condition_variable wake_cond;
+  //! Used to wake up the dispatching thread.
+  std::condition_variable done_cond;
+  //! Incremented each time a job is published.
+  std::atomic<size_type> generation { 0 };
+  //! The number of workers that haven't finished the current job.
+  std::atomic<size_type> pending { 0 };
+  //! The function of the current job.
+  job_function_type job_function = nullptr;
+  //! The data of the current job.
+  void* job_data = nullptr;
+  //! Set when the pool is being destroyed.
+  bool stopping = false;
+};
+
+} // namespace detail
+
+//! \brief This scheduler runs tasks on a pool of
+//! threads that are created once and kept parked
+//! between calls. It is meant for projects that
+//! rebuild BVHs often, such as once per frame.
+//!
+//! Copies of this scheduler share the same pool,
+//! so it may be passed by value to @ref builder.
+//! A task must not invoke the scheduler it is running on.
+class thread_pool_scheduler final {
+  //! The thread pool shared by the copies of this scheduler.
+  std::shared_ptr<detail::thread_pool> pool;
+public:
+  //! Constructs a new thread pool scheduler.
+  //! \param max_threads_ The maximum number of threads to run.
+  thread_pool_scheduler(size_type max_threads_ = std::thread::hardware_concurrency())
+    : pool(std::make_shared<detail::thread_pool>(max_threads_)) { }
+  //! Schedules a new task to be completed.
+  //! Each thread of the pool calls its own copy of the task.
+  //!
+  //! \tparam task_type The type of the task functor.
+  //! \tparam arg_types The arguments to pass to the task.
+  template <typename task_type, typename... arg_types>
+  void operator () (task_type task, arg_types... args) {
+
+    auto thread_count = pool->size();
+
+    auto job = [&task, thread_count, &args...](size_type thread_index) {
+      task_type thread_task(task);
+      thread_task(work_division { thread_index, thread_count, thread_index }, args...);
+    };
+
+    pool->run(job);
+  }
+  //! Indicates to the library the maximum number of threads
+  //! that may be invoked at a time.
+  //!
+  //! \return The max number of threads that may be invoked at a time.
+  inline size_type max_threads() const noexcept {
+    return pool->size();
+  }
+};
+
+namespace detail {
+
+//! \brief A range of work division indices owned by one thread.
+//! The owner claims divisions from the front of the range while
+//! idle threads steal the back half of it. Both ends are packed
+//! into one atomic so that either operation is a single CAS.
+class alignas(64) stealable_range final {
+public:
+  //! Replaces the range. Only the dispatching thread may call this
+  //! before the task starts, and after that only the owning thread,
+  //! while its range is empty.
+  //!
+  //! \param begin The first division index of the range.
+  //!
+  //! \param end The non-inclusive last division index of the range.
+  void reset(size_type begin, size_type end) noexcept {
+    bounds.store(pack(begin, end), std::memory_order_release);
+  }
+  //! Claims the division at the front of the range.
+  //!
+  //! \param index Receives the claimed division index.
+  //!
+  //! \return True if a division was claimed, false if the range is empty.
+  bool pop(size_type& index) noexcept {
+
+    auto value = bounds.load(std::memory_order_acquire);
+
+    for (;;) {
+
+      auto begin = unpack_begin(value);
+      auto end = unpack_end(value);
+      if (begin >= end) {
+        return false;
+      }
+
+      if (bounds.compare_exchange_weak(value, pack(begin + 1, end), std::memory_order_acq_rel)) {
+        index = begin;
+        return true;
+      }
+    }
+  }
+  //! Steals the back half of the range.
+  //!
+  //! \param begin Receives the first stolen division index.
+  //!
+  //! \param end Receives the non-inclusive last stolen division index.
+  //!
+  //! \return True if divisions were stolen, false if the range is empty.
+  bool steal(size_type& begin, size_type& end) noexcept {
+
+    auto value = bounds.load(std::memory_order_acquire);
+
+    for (;;) {
+
+      auto b = unpack_begin(value);
+      auto e = unpack_end(value);
+      if (b >= e) {
+        return false;
+      }
+
+      auto mid = b + ((e - b) / 2);
+
+      if (bounds.compare_exchange_weak(value, pack(b, mid), std::memory_order_acq_rel)) {
+        begin = mid;
+        end = e;
+        return true;
+      }
+    }
+  }
+private:
+  //! Packs the two ends of a range into one integer.
+  static constexpr std::uint64_t pack(size_type begin, size_type end) noexcept {
+    return std::uint64_t(begin) | (std::uint64_t(end) << 32);
+  }
+  //! Gets the beginning of a packed range.
+  static constexpr size_type unpack_begin(std::uint64_t value) noexcept {
+    return size_type(value & 0xffffffff);
+  }
+  //! Gets the end of a packed range.
+  static constexpr size_type unpack_end(std::uint64_t value) noexcept {
+    return size_type(value >> 32);
+  }
+  //! The two ends of the range.
+  std::atomic<std::uint64_t> bounds { 0 };
+};
+
+} // namespace detail
+
+//! \brief This scheduler splits each task into many more
+//! work divisions than there are threads. Every thread starts
+//! out with an equal share of the divisions and, once it runs
+//! out, steals half of the remaining divisions of another thread.
+//!
+//! This keeps all threads busy when some of them are slower than
+//! others, such as on machines with mixed core types or when the
+//! process shares its cores with other work. Like @ref thread_pool_scheduler,
+//! its threads are kept between calls and its copies share them.
+class work_stealing_scheduler final {
+  //! The state shared by the copies of this scheduler.
+  struct shared_state final {
+    //! The threads that the divisions are run on.
+    detail::thread_pool pool;
+    //! The range of divisions owned by each thread.
+    std::unique_ptr<detail::stealable_range[]> ranges;
+    //! Constructs the shared state.
+    //! \param thread_count The number of threads to run.
+    shared_state(size_type thread_count)
+      : pool(thread_count),
+        ranges(new detail::stealable_range[pool.size()]) { }
+  };
+  //! The state shared by the copies of this scheduler.
+  std::shared_ptr<shared_state> state;
+  //! The number of divisions each thread starts out with.
+  size_type divisions_per_thread;
+public:
+  //! Constructs a new work stealing scheduler.
+  //!
+  //! \param max_threads_ The maximum number of threads to run.
+  //!
+  //! \param divisions_per_thread_ The number of work divisions
+  //! per thread that each task is split into. Higher values balance
+  //! the work better, at the cost of more calls to the task.
+  work_stealing_scheduler(size_type max_threads_ = std::thread::hardware_concurrency(),
+                          size_type divisions_per_thread_ = 16)
+    : state(std::make_shared<shared_state>(max_threads_)),
+      divisions_per_thread(divisions_per_thread_ ? divisions_per_thread_ : 1) { }
+  //! Schedules a new task to be completed.
+  //! Each thread calls its own copy of the task,
+  //! once for each division that it claims.
+  //!
+  //! \tparam task_type The type of the task functor.
+  //! \tparam arg_types The arguments to pass to the task.
+  template <typename task_type, typename... arg_types>
+  void operator () (task_type task, arg_types... args) {
+
+    auto thread_count = state->pool.size();
+
+    auto division_count = thread_count * divisions_per_thread;
+
+    auto per_thread = divisions_per_thread;
+
+    auto* ranges = state->ranges.get();
+
+    // The ranges are handed out before any thread starts, so that
+    // the divisions of a thread that wakes up late can be stolen.
+
+    for (size_type i = 0; i < thread_count; i++) {
+      ranges[i].reset(i * per_thread, (i + 1) * per_thread);
+    }
+
+    auto job = [&task, &args..., ranges, thread_count, division_count](size_type thread_index) {
+
+      task_type thread_task(task);
+
+      auto& own_range = ranges[thread_index];
+
+      for (;;) {
+
+        size_type index = 0;
+
+        while (own_range.pop(index)) {
+          thread_task(work_division { index, division_count, thread_index }, args...);
+        }
+
+        size_type begin = 0;
+        size_type end = 0;
+
+        bool stolen = false;
+
+        for (size_type i = 1; (i < thread_count) && !stolen; i++) {
+          stolen = ranges[(thread_index + i) % thread_count].steal(begin, end);
+        }
+
+        if (!stolen) {
+          break;
+        }
+
+        own_range.reset(begin, end);
+      }
+    };
+
+    state->pool.run(job);
+  }
+  //! Indicates to the library the maximum number of threads
+  //! that may be invoked at a time.
+  //!
+  //! \return The max number of threads that may be invoked at a time.
+  inline size_type max_threads() const noexcept {
+    return state->pool.size();
+  }
+};
+
 //! A type definition that uses the
-//! naive thread scheduler.
-using default_scheduler = naive_thread_scheduler;
+//! thread pool scheduler.
+using default_scheduler = thread_pool_scheduler;
 
 #else // LBVH_NO_THREADS
 
@@ -205,6 +802,9 @@ struct aabb final {
 //! An internal node within the BVH.
 //! Points to two other nodes, which
 //! may either be leaf nodes or other internal nodes.
+//! Since a leaf keeps its primitive count next to its first primitive
+//! index, a BVH holds at most two to the power of @ref leaf_index_bits
+//! primitives, whatever the leaf size it was built with.
 //!
 //! \tparam scalar_type The type used for the bounding
 //! box vectors of the node.
@@ -217,29 +817,79 @@ struct alignas(sizeof(scalar_type) * 8) node final {
   //! The index to the left node.
   //! The highest bit may be set to
   //! one if this is suppose to point to a leaf.
+  //! A leaf points to a range of consecutive primitives,
+  //! given by its leaf index and its leaf count.
   index_type left;
   //! The index to the right node.
   index_type right;
-  //! The highest bit may be set to
-  //! one if this is suppose to point to a leaf.
+  //! The number of bits used to store the primitive count of a leaf.
+  static constexpr index_type leaf_count_bits() noexcept {
+    return 4;
+  }
+  //! The number of bits used to store the first primitive index of a leaf.
+  //! This limits the number of primitives a BVH can have to two to the power
+  //! of this value, which is 27 for single precision and 59 for double precision.
+  static constexpr index_type leaf_index_bits() noexcept {
+    return index_type((sizeof(index_type) * 8) - 1 - leaf_count_bits());
+  }
+  //! The maximum number of primitives that a leaf may point to.
+  static constexpr size_type max_leaf_size() noexcept {
+    return size_type(1) << leaf_count_bits();
+  }
+  //! Makes a child index that points to a leaf.
+  //!
+  //! \param first The index of the first primitive in the leaf.
+  //!
+  //! \param count The number of primitives in the leaf.
+  //! This must be between one and @ref max_leaf_size.
+  //!
+  //! \return The child index, with the highest bit set.
+  static constexpr index_type make_leaf(size_type first, size_type count = 1) noexcept {
+    return index_type(highest_bit<index_type>() | ((count - 1) << leaf_index_bits()) | first);
+  }
+  //! Indicates if a child index points to a leaf.
+  static constexpr bool is_leaf(index_type child) noexcept {
+    return child & highest_bit<index_type>();
+  }
+  //! Gets the index of the first primitive in a leaf from its child index.
+  static constexpr index_type leaf_index(index_type child) noexcept {
+    return child & ((index_type(1) << leaf_index_bits()) - 1);
+  }
+  //! Gets the number of primitives in a leaf from its child index.
+  static constexpr index_type leaf_count(index_type child) noexcept {
+    return ((child >> leaf_index_bits()) & index_type(max_leaf_size() - 1)) + 1;
+  }
   //! Accesses the left index as a leaf index.
+  //! This is the index of the first primitive in the leaf.
   inline constexpr index_type left_leaf_index() const noexcept {
-    return left & (highest_bit<index_type>() - 1);
+    return leaf_index(left);
   }
   //! Accesses the right index as a leaf index.
+  //! This is the index of the first primitive in the leaf.
   inline constexpr index_type right_leaf_index() const noexcept {
-    return right & (highest_bit<index_type>() - 1);
+    return leaf_index(right);
+  }
+  //! Accesses the number of primitives in the left leaf.
+  inline constexpr index_type left_leaf_count() const noexcept {
+    return leaf_count(left);
+  }
+  //! Accesses the number of primitives in the right leaf.
+  inline constexpr index_type right_leaf_count() const noexcept {
+    return leaf_count(right);
   }
   //! Indicates if the left index points to a leaf.
   inline constexpr bool left_is_leaf() const noexcept {
-    return left & highest_bit<index_type>();
+    return is_leaf(left);
   }
   //! Indicates if the right index points to a leaf.
   inline constexpr bool right_is_leaf() const noexcept {
-    return right & highest_bit<index_type>();
+    return is_leaf(right);
   }
 };
 
+template <typename scalar_type, typename task_scheduler>
+class builder;
+
 //! This is the structure for the LBVH.
 //! \tparam float_type The floating point type used for box vectors.
 template <typename float_type>
@@ -248,9 +898,35 @@ public:
   //! A type definition for BVH nodes.
   using node_type = node<float_type>;
   //! A type definition for a BVH node vector.
-  using node_vec = std::vector<node_type>;
+  using node_vec = pmr::vector<node_type>;
+  //! A type definition for a primitive index.
+  using index_type = typename node_type::index_type;
+  //! A type definition for a vector of primitive indices.
+  using index_vec = pmr::vector<index_type>;
+  //! Constructs an empty BVH, which can be
+  //! built into with @ref builder::rebuild.
+  bvh() = default;
+  //! Constructs an empty BVH that allocates its memory from a resource.
+  //!
+  //! \param resource The memory resource for the nodes and primitive indices.
+  explicit bvh(pmr::memory_resource* resource)
+    : nodes(resource), prim_indices(resource) {}
   //! Constructs a BVH from prebuilt internal nodes.
   bvh(node_vec&& nodes_) : nodes(std::move(nodes_)) {}
+  //! Constructs a BVH from prebuilt internal nodes
+  //! and the order of the primitives along the curve.
+  bvh(node_vec&& nodes_, index_vec&& primitive_indices_)
+    : nodes(std::move(nodes_)), prim_indices(std::move(primitive_indices_)) {}
+  //! Constructs a BVH from prebuilt internal nodes kept in a @c std::vector.
+  //! The nodes are copied into the default memory resource, since a
+  //! polymorphic vector can't take over the memory of a @c std::vector.
+  bvh(const std::vector<node_type>& nodes_)
+    : nodes(nodes_.begin(), nodes_.end()) {}
+  //! Constructs a BVH from prebuilt internal nodes and the order of the
+  //! primitives along the curve, both kept in a @c std::vector.
+  //! Both are copied into the default memory resource.
+  bvh(const std::vector<node_type>& nodes_, const std::vector<index_type>& primitive_indices_)
+    : nodes(nodes_.begin(), nodes_.end()), prim_indices(primitive_indices_.begin(), primitive_indices_.end()) {}
   //! Accesses the beginning iterator.
   inline auto begin() const noexcept { return nodes.begin(); }
   //! Accesses the ending iterator.
@@ -276,36 +952,603 @@ public:
   inline const node_type& operator [] (size_type index) const noexcept {
     return nodes[index];
   }
+  //! Accesses the sorted-to-original primitive permutation.
+  //! Entry @p i is the index, in the array passed to the builder,
+  //! of the @p i th primitive along the Morton curve.
+  //!
+  //! If the builder reordered the primitives, the leaves point into the
+  //! reordered array and this maps them back to the original array.
+  //! Otherwise, the leaves already point into the original array.
+  //!
+  //! \return The primitive permutation, one index per primitive.
+  inline const index_vec& primitive_indices() const noexcept {
+    return prim_indices;
+  }
 private:
+  //! The builder refits the nodes in place.
+  template <typename, typename>
+  friend class builder;
   //! The internal nodes of the BVH.
   node_vec nodes;
+  //! The original index of each primitive, in curve order.
+  index_vec prim_indices;
 };
 
-//! \brief This class is used for the constructing of BVHs.
-//! It is meant to be the first class declared by anyone using the library.
-//! It takes a set of primitives, as well as a function object to calculate their bounding boxes,
-//! and generates an LBVH from them. The only function required to be implemented is the function
-//! object that converts primitives to bounding boxes.
+//! \brief A read-only view of the nodes and primitive permutation of a BVH.
+//! The memory is owned by something else, such as a @ref bvh or a @ref mapped_bvh.
+//! This is what the traversers work with, so a BVH can be traversed from either.
 //!
-//! \tparam scalar_type The scalar type to use for the box vectors.
-//!
-//! \tparam task_scheduler The scheduler type to use for construction tasks.
-//! By default, this is the type of scheduler provided by the library.
-template <typename scalar_type, typename task_scheduler = default_scheduler>
-class builder final {
-  //! Is passed the various work items during BVH construction.
-  task_scheduler scheduler;
+//! \tparam scalar_type The floating point type used for box vectors.
+template <typename scalar_type>
+class bvh_view final {
 public:
-  //! A type definition for a BVH.
-  using bvh_type = bvh<scalar_type>;
-  //! A type definition for a BVH node.
+  //! A type definition for BVH nodes.
   using node_type = node<scalar_type>;
-  //! A type definition for a node vector.
+  //! A type definition for a primitive index.
+  using index_type = typename node_type::index_type;
+  //! Constructs an empty view.
+  constexpr bvh_view() noexcept = default;
+  //! Constructs a view of a BVH.
+  //!
+  //! \param b The BVH to view. It must outlive the view.
+  bvh_view(const bvh<scalar_type>& b) noexcept
+    : nodes(b.size() ? &b[0] : nullptr),
+      node_count(b.size()),
+      prim_indices(b.primitive_indices().data()),
+      prim_count(b.primitive_indices().size()) {}
+  //! Constructs a view over the arrays of a BVH.
+  //!
+  //! \param n The nodes of the BVH, the first being the root.
+  //!
+  //! \param n_count The number of nodes.
+  //!
+  //! \param i The primitive permutation, see @ref bvh::primitive_indices.
+  //!
+  //! \param i_count The number of primitive indices.
+  constexpr bvh_view(const node_type* n, size_type n_count, const index_type* i, size_type i_count) noexcept
+    : nodes(n), node_count(n_count), prim_indices(i), prim_count(i_count) {}
+  //! Accesses the beginning iterator.
+  inline const node_type* begin() const noexcept { return nodes; }
+  //! Accesses the ending iterator.
+  inline const node_type* end() const noexcept { return nodes + node_count; }
+  //! Indicates the number of internal nodes in the BVH.
+  inline size_type size() const noexcept { return node_count; }
+  //! Accesses a node within the BVH, without bounds checking.
+  //!
+  //! \param index The index of the node to access.
+  inline const node_type& operator [] (size_type index) const noexcept {
+    return nodes[index];
+  }
+  //! Accesses the primitive permutation.
+  //! There are @ref primitive_count entries.
+  inline const index_type* primitive_indices() const noexcept {
+    return prim_indices;
+  }
+  //! Indicates the number of entries in the primitive permutation.
+  inline size_type primitive_count() const noexcept {
+    return prim_count;
+  }
+private:
+  //! The nodes of the BVH.
+  const node_type* nodes = nullptr;
+  //! The number of nodes.
+  size_type node_count = 0;
+  //! The primitive permutation.
+  const index_type* prim_indices = nullptr;
+  //! The number of entries in the primitive permutation.
+  size_type prim_count = 0;
+};
+
+//! \brief Writes a BVH to a file that can be mapped into memory with @ref mapped_bvh.
+//! The file starts with a versioned header, followed by the nodes and the
+//! primitive permutation exactly as they're laid out in memory. Each array is
+//! aligned to 64 bytes and every value is little endian. Writing fails on
+//! machines that aren't little endian.
+//!
+//! \param b The BVH to write.
+//!
+//! \param path The path of the file to write.
+//!
+//! \return True on success, false on failure.
+template <typename scalar_type>
+bool save(const bvh<scalar_type>& b, const char* path);
+
+#ifndef LBVH_NO_MMAP
+
+//! \brief A BVH that was written with @ref save and is mapped into memory.
+//! Nothing is copied or parsed when the file is opened, and since the
+//! mapping is read-only, processes that open the same file share its pages.
+//! This isn't available if LBVH_NO_MMAP is defined.
+//!
+//! \tparam scalar_type The floating point type used for box vectors.
+//! It must be the same type that the file was written with.
+template <typename scalar_type>
+class mapped_bvh final {
+public:
+  //! Constructs an object with no file opened.
+  mapped_bvh() noexcept = default;
+  //! Closes the file, if one is open.
+  ~mapped_bvh() { close(); }
+  //! Maps a BVH file into memory, closing the previous one.
+  //! The header is checked against the scalar type and the
+  //! sizes of the arrays are checked against the file size.
+  //!
+  //! \param path The path of the file to open.
+  //!
+  //! \return True on success, false on failure.
+  bool open(const char* path);
+  //! Unmaps the file. Views made before this become invalid.
+  void close() noexcept;
+  //! Accesses a view of the mapped BVH.
+  //! If no file is open, the view is empty.
+  inline bvh_view<scalar_type> view() const noexcept {
+    return view_;
+  }
+
+  mapped_bvh(const mapped_bvh&) = delete;
+  mapped_bvh& operator = (const mapped_bvh&) = delete;
+private:
+  //! The view of the mapped arrays.
+  bvh_view<scalar_type> view_;
+  //! The address of the mapping.
+  void* data = nullptr;
+  //! The size of the mapping, in bytes.
+  size_type data_size = 0;
+};
+
+#endif // LBVH_NO_MMAP
+
+//! \brief A node of a @ref wide_bvh.
+//! The boxes of the children are kept in the node, in structure
+//! of arrays layout, so that they can all be tested at once.
+//! Nodes with two children are aligned to a cache line, so that
+//! each step of a traversal loads one line, or two with doubles.
+//!
+//! \tparam scalar_type The type used for the bounding box vectors.
+//!
+//! \tparam width The maximum number of children of the node.
+template <typename scalar_type, size_type width>
+struct alignas((width == 2) ? 64 : sizeof(scalar_type) * width) wide_node final {
+  //! The type definition for a child index.
+  //! Leaves are encoded the same way as in @ref node.
+  using index_type = typename node<scalar_type>::index_type;
+  //! The minimum X coordinate of each child box.
+  scalar_type min_x[width];
+  //! The minimum Y coordinate of each child box.
+  scalar_type min_y[width];
+  //! The minimum Z coordinate of each child box.
+  scalar_type min_z[width];
+  //! The maximum X coordinate of each child box.
+  scalar_type max_x[width];
+  //! The maximum Y coordinate of each child box.
+  scalar_type max_y[width];
+  //! The maximum Z coordinate of each child box.
+  scalar_type max_z[width];
+  //! The index of each child. Unused slots
+  //! are set to @ref empty_child and have empty boxes.
+  index_type children[width];
+  //! The child index given to unused slots.
+  static constexpr index_type empty_child() noexcept {
+    return std::numeric_limits<index_type>::max();
+  }
+  //! Accesses the box of a child.
+  //!
+  //! \param i The slot of the child.
+  aabb<scalar_type> box(size_type i) const noexcept {
+    return aabb<scalar_type> {
+      { min_x[i], min_y[i], min_z[i] },
+      { max_x[i], max_y[i], max_z[i] }
+    };
+  }
+  //! Assigns the box of a child.
+  //!
+  //! \param i The slot of the child.
+  //!
+  //! \param b The box to assign.
+  void set_box(size_type i, const aabb<scalar_type>& b) noexcept {
+    min_x[i] = b.min.x;
+    min_y[i] = b.min.y;
+    min_z[i] = b.min.z;
+    max_x[i] = b.max.x;
+    max_y[i] = b.max.y;
+    max_z[i] = b.max.z;
+  }
+};
+
+//! \brief A BVH with four or eight children per node.
+//! It's made by collapsing the levels of a binary @ref bvh,
+//! and traversed with a @ref wide_traverser. Wide nodes
+//! let the traverser test several child boxes at once.
+//!
+//! With a width of two, this is the binary BVH with the boxes of
+//! the children stored in their parent. The traverser then decides
+//! where to go next from a single node, instead of loading the two
+//! children, and leaves are only visited when their box is hit.
+//!
+//! \tparam scalar_type The type used for the bounding box vectors.
+//!
+//! \tparam width The maximum number of children per node.
+template <typename scalar_type, size_type width>
+class wide_bvh final {
+public:
+  static_assert((width >= 2) && (width <= 32), "The node width must be between 2 and 32.");
+  //! A type definition for a wide node.
+  using node_type = wide_node<scalar_type, width>;
+  //! A type definition for a wide node vector.
+  using node_vec = std::vector<node_type>;
+  //! A type definition for a primitive index.
+  using index_type = typename node_type::index_type;
+  //! A type definition for a vector of primitive indices.
+  using index_vec = std::vector<index_type>;
+  //! Converts a binary BVH into a wide one.
+  //! Each wide node takes the place of a binary node and repeatedly
+  //! opens the child with the largest surface area until it has
+  //! @p width children. The leaves keep pointing to the same primitives.
+  //!
+  //! \param b The binary BVH to convert.
+  //!
+  //! \param primitives The primitives that the leaves point to.
+  //! They're needed for the boxes of the leaves, which the binary BVH doesn't store.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  template <typename primitive, typename aabb_converter>
+  wide_bvh(const bvh<scalar_type>& b, const primitive* primitives, const aabb_converter& converter);
+  //! Indicates the number of nodes in the BVH.
+  inline auto size() const noexcept { return nodes.size(); }
+  //! Accesses a node within the BVH, without bounds checking.
+  //!
+  //! \param index The index of the node to access.
+  inline const node_type& operator [] (size_type index) const noexcept {
+    return nodes[index];
+  }
+  //! Accesses the sorted-to-original primitive permutation.
+  //! This is copied from the binary BVH, see @ref bvh::primitive_indices.
+  inline const index_vec& primitive_indices() const noexcept {
+    return prim_indices;
+  }
+private:
+  //! The nodes of the BVH, the first being the root.
+  node_vec nodes;
+  //! The original index of each primitive, in curve order.
+  index_vec prim_indices;
+};
+
+//! \brief A compressed node of a @ref quantized_bvh.
+//! The child boxes are stored as small integers on a grid that spans
+//! the box of the node. The grid spacing of each axis is a power of two,
+//! so a child box is decoded with one multiply and one add per coordinate,
+//! and the decoded boxes always enclose the original ones.
+//!
+//! The children aren't stored as full indices either. The internal children
+//! of a node are stored next to each other, as are the primitives of its
+//! leaves, so the node only keeps where each of them starts and one byte
+//! per child that tells what the child is.
+//!
+//! \tparam scalar_type The type used for the bounding box vectors.
+//!
+//! \tparam width The maximum number of children of the node.
+//!
+//! \tparam quant_type The unsigned integer type of a quantized coordinate.
+template <typename scalar_type, size_type width, typename quant_type = std::uint8_t>
+struct quantized_node final {
+  static_assert(std::is_unsigned<quant_type>::value && (sizeof(quant_type) <= 2),
+                "Quantized coordinates must be 8 or 16 bit unsigned integers.");
+  //! The type definition for a child index.
+  //! Leaves are encoded the same way as in @ref node.
+  using index_type = typename node<scalar_type>::index_type;
+  //! A type definition for a decoded node.
+  using wide_node_type = wide_node<scalar_type, width>;
+  //! The minimum corner of the grid.
+  scalar_type origin[3];
+  //! The index of the first internal child. The internal children
+  //! follow each other in the order of their slots.
+  index_type child_base;
+  //! The first leaf slot of the node, see @ref quantized_bvh::leaf_primitives.
+  //! The primitives of the leaves follow each other in the order of their slots.
+  index_type leaf_base;
+  //! The power of two exponent of the grid spacing, for each axis.
+  std::int8_t exponent[3];
+  //! What each slot holds, see @ref empty_meta, @ref internal_meta and @ref leaf_meta.
+  std::uint8_t meta[width];
+  //! The quantized minimum X coordinate of each child box.
+  quant_type min_x[width];
+  //! The quantized minimum Y coordinate of each child box.
+  quant_type min_y[width];
+  //! The quantized minimum Z coordinate of each child box.
+  quant_type min_z[width];
+  //! The quantized maximum X coordinate of each child box.
+  quant_type max_x[width];
+  //! The quantized maximum Y coordinate of each child box.
+  quant_type max_y[width];
+  //! The quantized maximum Z coordinate of each child box.
+  quant_type max_z[width];
+  //! The largest quantized coordinate.
+  static constexpr quant_type max_quant() noexcept {
+    return std::numeric_limits<quant_type>::max();
+  }
+  //! The meta value of an unused slot.
+  static constexpr std::uint8_t empty_meta() noexcept {
+    return 0;
+  }
+  //! The meta value of a slot that holds an internal node.
+  static constexpr std::uint8_t internal_meta() noexcept {
+    return 1;
+  }
+  //! The meta value of a slot that holds a leaf.
+  //!
+  //! \param count The number of primitives in the leaf.
+  static constexpr std::uint8_t leaf_meta(size_type count) noexcept {
+    return std::uint8_t(0x80 | (count - 1));
+  }
+  //! Quantizes the child boxes of a wide node.
+  //! Minimum coordinates are rounded down and maximum coordinates are
+  //! rounded up, so that the decoded boxes never miss a primitive.
+  //!
+  //! The grid spacing is kept within the range of single precision
+  //! exponents, so a node must span less than 2^127 along each axis.
+  //!
+  //! \param n The node to quantize. Only the kind of each child and
+  //! the primitive count of each leaf are kept.
+  //!
+  //! \param child_base The index that the first internal child is moved to.
+  //!
+  //! \param leaf_base The leaf slot that the first primitive of the leaves is moved to.
+  static quantized_node encode(const wide_node_type& n, index_type child_base, index_type leaf_base) noexcept;
+  //! Decodes the child boxes and child indices of the node.
+  //!
+  //! \return A wide node with the decoded boxes. Internal children get
+  //! their node index and leaves point to their leaf slots.
+  //! Unused slots get empty boxes.
+  wide_node_type decode() const noexcept;
+};
+
+//! \brief A @ref wide_bvh with quantized child boxes.
+//! Each node takes up a fraction of the size of a @ref wide_node,
+//! which lets more of a large tree stay in the cache during traversal.
+//! It's traversed with a @ref quantized_traverser.
+//!
+//! The nodes are laid out breadth first, so that the internal children of
+//! each node follow each other, and the leaves point into an array of leaf
+//! slots instead of the primitives, so that the primitives of the leaves of
+//! each node follow each other as well.
+//!
+//! \tparam scalar_type The type used for the bounding box vectors.
+//!
+//! \tparam width The maximum number of children per node.
+//!
+//! \tparam quant_type The unsigned integer type of a quantized coordinate.
+template <typename scalar_type, size_type width, typename quant_type = std::uint8_t>
+class quantized_bvh final {
+public:
+  //! A type definition for a quantized node.
+  using node_type = quantized_node<scalar_type, width, quant_type>;
+  //! A type definition for a quantized node vector.
   using node_vec = std::vector<node_type>;
+  //! A type definition for a primitive index.
+  using index_type = typename node_type::index_type;
+  //! A type definition for a vector of primitive indices.
+  using index_vec = std::vector<index_type>;
+  //! Quantizes the nodes of a wide BVH.
+  //!
+  //! \param b The wide BVH to quantize. The root keeps index zero,
+  //! but the other nodes and the leaves are moved around.
+  quantized_bvh(const wide_bvh<scalar_type, width>& b);
+  //! Indicates the number of nodes in the BVH.
+  inline auto size() const noexcept { return nodes.size(); }
+  //! Accesses a node within the BVH, without bounds checking.
+  //!
+  //! \param index The index of the node to access.
+  inline const node_type& operator [] (size_type index) const noexcept {
+    return nodes[index];
+  }
+  //! Accesses the sorted-to-original primitive permutation.
+  //! This is copied from the wide BVH, see @ref bvh::primitive_indices.
+  inline const index_vec& primitive_indices() const noexcept {
+    return prim_indices;
+  }
+  //! Accesses the primitive of each leaf slot. This is the index that
+  //! the wide BVH leaf pointed to, in the array passed to the traverser.
+  inline const index_vec& leaf_primitives() const noexcept {
+    return leaf_prims;
+  }
+private:
+  //! The nodes of the BVH, the first being the root.
+  node_vec nodes;
+  //! The original index of each primitive, in curve order.
+  index_vec prim_indices;
+  //! The primitive of each leaf slot.
+  index_vec leaf_prims;
+};
+
+//! \brief An affine transformation, stored as
+//! the top three rows of a 4x4 matrix.
+//!
+//! \tparam scalar_type The type of the matrix elements.
+template <typename scalar_type>
+struct transform final {
+  //! The rows of the matrix. The first three columns are the
+  //! linear part and the last column is the translation.
+  scalar_type m[3][4];
+  //! Creates a transformation that leaves points where they are.
+  static constexpr transform identity() noexcept {
+    return transform {
+      {
+        { 1, 0, 0, 0 },
+        { 0, 1, 0, 0 },
+        { 0, 0, 1, 0 }
+      }
+    };
+  }
+};
+
+//! \brief An instance of a BVH, placed into the scene with a transformation.
+//! A top level BVH is built over instances by passing them to a @ref builder,
+//! and it's traversed with an @ref instance_traverser. Many instances may share
+//! the same BVH, so that large scenes don't need a copy of each object.
+//!
+//! \tparam scalar_type The type used for the bounding box vectors.
+//!
+//! \tparam primitive_type The type of the primitives in the instanced BVH.
+template <typename scalar_type, typename primitive_type>
+struct instance final {
+  //! Moves the instanced BVH from its own space into the scene.
+  //! The linear part must be invertible.
+  transform<scalar_type> object_to_world;
+  //! The instanced BVH. It must have at least one node.
+  const bvh<scalar_type>* blas;
+  //! The primitives that the leaves of the instanced BVH point to.
+  const primitive_type* primitives;
+};
+
+//! \brief The algorithms that a @ref builder can use
+//! to turn the sorted Morton curve into a tree.
+enum class build_method {
+  //! Builds a radix tree over the Morton codes, as described by Karras.
+  //! This is the fastest method, but it ignores the size of the primitives.
+  radix_tree,
+  //! Parallel locally-ordered clustering, as described by Meister and Bittner.
+  //! Starting with one cluster per primitive in Morton order, each cluster looks
+  //! for the neighbor within @ref build_options::search_radius that it makes the
+  //! smallest box with, and mutual neighbors are merged, until one cluster remains.
+  //! This takes longer than the radix tree but gives trees of much better quality.
+  ploc,
+  //! Groups the primitives into clusters by the leading bits of their Morton codes,
+  //! as in HLBVH by Garanzha et al. The radix tree is kept inside of each cluster,
+  //! while the levels above the clusters are rebuilt with a binned surface area
+  //! heuristic. See @ref build_options::cluster_levels.
+  hybrid
+};
+
+//! \brief The orders that a @ref builder can store the nodes of a BVH in.
+//! The root is always the first node, and the topology of the tree
+//! stays the same. Only the positions of the nodes in memory change.
+enum class node_layout {
+  //! The nodes stay where the build method puts them. For a radix tree,
+  //! that's the position of the split in the Morton curve, which can put
+  //! a parent and its children far apart.
+  build_order,
+  //! The nodes are stored in depth first order, so that the left child of
+  //! a node comes right after it and each subtree takes up a contiguous range.
+  depth_first,
+  //! The nodes are stored in the cache oblivious van Emde Boas order. The tree
+  //! is cut at half of its height, the top half is laid out recursively and then
+  //! each of the subtrees below it. A walk from the root to a leaf then touches
+  //! fewer cache lines and pages, for any cache size.
+  van_emde_boas
+};
+
+//! \brief Contains the options used to build a BVH.
+//! The default options give a plain LBVH build.
+struct build_options final {
+  //! The algorithm used to build the tree from the sorted Morton curve.
+  build_method method = build_method::radix_tree;
+  //! How many clusters away along the Morton curve a cluster
+  //! looks for its nearest neighbor, when using @ref build_method::ploc.
+  size_type search_radius = 16;
+  //! The number of Morton levels, three bits each, that primitives must share
+  //! to be in the same cluster, when using @ref build_method::hybrid. The default
+  //! gives up to 32768 clusters.
+  size_type cluster_levels = 5;
+  //! Whether or not the bounding box of each primitive is computed
+  //! once, in the same pass as the centroid bounds, and kept for the
+  //! rest of the build. This calls the box converter once per primitive
+  //! instead of three times, at the cost of one box of memory per primitive.
+  bool cache_boxes = false;
+  //! Whether or not the primitives are moved into Morton order
+  //! when they are passed to the builder as a non-const array.
+  //! The leaves then point to consecutive primitives, which makes
+  //! traversal more cache friendly. The original index of each primitive
+  //! is kept in @ref bvh::primitive_indices. The primitive type must be
+  //! default constructible and copy assignable.
+  bool reorder_primitives = false;
+  //! The maximum number of primitives per leaf. When this is greater than
+  //! one, subtrees are collapsed into leaves that hold a range of primitives
+  //! wherever the surface area heuristic says it pays off. This only applies
+  //! when the primitives are reordered, since a leaf range has to point to
+  //! consecutive primitives. It may be at most @ref node::max_leaf_size.
+  size_type max_leaf_size = 1;
+  //! The cost of traversing a node, as used by the surface area heuristic.
+  float traversal_cost = 1;
+  //! The cost of intersecting a primitive, as used by the surface area heuristic.
+  float intersection_cost = 1;
+  //! The number of treelet restructuring passes to run after the tree is built.
+  //! Each pass visits the nodes from the bottom up, takes the seven leaves of
+  //! the treelet below a node and replaces its topology with the one that has
+  //! the lowest surface area heuristic cost. Later passes only restructure
+  //! larger subtrees. This makes the build slower and the traversal faster,
+  //! so it's mostly worth it for static scenes. Zero disables it.
+  size_type optimization_passes = 0;
+  //! The order that the nodes are stored in once the tree is built.
+  //! This is done last, after the nodes are collapsed or restructured.
+  node_layout layout = node_layout::build_order;
+};
+
+namespace detail {
+
+template <typename scalar_type>
+struct subtree_info;
+
+template <typename code_type>
+class space_filling_curve;
+
+template <typename scalar_type>
+struct build_scratch;
+
+} // namespace detail
+
+//! \brief This class is used for the constructing of BVHs.
+//! It is meant to be the first class declared by anyone using the library.
+//! It takes a set of primitives, as well as a function object to calculate their bounding boxes,
+//! and generates an LBVH from them. The only function required to be implemented is the function
+//! object that converts primitives to bounding boxes.
+//!
+//! A BVH may have at most two to the power of @ref node::leaf_index_bits primitives, which is
+//! 2^27 for single precision and 2^59 for double precision. Building one with more primitives
+//! throws std::length_error before any of the primitives are read.
+//!
+//! \tparam scalar_type The scalar type to use for the box vectors.
+//!
+//! \tparam task_scheduler The scheduler type to use for construction tasks.
+//! By default, this is the type of scheduler provided by the library.
+template <typename scalar_type, typename task_scheduler = default_scheduler>
+class builder final {
+  //! Is passed the various work items during BVH construction.
+  task_scheduler scheduler;
+  //! The options used to build each BVH.
+  build_options options;
+  //! The buffers kept from one build to the next.
+  detail::build_scratch<scalar_type> scratch;
+public:
+  //! A type definition for a BVH.
+  using bvh_type = bvh<scalar_type>;
+  //! A type definition for a bounding box.
+  using box_type = aabb<scalar_type>;
+  //! A type definition for a vector of bounding boxes.
+  using box_vec = pmr::vector<box_type>;
+  //! A type definition for a BVH node.
+  using node_type = node<scalar_type>;
+  //! A type definition for a node vector.
+  using node_vec = pmr::vector<node_type>;
+  //! A type definition for a node index.
+  using index_type = typename node_type::index_type;
+  //! A type definition for a vector of node indices.
+  using index_vec = pmr::vector<index_type>;
   //! Constructs a new BVH builder.
   //! \param scheduler_ The task scheduler to distribute the work with.
-  builder(task_scheduler scheduler_ = task_scheduler())
-    : scheduler(scheduler_) {}
+  //! \param resource The memory resource that everything allocated during a build
+  //! comes from, including the BVHs returned by the builder.
+  builder(task_scheduler scheduler_ = task_scheduler(),
+          pmr::memory_resource* resource = pmr::get_default_resource())
+    : scheduler(scheduler_), scratch(resource) {}
+  //! Constructs a new BVH builder.
+  //! \param options_ The options to build each BVH with.
+  //! \param scheduler_ The task scheduler to distribute the work with.
+  //! \param resource The memory resource that everything allocated during a build
+  //! comes from, including the BVHs returned by the builder.
+  builder(const build_options& options_,
+          task_scheduler scheduler_ = task_scheduler(),
+          pmr::memory_resource* resource = pmr::get_default_resource())
+    : scheduler(scheduler_), options(options_), scratch(resource) {}
   //! Builds a BVH from an array of primitives.
   //!
   //! \param primitives The array of primitives to build the BVH for.
@@ -320,10 +1563,222 @@ public:
   //! \return A BVH built for the specified primitives.
   template <typename primitive, typename aabb_converter>
   bvh_type operator () (const primitive* primitives, size_type count, const aabb_converter& converter);
+  //! Builds a BVH from an array of primitives that the builder may modify.
+  //! If @ref build_options::reorder_primitives is set, the primitives are
+  //! moved into Morton order and the leaves of the BVH point into the
+  //! reordered array. Otherwise, this is the same as the const overload.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \return A BVH built for the specified primitives.
+  template <typename primitive, typename aabb_converter>
+  bvh_type operator () (primitive* primitives, size_type count, const aabb_converter& converter);
+  //! Builds a BVH into an existing one, reusing the memory of its nodes.
+  //! Along with the buffers that the builder keeps between builds, this
+  //! avoids most of the allocations of a build when a scene of about the
+  //! same size is rebuilt every frame.
+  //!
+  //! \param b The BVH to build into. Its previous contents are replaced.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  template <typename primitive, typename aabb_converter>
+  void rebuild(bvh_type& b, const primitive* primitives, size_type count, const aabb_converter& converter);
+  //! Builds a BVH into an existing one, from primitives that the builder may
+  //! reorder. See the non-const overload of the call operator.
+  //!
+  //! \param b The BVH to build into. Its previous contents are replaced.
+  //!
+  //! \param primitives The array of primitives to build the BVH for.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  template <typename primitive, typename aabb_converter>
+  void rebuild(bvh_type& b, primitive* primitives, size_type count, const aabb_converter& converter);
+  //! Builds a BVH from the precomputed bounding boxes of a set of primitives.
+  //! The leaves of the BVH point to the primitives that the boxes belong to.
+  //!
+  //! \param boxes The bounding box of each primitive.
+  //!
+  //! \param count The number of boxes in the box array.
+  //!
+  //! \return A BVH built for the specified boxes.
+  bvh_type operator () (const box_type* boxes, size_type count);
+  //! Builds a top level BVH over a set of instances.
+  //! Each instance is bounded by the root box of its BVH, moved into
+  //! the scene, and the leaves of the result point to the instances.
+  //!
+  //! \param instances The array of instances to build the BVH for.
+  //!
+  //! \param count The number of instances in the instance array.
+  //!
+  //! \return A BVH built for the specified instances.
+  template <typename primitive>
+  bvh_type operator () (const instance<scalar_type, primitive>* instances, size_type count);
+  //! Recomputes the boxes of a BVH after its primitives have moved,
+  //! keeping its topology. This is much cheaper than a rebuild,
+  //! but the quality of the tree drops if the primitives move a lot.
+  //!
+  //! \param b The BVH to refit. It must have been built by a builder.
+  //!
+  //! \param primitives The primitives that the leaves point to.
+  //! If the BVH was built with reordered primitives, this is the reordered array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  template <typename primitive, typename aabb_converter>
+  void refit(bvh_type& b, const primitive* primitives, const aabb_converter& converter);
+  //! Recomputes the boxes of a BVH after some of its primitives have moved.
+  //! Only the ancestors of the changed primitives are refitted.
+  //!
+  //! \param b The BVH to refit. It may have been built by a builder
+  //! or constructed from its nodes, without a primitive permutation.
+  //!
+  //! \param primitives The primitives that the leaves point to.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \param changed The indices of the primitives that have moved,
+  //! in the same array that the leaves point to.
+  //!
+  //! \param changed_count The number of indices in the changed array.
+  template <typename primitive, typename aabb_converter>
+  void refit(bvh_type& b, const primitive* primitives, const aabb_converter& converter, const index_type* changed, size_type changed_count);
 protected:
+  //! Builds a BVH once the centroid bounds are known.
+  //!
+  //! \param out The BVH to build into.
+  //!
+  //! \param centroid_bounds The box containing the center of every primitive box.
+  //!
+  //! \param reorder Called with the primitive permutation once the curve is sorted.
+  //! It returns true if it moved the primitives into that order, in which case the
+  //! leaves point to Morton order positions instead of original indices.
+  template <typename primitive, typename aabb_converter, typename reorder_func>
+  void build(bvh_type& out, const primitive* primitives, size_type count, const aabb_converter& converter, const box_type& centroid_bounds, reorder_func reorder);
+  //! Computes the bounding box of each primitive, along with the centroid bounds.
+  //!
+  //! \param boxes Receives the bounding box of each primitive.
+  //!
+  //! \return The box containing the center of every primitive box.
+  template <typename primitive, typename aabb_converter>
+  box_type cache_boxes(const primitive* primitives, size_type count, const aabb_converter& converter, box_vec& boxes);
+  //! Checks that a BVH can point to every primitive of a build.
+  //! Throws std::length_error if there are too many primitives.
+  //!
+  //! \param count The number of primitives to build the BVH for.
+  static void check_count(size_type count);
+  //! Passed to @ref build when the primitives can't be reordered.
+  //!
+  //! \return Always false.
+  static bool keep_order(const index_vec&) noexcept {
+    return false;
+  }
   //! Fits BVH nodes with their appropriate boxes.
+  //! This is done from the bottom up, in parallel.
+  //!
+  //! \param nodes The nodes to fit the boxes of.
+  //!
+  //! \param parents The index of the parent of each node.
+  //!
+  //! \param infos If not null, receives the subtree information
+  //! of each node for @ref collapse_subtrees.
+  template <typename primitive, typename aabb_converter>
+  void fit_boxes(node_vec& nodes, const index_vec& parents, const primitive* primitives, const aabb_converter& converter, detail::subtree_info<scalar_type>* infos = nullptr);
+  //! Restructures the treelets of the BVH to lower its surface area heuristic cost.
+  //! This also fits the boxes of the nodes, so @ref fit_boxes doesn't have to be called.
+  //!
+  //! \param nodes The nodes of the BVH.
+  //!
+  //! \param parents The index of the parent of each node, which is updated.
+  //!
+  //! \param infos Receives the subtree information of each node.
+  template <typename primitive, typename aabb_converter>
+  void optimize_treelets(node_vec& nodes, index_vec& parents, const primitive* primitives, const aabb_converter& converter, detail::subtree_info<scalar_type>* infos);
+  //! Moves the primitives into the order in which the leaves appear
+  //! in a depth first traversal, so that every subtree once again
+  //! covers a range of consecutive primitives.
+  //!
+  //! \param nodes The nodes of the BVH, which get their leaf indices updated.
+  //!
+  //! \param parents The index of the parent of each node.
+  //!
+  //! \param infos The subtree information of each node.
+  //! The index of the first primitive of each subtree is updated.
+  //!
+  //! \param primitive_indices The original index of each primitive, which is updated.
+  //!
+  //! \param reorder Moves the primitives into a new order.
+  template <typename reorder_func>
+  void reorder_leaves(node_vec& nodes, const index_vec& parents, pmr::vector<detail::subtree_info<scalar_type>>& infos, index_vec& primitive_indices, reorder_func& reorder);
+  //! Builds the nodes by clustering the primitives, as described by @ref build_method::ploc.
+  //! The boxes of the nodes are fitted along the way.
+  //!
+  //! \param nodes The node array to fill, already sized for the primitives.
+  //!
+  //! \param parents Receives the index of the parent of each node.
+  //!
+  //! \param leaf_indices The primitive index to give the leaf at each curve position.
+  //! If this is null, leaves are given their curve position.
   template <typename primitive, typename aabb_converter>
-  void fit_boxes(node_vec& nodes, const primitive* primitives, const aabb_converter& converter);
+  void cluster_nodes(node_vec& nodes, index_vec& parents, const primitive* primitives, const aabb_converter& converter, const index_type* leaf_indices);
+  //! Rebuilds the levels of a radix tree above the Morton clusters
+  //! with a binned surface area heuristic, as described by @ref build_method::hybrid.
+  //! The boxes of the tree must already be fitted, and the new nodes are fitted as well.
+  //!
+  //! \param nodes The nodes of the radix tree.
+  //!
+  //! \param parents The index of the parent of each node, which is updated.
+  //!
+  //! \param curve The sorted curve that the radix tree was built from.
+  template <typename code_type, typename primitive, typename aabb_converter>
+  void rebuild_top_levels(node_vec& nodes, index_vec& parents, const detail::space_filling_curve<code_type>& curve, const primitive* primitives, const aabb_converter& converter);
+  //! Calls a function object for each node from the bottom up, in parallel.
+  //! See @ref detail::bottom_up_kernel for the order the nodes are visited in.
+  //!
+  //! \param nodes The nodes to visit.
+  //!
+  //! \param parents The index of the parent of each node.
+  //!
+  //! \param visitor The function object to call with each node index.
+  template <typename visitor_type>
+  void visit_bottom_up(const node_vec& nodes, const index_vec& parents, const visitor_type& visitor);
+  //! Calls a function object for some of the nodes from the bottom up, in parallel.
+  //!
+  //! \param parents The index of the parent of each node.
+  //!
+  //! \param child_counts The number of children of each node that are visited.
+  //! Nodes that aren't visited at all are given @ref detail::unvisited_node.
+  //!
+  //! \param visitor The function object to call with each node index.
+  template <typename visitor_type>
+  void visit_bottom_up(const index_vec& parents, const pmr::vector<std::uint8_t>& child_counts, const visitor_type& visitor);
+  //! Finds the parent of each node.
+  //!
+  //! \param nodes The nodes to find the parents of.
+  //!
+  //! \return The index of the parent of each node.
+  index_vec find_parents(const node_vec& nodes);
+  //! Turns the subtrees that are cheaper as a leaf into leaves
+  //! and removes the nodes that were inside of them.
+  //!
+  //! \param nodes The nodes of the BVH.
+  //!
+  //! \param parents The index of the parent of each node.
+  //!
+  //! \param infos The subtree information of each node, from @ref fit_boxes.
+  void collapse_subtrees(node_vec& nodes, const index_vec& parents, pmr::vector<detail::subtree_info<scalar_type>>& infos);
+  //! Moves the nodes into the order given by @ref build_options::layout.
+  //!
+  //! \param nodes The nodes of the BVH.
+  void lay_out_nodes(node_vec& nodes);
 };
 
 //! \brief This structure contains basic information
@@ -377,6 +1832,12 @@ struct ray final {
   //! The direction at which the ray is pointing at.
   //! Usually, this is not normalized.
   vec_type dir;
+  //! The distance along the ray at which hits start to count.
+  //! Distances are in units of the direction vector.
+  scalar_type tmin = 0;
+  //! The distance along the ray at which hits stop counting.
+  //! Boxes that are entered beyond this distance are skipped.
+  scalar_type tmax = std::numeric_limits<scalar_type>::infinity();
 };
 
 //! \brief Represents a single ray with
@@ -449,6 +1910,8 @@ struct vec_packet final {
 //! A packet of rays can be traversed faster than
 //! one ray at a time because it leads to better
 //! caching, auto-vectorization, and better coherency.
+//! Every array is value-initialized, so a packet that
+//! isn't filled up has zeros in its unused slots.
 //!
 //! \tparam scalar_type The type to use for vector components.
 //!
@@ -463,12 +1926,46 @@ struct ray_packet final {
   vec_packet<scalar_type, 3, count> dir;
   //! The reciprocal direction vectors.
   vec_packet<scalar_type, 3, count> rcp_dir;
+  //! The distance at which hits start to count, for each ray.
+  scalar_type tmin[count] {};
+  //! The distance at which hits stop counting, for each ray.
+  scalar_type tmax[count] {};
   //! These are the indices that each ray corresponds to.
   //! Since a ray packet may be sorted multiple times
   //! throughout a BVH traversal, tracking their original
   //! indices allows them to be reordered after a BVH
   //! node is exited.
-  index_type indices[count];
+  index_type indices[count] {};
+  //! Puts a ray into the packet, along with its reciprocal direction.
+  //!
+  //! \param i The slot to put the ray into.
+  //!
+  //! \param r The ray to put into the packet.
+  void set(size_type i, const ray<scalar_type>& r) noexcept {
+    pos[0][i] = r.pos.x;
+    pos[1][i] = r.pos.y;
+    pos[2][i] = r.pos.z;
+    dir[0][i] = r.dir.x;
+    dir[1][i] = r.dir.y;
+    dir[2][i] = r.dir.z;
+    rcp_dir[0][i] = 1 / r.dir.x;
+    rcp_dir[1][i] = 1 / r.dir.y;
+    rcp_dir[2][i] = 1 / r.dir.z;
+    tmin[i] = r.tmin;
+    tmax[i] = r.tmax;
+    indices[i] = index_type(i);
+  }
+  //! Gets a ray out of the packet.
+  //!
+  //! \param i The slot of the ray.
+  ray<scalar_type> get(size_type i) const noexcept {
+    return ray<scalar_type> {
+      { pos[0][i], pos[1][i], pos[2][i] },
+      { dir[0][i], dir[1][i], dir[2][i] },
+      tmin[i],
+      tmax[i]
+    };
+  }
 };
 
 //! \brief This class is used for traversing a BVH.
@@ -482,17 +1979,17 @@ template <typename scalar_type,
           typename primitive_type,
           typename intersection_type = intersection<scalar_type>>
 class traverser final {
-  //! A reference to the BVH being traversed.
-  const bvh<scalar_type>& bvh_;
+  //! The BVH being traversed.
+  bvh_view<scalar_type> bvh_;
   //! The primitives to check for intersection.
   const primitive_type* primitives;
 public:
   //! A type definition for a ray.
   using ray_type = ray<scalar_type>;
   //! Constructs a new traverser instance.
-  //! \param b The BVH to be traversed.
+  //! \param b The BVH to be traversed. This may be a @ref bvh or a view of one.
   //! \param p The primitives to check for intersection in each box.
-  constexpr traverser(const bvh<scalar_type>& b, const primitive_type* p) noexcept
+  constexpr traverser(bvh_view<scalar_type> b, const primitive_type* p) noexcept
     : bvh_(b), primitives(p) {}
   //! \brief Traverses the BVH, returning the closest intersection that was made.
   //!
@@ -501,10 +1998,286 @@ public:
   //! that indicates whether or not a hit was made.
   template <typename intersector_type>
   intersection_type operator () (const ray_type& ray, const intersector_type& intersector) const noexcept;
+
+  //! \brief Checks whether anything lies along the ray, such as between a point and a light.
+  //! The traversal stops at the first hit within the interval of the ray, and the children of
+  //! a node are visited in no particular order, so this is cheaper than finding the closest hit.
+  //!
+  //! \tparam intersector_type Works the same way as it does for @ref operator ().
+  //!
+  //! \param ray The ray to check. For a shadow ray, @ref ray::tmax is the distance to the light.
+  //!
+  //! \return True if a primitive was hit within the interval of the ray, false otherwise.
+  template <typename intersector_type>
+  bool occluded(const ray_type& ray, const intersector_type& intersector) const noexcept;
 };
 
-//! \brief Contains the associated types for 32-bit sizes.
-template <>
+//! \brief This class is used for traversing a BVH with a packet of rays.
+//! Each node is fetched once for the whole packet and its box is tested
+//! against all of the rays at once, which pays off when the rays are
+//! coherent, such as camera rays of neighboring pixels or shadow rays
+//! towards the same light.
+//!
+//! \tparam scalar_type The floating point type to use for vector components.
+//!
+//! \tparam count The number of rays in a packet, up to 64.
+//!
+//! \tparam primitive_type The type of the primitive being checked for intersection.
+//!
+//! \tparam intersection_type The type used for indicating intersections.
+template <typename scalar_type,
+          size_type count,
+          typename primitive_type,
+          typename intersection_type = intersection<scalar_type>>
+class packet_traverser final {
+  static_assert((count >= 1) && (count <= 64), "A packet may have at most 64 rays.");
+  //! The BVH being traversed.
+  bvh_view<scalar_type> bvh_;
+  //! The primitives to check for intersection.
+  const primitive_type* primitives;
+public:
+  //! A type definition for a ray packet.
+  using packet_type = ray_packet<scalar_type, count>;
+  //! A type definition for a mask with one bit per ray.
+  using mask_type = std::conditional_t<(count > 32), std::uint64_t, std::uint32_t>;
+  //! Constructs a new packet traverser instance.
+  //! \param b The BVH to be traversed. This may be a @ref bvh or a view of one.
+  //! \param p The primitives to check for intersection in each box.
+  constexpr packet_traverser(bvh_view<scalar_type> b, const primitive_type* p) noexcept
+    : bvh_(b), primitives(p) {}
+  //! \brief Traverses the BVH, finding the closest intersection of each ray.
+  //!
+  //! \tparam intersector_type Works the same way as it does for @ref traverser.
+  //! It's called with one ray of the packet at a time.
+  //!
+  //! \param packet The rays to trace.
+  //!
+  //! \param active A mask with one bit set for each slot of the packet that holds a ray.
+  //!
+  //! \param closest Receives the closest intersection of each ray in the packet.
+  //! Slots without a ray are given an intersection without a hit.
+  template <typename intersector_type>
+  void operator () (const packet_type& packet, mask_type active, const intersector_type& intersector, intersection_type* closest) const noexcept;
+};
+
+//! \brief This class is used for traversing a @ref wide_bvh.
+//! All child boxes of a node are tested at once, with SSE or
+//! AVX instructions where they're available, and the children
+//! that are hit are visited from nearest to farthest.
+//!
+//! \tparam scalar_type The floating point type to use for vector components.
+//!
+//! \tparam width The maximum number of children per node.
+//!
+//! \tparam primitive_type The type of the primitive being checked for intersection.
+//!
+//! \tparam intersection_type The type used for indicating intersections.
+template <typename scalar_type,
+          size_type width,
+          typename primitive_type,
+          typename intersection_type = intersection<scalar_type>>
+class wide_traverser final {
+  //! A reference to the BVH being traversed.
+  const wide_bvh<scalar_type, width>& bvh_;
+  //! The primitives to check for intersection.
+  const primitive_type* primitives;
+public:
+  //! A type definition for a ray.
+  using ray_type = ray<scalar_type>;
+  //! Constructs a new wide traverser instance.
+  //! \param b The BVH to be traversed.
+  //! \param p The primitives to check for intersection in each leaf.
+  constexpr wide_traverser(const wide_bvh<scalar_type, width>& b, const primitive_type* p) noexcept
+    : bvh_(b), primitives(p) {}
+  //! \brief Traverses the BVH, returning the closest intersection that was made.
+  //!
+  //! \tparam intersector_type Works the same way as it does for @ref traverser.
+  template <typename intersector_type>
+  intersection_type operator () (const ray_type& ray, const intersector_type& intersector) const noexcept;
+};
+
+//! \brief This class is used for traversing a @ref quantized_bvh.
+//! The child boxes of each node are decoded as the node is visited,
+//! and then tested the same way as in a @ref wide_traverser.
+//!
+//! \tparam scalar_type The floating point type to use for vector components.
+//!
+//! \tparam width The maximum number of children per node.
+//!
+//! \tparam primitive_type The type of the primitive being checked for intersection.
+//!
+//! \tparam intersection_type The type used for indicating intersections.
+//!
+//! \tparam quant_type The unsigned integer type of a quantized coordinate.
+template <typename scalar_type,
+          size_type width,
+          typename primitive_type,
+          typename intersection_type = intersection<scalar_type>,
+          typename quant_type = std::uint8_t>
+class quantized_traverser final {
+  //! A reference to the BVH being traversed.
+  const quantized_bvh<scalar_type, width, quant_type>& bvh_;
+  //! The primitives to check for intersection.
+  const primitive_type* primitives;
+public:
+  //! A type definition for a ray.
+  using ray_type = ray<scalar_type>;
+  //! Constructs a new quantized traverser instance.
+  //! \param b The BVH to be traversed.
+  //! \param p The primitives to check for intersection in each leaf.
+  constexpr quantized_traverser(const quantized_bvh<scalar_type, width, quant_type>& b, const primitive_type* p) noexcept
+    : bvh_(b), primitives(p) {}
+  //! \brief Traverses the BVH, returning the closest intersection that was made.
+  //!
+  //! \tparam intersector_type Works the same way as it does for @ref traverser.
+  template <typename intersector_type>
+  intersection_type operator () (const ray_type& ray, const intersector_type& intersector) const noexcept;
+};
+
+//! \brief The closest intersection found by an @ref instance_traverser.
+//!
+//! \tparam intersection_type The type of intersection returned by the instanced BVHs.
+template <typename intersection_type>
+struct instance_intersection final {
+  //! A type definition for an instance index.
+  using index = typename intersection_type::index;
+  //! The intersection with the primitive of the instance.
+  //! The distance is measured along the world space ray, while
+  //! everything else is in the object space of the instance.
+  intersection_type hit;
+  //! The index of the instance that was hit.
+  index instance = std::numeric_limits<index>::max();
+  //! Indicates whether or not an intersection was made.
+  operator bool () const noexcept {
+    return bool(hit);
+  }
+  //! Compares two intersections by distance.
+  bool operator < (const instance_intersection& other) const noexcept {
+    return hit < other.hit;
+  }
+  //! Compares the intersection distance with another distance.
+  template <typename scalar_type>
+  bool operator < (scalar_type t) const noexcept {
+    return hit < t;
+  }
+};
+
+//! \brief This class is used for traversing a top level BVH built over instances.
+//! When the ray reaches an instance, it's moved into the space of the instance and
+//! the instanced BVH is traversed with a @ref traverser. Since the ray direction
+//! isn't normalized after the move, distances stay comparable between instances.
+//!
+//! \tparam scalar_type The floating point type to use for vector components.
+//!
+//! \tparam primitive_type The type of the primitives in the instanced BVHs.
+//!
+//! \tparam intersection_type The type used for indicating intersections with the primitives.
+//! Besides what @ref traverser requires, this has to have a @c distance member, which is used
+//! to end the ray at the closest hit found so far before the next instance is traversed.
+template <typename scalar_type,
+          typename primitive_type,
+          typename intersection_type = intersection<scalar_type>>
+class instance_traverser final {
+public:
+  //! A type definition for a ray.
+  using ray_type = ray<scalar_type>;
+  //! A type definition for an instance.
+  using instance_type = instance<scalar_type, primitive_type>;
+  //! A type definition for the intersections that are returned.
+  using result_type = instance_intersection<intersection_type>;
+  //! Constructs a new instance traverser.
+  //! The world to object transformation of each instance is computed here,
+  //! so the traverser should be kept around while the instances don't move.
+  //!
+  //! \param top The top level BVH, built over the instances.
+  //!
+  //! \param instances The instances that the leaves of @p top point to.
+  //!
+  //! \param count The number of instances.
+  instance_traverser(bvh_view<scalar_type> top, const instance_type* instances, size_type count);
+  //! \brief Traverses the instances, returning the closest intersection that was made.
+  //!
+  //! \tparam intersector_type Works the same way as it does for @ref traverser.
+  template <typename intersector_type>
+  result_type operator () (const ray_type& ray, const intersector_type& intersector) const noexcept;
+private:
+  //! The top level BVH.
+  bvh_view<scalar_type> top_;
+  //! The instances that the top level BVH points to.
+  const instance_type* instances_;
+  //! The inverse transformation of each instance.
+  std::vector<transform<scalar_type>> world_to_object;
+};
+
+namespace detail {
+
+//! Keeps a function parameter out of template argument deduction,
+//! so that it may be passed anything that converts to its type.
+template <typename type>
+struct non_deduced final {
+  //! The type of the parameter.
+  using value_type = type;
+};
+
+} // namespace detail
+
+//! \brief Contains the options used by @ref trace.
+struct trace_options final {
+  //! The number of rays that are traced one after another by a task.
+  //! The default is small enough for a chunk of rays and hits to stay
+  //! in the first level cache.
+  size_type chunk_size = 256;
+  //! Whether or not the rays are sorted before they're traced, so that rays
+  //! that start close together and point the same way are traced one after
+  //! another and find the nodes they visit still in the cache. The rays are
+  //! grouped by the octant of their direction first and then sorted along
+  //! a Morton curve of their origin and direction. The hits are still written
+  //! in the order of the rays. This pays off for incoherent rays, such as
+  //! diffuse bounces, and mostly costs time for coherent ones.
+  bool sort_rays = false;
+};
+
+//! \brief Traces a buffer of rays through a BVH in parallel and writes
+//! the closest hit of each ray to the matching slot of @p hits.
+//!
+//! The rays are split into chunks of @ref trace_options::chunk_size rays.
+//! Each task of the scheduler claims chunks one at a time from a shared
+//! counter until they run out, so threads that get cheaper rays simply
+//! end up tracing more chunks.
+//!
+//! \tparam intersector_type Works the same way as it does for @ref traverser.
+//!
+//! \param b The BVH to trace the rays through. This may be a @ref bvh or a view of one.
+//!
+//! \param primitives The primitives that the BVH was built for.
+//!
+//! \param rays The rays to trace.
+//!
+//! \param count The number of rays to trace.
+//!
+//! \param hits Receives the closest hit of each ray. This has to have room for @p count hits.
+//!
+//! \param intersector The function object that intersects a ray with a primitive.
+//!
+//! \param scheduler The scheduler to trace the chunks with.
+//!
+//! \param options The options to trace the rays with.
+template <typename scalar_type,
+          typename primitive_type,
+          typename intersection_type,
+          typename intersector_type,
+          typename task_scheduler = default_scheduler>
+void trace(typename detail::non_deduced<bvh_view<scalar_type>>::value_type b,
+           const primitive_type* primitives,
+           const ray<scalar_type>* rays,
+           size_type count,
+           intersection_type* hits,
+           const intersector_type& intersector,
+           task_scheduler scheduler = task_scheduler(),
+           const trace_options& options = trace_options());
+
+//! \brief Contains the associated types for 32-bit sizes.
+template <>
 struct associated_types<4> final {
   //! The unsigned integer type to use for 32-bit types.
   using uint_type = std::uint32_t;
@@ -525,6 +2298,287 @@ struct associated_types<8> final {
   using float_type = double;
 };
 
+namespace detail {
+
+//! \brief The instruction sets that the float packet
+//! kernels are picked from when the program runs.
+enum class simd_level {
+  //! Only the portable loops are used.
+  none,
+  //! Eight lanes at a time, with AVX2.
+  avx2,
+  //! Sixteen lanes at a time, with AVX-512.
+  avx512
+};
+
+//! Asks the CPU and the operating system which of the
+//! instruction sets in @ref simd_level can be used.
+inline simd_level detect_simd_level() noexcept {
+
+#if !defined(LBVH_SIMD_DISPATCH)
+
+  return simd_level::none;
+
+#elif defined(_MSC_VER)
+
+  int info[4];
+
+  __cpuid(info, 0);
+
+  if (info[0] < 7) {
+    return simd_level::none;
+  }
+
+  __cpuid(info, 1);
+
+  // The operating system has to save the vector registers.
+
+  if (!(info[2] & (1 << 27))) {
+    return simd_level::none;
+  }
+
+  auto xcr0 = _xgetbv(0);
+
+  if ((xcr0 & 0x6) != 0x6) {
+    return simd_level::none;
+  }
+
+  __cpuidex(info, 7, 0);
+
+  if ((info[1] & (1 << 16)) && ((xcr0 & 0xe6) == 0xe6)) {
+    return simd_level::avx512;
+  }
+
+  if (info[1] & (1 << 5)) {
+    return simd_level::avx2;
+  }
+
+  return simd_level::none;
+
+#else
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f")) {
+    return simd_level::avx512;
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    return simd_level::avx2;
+  }
+
+  return simd_level::none;
+
+#endif
+}
+
+//! The instruction set that the float packet kernels are dispatched to.
+//! It's detected the first time that it's needed.
+inline simd_level cpu_simd_level() noexcept {
+  static const simd_level level = detect_simd_level();
+  return level;
+}
+
+#ifdef LBVH_SIMD_DISPATCH
+
+//! \brief Float kernels for @ref simd_level::avx2.
+//! These are compiled for AVX2 no matter what the rest of the
+//! program is compiled for, so they may only be called once
+//! @ref cpu_simd_level says that the CPU supports them.
+//! Array lengths must be multiples of eight.
+struct avx2_kernels final {
+  //! The number of floats processed at a time.
+  static constexpr size_type width() noexcept {
+    return 8;
+  }
+  //! Multiplies two arrays, element by element.
+  LBVH_TARGET("avx2") static void mul(const float* a, const float* b, float* out, size_type n) noexcept {
+    for (size_type i = 0; i < n; i += width()) {
+      _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+  }
+  //! Subtracts two arrays, element by element.
+  LBVH_TARGET("avx2") static void sub(const float* a, const float* b, float* out, size_type n) noexcept {
+    for (size_type i = 0; i < n; i += width()) {
+      _mm256_storeu_ps(out + i, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+  }
+  //! Multiplies each dimension of a packet by a value of its own.
+  //!
+  //! \param a The packet, with @p n values per dimension.
+  //!
+  //! \param b One value for each of the three dimensions.
+  LBVH_TARGET("avx2") static void scale(const float* a, const float* b, float* out, size_type n) noexcept {
+    for (size_type d = 0; d < 3; d++) {
+      auto factor = _mm256_set1_ps(b[d]);
+      for (size_type i = d * n; i < (d + 1) * n; i += width()) {
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), factor));
+      }
+    }
+  }
+  //! Adds a value of its own to each dimension of a packet.
+  //!
+  //! \param a The packet, with @p n values per dimension.
+  //!
+  //! \param b One value for each of the three dimensions.
+  LBVH_TARGET("avx2") static void offset(const float* a, const float* b, float* out, size_type n) noexcept {
+    for (size_type d = 0; d < 3; d++) {
+      auto term = _mm256_set1_ps(b[d]);
+      for (size_type i = d * n; i < (d + 1) * n; i += width()) {
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(a + i), term));
+      }
+    }
+  }
+  //! Tests a box against eight rays of a packet.
+  //!
+  //! \param box The box bounds, minimum then maximum.
+  //!
+  //! \param rcp_dir The reciprocal directions of the packet, at the first ray.
+  //!
+  //! \param inv_pos The scaled and negated positions of the packet, at the first ray.
+  //!
+  //! \param stride The number of values per dimension in the packet.
+  //!
+  //! \param ray_tmin The start of the interval of each ray.
+  //!
+  //! \param ray_tmax The end of the interval of each ray.
+  //!
+  //! \param tmin Receives the entry distance of each ray.
+  //!
+  //! \return A mask with one bit set for each ray that hits the box.
+  LBVH_TARGET("avx2") static std::uint32_t box_test(const float* box, const float* rcp_dir, const float* inv_pos, size_type stride, const float* ray_tmin, const float* ray_tmax, float* tmin) noexcept {
+
+    auto tn = _mm256_setzero_ps();
+    auto tf = _mm256_setzero_ps();
+
+    for (size_type d = 0; d < 3; d++) {
+
+      auto rcp = _mm256_loadu_ps(rcp_dir + (d * stride));
+      auto pos = _mm256_loadu_ps(inv_pos + (d * stride));
+
+      auto t1 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(box[d]), rcp), pos);
+      auto t2 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(box[d + 3]), rcp), pos);
+
+      auto near_t = _mm256_min_ps(t1, t2);
+      auto far_t = _mm256_max_ps(t1, t2);
+
+      tn = d ? _mm256_max_ps(tn, near_t) : near_t;
+      tf = d ? _mm256_min_ps(tf, far_t) : far_t;
+    }
+
+    _mm256_storeu_ps(tmin, tn);
+
+    tf = _mm256_min_ps(_mm256_loadu_ps(ray_tmax), tf);
+
+    auto start = _mm256_max_ps(_mm256_setzero_ps(), _mm256_loadu_ps(ray_tmin));
+
+    return std::uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(tf, _mm256_max_ps(start, tn), _CMP_GE_OQ)));
+  }
+};
+
+//! \brief Float kernels for @ref simd_level::avx512.
+//! See @ref avx2_kernels for how they're used.
+//! Array lengths must be multiples of sixteen.
+struct avx512_kernels final {
+  //! The number of floats processed at a time.
+  static constexpr size_type width() noexcept {
+    return 16;
+  }
+  //! Multiplies two arrays, element by element.
+  LBVH_TARGET("avx512f") static void mul(const float* a, const float* b, float* out, size_type n) noexcept {
+    for (size_type i = 0; i < n; i += width()) {
+      _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+    }
+  }
+  //! Subtracts two arrays, element by element.
+  LBVH_TARGET("avx512f") static void sub(const float* a, const float* b, float* out, size_type n) noexcept {
+    for (size_type i = 0; i < n; i += width()) {
+      _mm512_storeu_ps(out + i, _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+    }
+  }
+  //! Multiplies each dimension of a packet by a value of its own.
+  //! See @ref avx2_kernels::scale.
+  LBVH_TARGET("avx512f") static void scale(const float* a, const float* b, float* out, size_type n) noexcept {
+    for (size_type d = 0; d < 3; d++) {
+      auto factor = _mm512_set1_ps(b[d]);
+      for (size_type i = d * n; i < (d + 1) * n; i += width()) {
+        _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_loadu_ps(a + i), factor));
+      }
+    }
+  }
+  //! Adds a value of its own to each dimension of a packet.
+  //! See @ref avx2_kernels::offset.
+  LBVH_TARGET("avx512f") static void offset(const float* a, const float* b, float* out, size_type n) noexcept {
+    for (size_type d = 0; d < 3; d++) {
+      auto term = _mm512_set1_ps(b[d]);
+      for (size_type i = d * n; i < (d + 1) * n; i += width()) {
+        _mm512_storeu_ps(out + i, _mm512_add_ps(_mm512_loadu_ps(a + i), term));
+      }
+    }
+  }
+  //! Tests a box against sixteen rays of a packet.
+  //! See @ref avx2_kernels::box_test.
+  LBVH_TARGET("avx512f") static std::uint32_t box_test(const float* box, const float* rcp_dir, const float* inv_pos, size_type stride, const float* ray_tmin, const float* ray_tmax, float* tmin) noexcept {
+
+    const __mmask16 all_lanes = 0xffff;
+
+    auto tn = _mm512_setzero_ps();
+    auto tf = _mm512_setzero_ps();
+
+    for (size_type d = 0; d < 3; d++) {
+
+      auto rcp = _mm512_loadu_ps(rcp_dir + (d * stride));
+      auto pos = _mm512_loadu_ps(inv_pos + (d * stride));
+
+      auto t1 = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(box[d]), rcp), pos);
+      auto t2 = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(box[d + 3]), rcp), pos);
+
+      // The zero masking forms of min and max are used because the
+      // plain ones trip an uninitialized warning in some GCC versions.
+
+      auto near_t = _mm512_maskz_min_ps(all_lanes, t1, t2);
+      auto far_t = _mm512_maskz_max_ps(all_lanes, t1, t2);
+
+      tn = d ? _mm512_maskz_max_ps(all_lanes, tn, near_t) : near_t;
+      tf = d ? _mm512_maskz_min_ps(all_lanes, tf, far_t) : far_t;
+    }
+
+    _mm512_storeu_ps(tmin, tn);
+
+    tf = _mm512_maskz_min_ps(all_lanes, _mm512_loadu_ps(ray_tmax), tf);
+
+    auto start = _mm512_maskz_max_ps(all_lanes, _mm512_setzero_ps(), _mm512_loadu_ps(ray_tmin));
+
+    return std::uint32_t(_mm512_cmp_ps_mask(tf, _mm512_maskz_max_ps(all_lanes, start, tn), _CMP_GE_OQ));
+  }
+};
+
+//! Picks the widest kernels for an array length.
+//!
+//! \param n The number of floats per call, which has to be a
+//! multiple of the kernel width.
+//!
+//! \return The instruction set to use, or @ref simd_level::none
+//! if the portable loop should be used.
+inline simd_level simd_level_for(size_type n) noexcept {
+
+  auto level = cpu_simd_level();
+
+  if ((level == simd_level::avx512) && !(n % avx512_kernels::width())) {
+    return simd_level::avx512;
+  }
+
+  if ((level != simd_level::none) && !(n % avx2_kernels::width())) {
+    return simd_level::avx2;
+  }
+
+  return simd_level::none;
+}
+
+#endif // LBVH_SIMD_DISPATCH
+
+} // namespace detail
+
 //! \brief This namespace contains various math routines
 //! for scalar and vector types. It may be useful to the
 //! user when writing intersection functions or primitive
@@ -718,35 +2772,101 @@ vec3<scalar_type> normalize(const vec3<scalar_type>& v) noexcept {
   return v * l_inv;
 }
 
-//! \brief Multiplies a 2D vector by a scalar value.
+//! \brief Moves a point by an affine transformation.
 //!
-//! \return The product of @p a and @p b.
+//! \return The point @p p, transformed by @p t.
 template <typename scalar_type>
-vec2<scalar_type> operator * (const vec2<scalar_type>& a, scalar_type b) noexcept {
-  return vec2<scalar_type> {
-    a.x * b,
-    a.y * b
+auto transform_point(const transform<scalar_type>& t, const vec3<scalar_type>& p) noexcept {
+  return vec3<scalar_type> {
+    (t.m[0][0] * p.x) + (t.m[0][1] * p.y) + (t.m[0][2] * p.z) + t.m[0][3],
+    (t.m[1][0] * p.x) + (t.m[1][1] * p.y) + (t.m[1][2] * p.z) + t.m[1][3],
+    (t.m[2][0] * p.x) + (t.m[2][1] * p.y) + (t.m[2][2] * p.z) + t.m[2][3]
   };
 }
 
-//! \brief Computes the sum of two 2D vectors.
+//! \brief Moves a direction by an affine transformation.
+//! Unlike @ref transform_point, the translation is ignored.
 //!
-//! \return The sum of @p a and @p b.
+//! \return The direction @p v, transformed by @p t.
 template <typename scalar_type>
-vec2<scalar_type> operator + (const vec2<scalar_type>& a,
-                              const vec2<scalar_type>& b) noexcept {
-  return vec2<scalar_type> {
-    a.x + b.x,
-    a.y + b.y
+auto transform_vector(const transform<scalar_type>& t, const vec3<scalar_type>& v) noexcept {
+  return vec3<scalar_type> {
+    (t.m[0][0] * v.x) + (t.m[0][1] * v.y) + (t.m[0][2] * v.z),
+    (t.m[1][0] * v.x) + (t.m[1][1] * v.y) + (t.m[1][2] * v.z),
+    (t.m[2][0] * v.x) + (t.m[2][1] * v.y) + (t.m[2][2] * v.z)
   };
 }
 
-//! \brief This structure implements various vector packet operations.
-//! Since these operations require various template parameters, they are
-//! best implemented in a structure where type definitions can make the code
-//! much more readable.
+//! \brief Inverts an affine transformation.
+//! The linear part of @p t must be invertible.
 //!
-//! \tparam scalar_type The scalar type of the vector components.
+//! \return The transformation that undoes @p t.
+template <typename scalar_type>
+auto inverse(const transform<scalar_type>& t) noexcept {
+
+  const auto& m = t.m;
+
+  // The inverse of the linear part is its adjugate over its determinant.
+
+  scalar_type c[3][3] {
+    { (m[1][1] * m[2][2]) - (m[1][2] * m[2][1]),
+      (m[0][2] * m[2][1]) - (m[0][1] * m[2][2]),
+      (m[0][1] * m[1][2]) - (m[0][2] * m[1][1]) },
+    { (m[1][2] * m[2][0]) - (m[1][0] * m[2][2]),
+      (m[0][0] * m[2][2]) - (m[0][2] * m[2][0]),
+      (m[0][2] * m[1][0]) - (m[0][0] * m[1][2]) },
+    { (m[1][0] * m[2][1]) - (m[1][1] * m[2][0]),
+      (m[0][1] * m[2][0]) - (m[0][0] * m[2][1]),
+      (m[0][0] * m[1][1]) - (m[0][1] * m[1][0]) }
+  };
+
+  auto det = (m[0][0] * c[0][0]) + (m[0][1] * c[1][0]) + (m[0][2] * c[2][0]);
+
+  auto det_inv = scalar_type(1) / det;
+
+  transform<scalar_type> out;
+
+  for (size_type i = 0; i < 3; i++) {
+
+    for (size_type j = 0; j < 3; j++) {
+      out.m[i][j] = c[i][j] * det_inv;
+    }
+
+    out.m[i][3] = -((out.m[i][0] * m[0][3]) + (out.m[i][1] * m[1][3]) + (out.m[i][2] * m[2][3]));
+  }
+
+  return out;
+}
+
+//! \brief Multiplies a 2D vector by a scalar value.
+//!
+//! \return The product of @p a and @p b.
+template <typename scalar_type>
+vec2<scalar_type> operator * (const vec2<scalar_type>& a, scalar_type b) noexcept {
+  return vec2<scalar_type> {
+    a.x * b,
+    a.y * b
+  };
+}
+
+//! \brief Computes the sum of two 2D vectors.
+//!
+//! \return The sum of @p a and @p b.
+template <typename scalar_type>
+vec2<scalar_type> operator + (const vec2<scalar_type>& a,
+                              const vec2<scalar_type>& b) noexcept {
+  return vec2<scalar_type> {
+    a.x + b.x,
+    a.y + b.y
+  };
+}
+
+//! \brief This structure implements various vector packet operations.
+//! Since these operations require various template parameters, they are
+//! best implemented in a structure where type definitions can make the code
+//! much more readable.
+//!
+//! \tparam scalar_type The scalar type of the vector components.
 //!
 //! \tparam dimensions The number of dimensions the vectors will have.
 //!
@@ -803,8 +2923,147 @@ struct vec_packet_ops final {
     }
     return out;
   }
+  //! Multiplies each dimension of a vector packet by a value of its own.
+  //!
+  //! \param b The value to multiply each dimension of @p a by.
+  //!
+  //! \return The scaled vector packet.
+  static constexpr auto scale(const vec_packet_type& a, const scalar_type (&b)[dimensions]) noexcept {
+    vec_packet_type out;
+    for (size_type d = 0; d < dimensions; d++) {
+      for (size_type i = 0; i < count; i++) {
+        out[d][i] = a[d][i] * b[d];
+      }
+    }
+    return out;
+  }
+  //! Adds a value of its own to each dimension of a vector packet.
+  //!
+  //! \param b The value to add to each dimension of @p a.
+  //!
+  //! \return The offset vector packet.
+  static constexpr auto offset(const vec_packet_type& a, const scalar_type (&b)[dimensions]) noexcept {
+    vec_packet_type out;
+    for (size_type d = 0; d < dimensions; d++) {
+      for (size_type i = 0; i < count; i++) {
+        out[d][i] = a[d][i] + b[d];
+      }
+    }
+    return out;
+  }
+};
+
+#ifdef LBVH_SIMD_DISPATCH
+
+//! \brief The operations on 3D float vector packets, done with
+//! AVX2 or AVX-512 when the CPU supports it and the packet size
+//! is a multiple of eight or sixteen. See @ref detail::cpu_simd_level.
+//!
+//! \tparam count The number of elements per dimension for each vector.
+template <size_type count>
+struct vec_packet_ops<float, 3, count> final {
+  //! A type definition for a vector packet.
+  using vec_packet_type = vec_packet<float, 3, count>;
+  //! Computes the Hadamard product of two vectors.
+  //!
+  //! \return The Hadamard product of @p a and @p b.
+  static auto hadamard_mul(const vec_packet_type& a, const vec_packet_type& b) noexcept {
+    vec_packet_type out;
+    switch (detail::simd_level_for(count)) {
+      case detail::simd_level::avx512:
+        detail::avx512_kernels::mul(a.values, b.values, out.values, 3 * count);
+        break;
+      case detail::simd_level::avx2:
+        detail::avx2_kernels::mul(a.values, b.values, out.values, 3 * count);
+        break;
+      case detail::simd_level::none:
+        for (size_type i = 0; i < (3 * count); i++) {
+          out.values[i] = a.values[i] * b.values[i];
+        }
+        break;
+    }
+    return out;
+  }
+  //! Computes the sum of a vector packet and single scalar value.
+  //!
+  //! \return The sum of @p a and @p b.
+  static auto add(const vec_packet_type& a, float b) noexcept {
+    return offset(a, { b, b, b });
+  }
+  //! Subtracts two vectors.
+  //!
+  //! \return The difference between @p a and @p b.
+  static auto sub(const vec_packet_type& a, const vec_packet_type& b) noexcept {
+    vec_packet_type out;
+    switch (detail::simd_level_for(count)) {
+      case detail::simd_level::avx512:
+        detail::avx512_kernels::sub(a.values, b.values, out.values, 3 * count);
+        break;
+      case detail::simd_level::avx2:
+        detail::avx2_kernels::sub(a.values, b.values, out.values, 3 * count);
+        break;
+      case detail::simd_level::none:
+        for (size_type i = 0; i < (3 * count); i++) {
+          out.values[i] = a.values[i] - b.values[i];
+        }
+        break;
+    }
+    return out;
+  }
+  //! Multiplies a vector packet by a scalar value.
+  //!
+  //! \return The product of @p a and @p b.
+  static auto mul(const vec_packet_type& a, float b) noexcept {
+    return scale(a, { b, b, b });
+  }
+  //! Multiplies each dimension of a vector packet by a value of its own.
+  //!
+  //! \return The scaled vector packet.
+  static auto scale(const vec_packet_type& a, const float (&b)[3]) noexcept {
+    vec_packet_type out;
+    switch (detail::simd_level_for(count)) {
+      case detail::simd_level::avx512:
+        detail::avx512_kernels::scale(a.values, b, out.values, count);
+        break;
+      case detail::simd_level::avx2:
+        detail::avx2_kernels::scale(a.values, b, out.values, count);
+        break;
+      case detail::simd_level::none:
+        for (size_type d = 0; d < 3; d++) {
+          for (size_type i = 0; i < count; i++) {
+            out[d][i] = a[d][i] * b[d];
+          }
+        }
+        break;
+    }
+    return out;
+  }
+  //! Adds a value of its own to each dimension of a vector packet.
+  //!
+  //! \return The offset vector packet.
+  static auto offset(const vec_packet_type& a, const float (&b)[3]) noexcept {
+    vec_packet_type out;
+    switch (detail::simd_level_for(count)) {
+      case detail::simd_level::avx512:
+        detail::avx512_kernels::offset(a.values, b, out.values, count);
+        break;
+      case detail::simd_level::avx2:
+        detail::avx2_kernels::offset(a.values, b, out.values, count);
+        break;
+      case detail::simd_level::none:
+        for (size_type d = 0; d < 3; d++) {
+          for (size_type i = 0; i < count; i++) {
+            out[d][i] = a[d][i] + b[d];
+          }
+        }
+        break;
+    }
+    return out;
+  }
 };
 
+#endif // LBVH_SIMD_DISPATCH
+
 //! Adds a single scalar value to all components of @p a.
 //!
 //! \return The sume of @p a and @p b.
@@ -840,16 +3099,7 @@ constexpr auto operator * (const vec_packet<scalar_type, dimensions, count>& a,
 template <typename scalar_type, size_type count>
 constexpr auto hadamard_mul(const vec_packet<scalar_type, 3, count>& a,
                             const vec3<scalar_type>& b) noexcept {
-
-  vec_packet<scalar_type, 3, count> out;
-
-  for (size_type i = 0; i < count; i++) {
-    out[0][i] = a[0][i] * b.x;
-    out[1][i] = a[1][i] * b.y;
-    out[2][i] = a[2][i] * b.z;
-  }
-
-  return out;
+  return vec_packet_ops<scalar_type, 3, count>::scale(a, { b.x, b.y, b.z });
 }
 
 //! \brief Subtracts a single 3D vector from a 3D vector packet.
@@ -862,16 +3112,8 @@ constexpr auto hadamard_mul(const vec_packet<scalar_type, 3, count>& a,
 template <typename scalar_type, size_type count>
 constexpr auto operator - (const vec_packet<scalar_type, 3, count>& a,
                            const vec3<scalar_type>& b) noexcept {
-
-  vec_packet<scalar_type, 3, count> out;
-
-  for (size_type i = 0; i < count; i++) {
-    out[0][i] = a[0][i] - b.x;
-    out[1][i] = a[1][i] - b.y;
-    out[2][i] = a[2][i] - b.z;
-  }
-
-  return out;
+  // Adding the negated vector gives exactly the same result.
+  return vec_packet_ops<scalar_type, 3, count>::offset(a, { -b.x, -b.y, -b.z });
 }
 
 } // namespace math
@@ -900,6 +3142,24 @@ inline auto clz(std::uint64_t n) noexcept {
 #endif
 }
 
+//! \brief Counts trailing zeroes of a non-zero 32-bit integer.
+inline auto ctz(std::uint32_t n) noexcept {
+#ifdef _MSC_VER
+  return _tzcnt_u32(n);
+#else
+  return __builtin_ctz(n);
+#endif
+}
+
+//! \brief Counts trailing zeroes of a non-zero 64-bit integer.
+inline auto ctz(std::uint64_t n) noexcept {
+#ifdef _MSC_VER
+  return _tzcnt_u64(n);
+#else
+  return __builtin_ctzll(n);
+#endif
+}
+
 //! \brief Gets the sign of a number, as an integer.
 //!
 //! \return The sign of @p n. If @p n is negative,
@@ -929,23 +3189,15 @@ struct loop_range final {
   size_type end;
   //! Constructs a loop range for an array and work division.
   //! This makes it easy to divide work required on an array
-  //! into a given work division.
+  //! into a given work division. The array is split as evenly
+  //! as possible, since schedulers may issue many small divisions.
   //!
   //! \param div The work division given by the scheduler.
   //!
   //! \param array_size The size of the array being worked on.
-  loop_range(const work_division& div, size_type array_size) noexcept {
-
-    auto chunk_size = array_size / div.max;
-
-    begin = chunk_size * div.idx;
-
-    if ((div.idx + 1) == div.max) {
-      end = array_size;
-    } else {
-      end = begin + chunk_size;
-    }
-  }
+  loop_range(const work_division& div, size_type array_size) noexcept
+    : begin((array_size * div.idx) / div.max),
+      end((array_size * (div.idx + 1)) / div.max) { }
 };
 
 //! Constructs an accelerated ray structure.
@@ -981,6 +3233,18 @@ constexpr auto make_accel_ray(const ray<scalar_type>& r) noexcept {
   };
 }
 
+//! Checks whether a primitive hit lies within the interval of a ray.
+//!
+//! \param isect The hit returned by the intersector.
+//!
+//! \param r The ray that the hit was made with.
+//!
+//! \return True if a hit was made at or after @ref ray::tmin and before @ref ray::tmax.
+template <typename intersection_type, typename scalar_type>
+bool in_interval(const intersection_type& isect, const ray<scalar_type>& r) noexcept {
+  return isect && !(isect < r.tmin) && (isect < r.tmax);
+}
+
 //! Represents a ray intersection with a box.
 //!
 //! \tparam scalar_type The scalar type of the intersection distances.
@@ -1003,6 +3267,9 @@ struct box_intersection final {
 };
 
 //! Checks for ray intersection with a bounding box.
+//! Boxes that lie outside of the interval of the ray are
+//! reported as misses. The entry distance isn't clipped,
+//! so that it still tells apart boxes that the ray starts in.
 //!
 //! \tparam scalar_type The type used for vector components.
 //!
@@ -1031,7 +3298,12 @@ auto intersect(const aabb<scalar_type>& box, const accel_ray<scalar_type>& accel
   tmin = max(tmin, min(tz1, tz2));
   tmax = min(tmax, max(tz1, tz2));
 
-  return box_intersection<scalar_type> { tmin, tmax };
+  tmax = min(accel_r.r.tmax, tmax);
+
+  return box_intersection<scalar_type> {
+    tmin,
+    (tmax >= accel_r.r.tmin) ? tmax : -std::numeric_limits<scalar_type>::infinity()
+  };
 
 #else // LBVH_ENABLE_SLAB_TEST
 
@@ -1058,95 +3330,713 @@ auto intersect(const aabb<scalar_type>& box, const accel_ray<scalar_type>& accel
     (bounds[accel_r.inv_octants[2]] * accel_r.rcp_dir.z) + accel_r.inv_pos.z
   };
 
+  auto tmax = min(accel_r.r.tmax, min(min(tf[0], tf[1]), tf[2]));
+
   return box_intersection<scalar_type> {
     max(max(tn[0], tn[1]), tn[2]),
-    min(min(tf[0], tf[1]), tf[2]),
+    (tmax >= accel_r.r.tmin) ? tmax : -std::numeric_limits<scalar_type>::infinity()
   };
 
 #endif // LBVH_ENABLE_SLAB_TEST
 }
 
-//! \brief This class represents a space filling curve.
+//! \brief Tests a ray against all of the child boxes of a wide node.
+//! This is the portable version, which is written so that compilers
+//! may vectorize it. It's specialized for the node widths that map
+//! to SSE and AVX registers.
 //!
-//! \tparam code_type The type used for units of the curve.
-template <typename code_type>
-class space_filling_curve final {
-public:
-  //! Represents a single entry within the curve table.
-  struct entry final {
-    //! Let's make the code and the primitive index the same size
-    //! by using this type definition.
-    using index_type = typename associated_types<sizeof(code_type)>::uint_type;
-    //! The code at this point along the curve.
-    code_type code;
-    //! The index to the primitive associated with this point.
-    index_type primitive;
-  };
-  //! A type definition for a vector of entries.
-  using entry_vec = std::vector<entry>;
-  //! Constructs a space filling curve.
-  //! \param entries_ The entries to assign the curve.
-  space_filling_curve(entry_vec&& entries_) noexcept
-    : entries(std::move(entries_)) {}
-  //! Constructs a curve via move semantics.
-  space_filling_curve(space_filling_curve&& other) noexcept
-    : entries(std::move(other.entries)) {}
-  //! Sorts the space filling curve based on the code of each entry.
-  void sort() {
-    auto cmp = [](const entry& a, const entry& b) {
-      return a.code < b.code;
-    };
-#if (__cplusplus >= 201703L) && !(defined LBVH_NO_THREADS)
-    std::sort(std::execution::par_unseq, entries.begin(), entries.end(), cmp);
-#else
-    std::sort(entries.begin(), entries.end(), cmp);
-#endif
-  }
-  //! Indicates the number of entries in the space filling curve.
-  inline auto size() const noexcept {
-    return entries.size();
+//! \tparam scalar_type The type used for vector components.
+//!
+//! \tparam width The number of children per node.
+template <typename scalar_type, size_type width>
+struct wide_box_test final {
+  //! Tests the child boxes of a node.
+  //!
+  //! \param n The node to test the child boxes of.
+  //!
+  //! \param accel_r The ray to test the boxes with.
+  //!
+  //! \param tmin Receives the entry distance of each child box.
+  //!
+  //! \return A mask with one bit set for each child box that was hit.
+  static std::uint32_t intersect(const wide_node<scalar_type, width>& n, const accel_ray<scalar_type>& accel_r, scalar_type* tmin) noexcept {
+
+    const scalar_type* bounds[6] { n.min_x, n.min_y, n.min_z, n.max_x, n.max_y, n.max_z };
+
+    const auto* near_x = bounds[accel_r.octants[0]];
+    const auto* near_y = bounds[accel_r.octants[1]];
+    const auto* near_z = bounds[accel_r.octants[2]];
+
+    const auto* far_x = bounds[accel_r.inv_octants[0]];
+    const auto* far_y = bounds[accel_r.inv_octants[1]];
+    const auto* far_z = bounds[accel_r.inv_octants[2]];
+
+    std::uint32_t mask = 0;
+
+    for (size_type i = 0; i < width; i++) {
+
+      auto tn = max(max((near_x[i] * accel_r.rcp_dir.x) + accel_r.inv_pos.x,
+                        (near_y[i] * accel_r.rcp_dir.y) + accel_r.inv_pos.y),
+                        (near_z[i] * accel_r.rcp_dir.z) + accel_r.inv_pos.z);
+
+      auto tf = min(min((far_x[i] * accel_r.rcp_dir.x) + accel_r.inv_pos.x,
+                        (far_y[i] * accel_r.rcp_dir.y) + accel_r.inv_pos.y),
+                        (far_z[i] * accel_r.rcp_dir.z) + accel_r.inv_pos.z);
+
+      tmin[i] = tn;
+
+      mask |= std::uint32_t(min(accel_r.r.tmax, tf) >= max(max(scalar_type(0), accel_r.r.tmin), tn)) << i;
+    }
+
+    return mask;
   }
-  //! Accesses a specific entry within the space filling curve.
-  //! \param index The index of the entry to access.
-  inline const auto& operator [] (size_type index) const noexcept {
-    return entries[index];
+};
+
+#if (defined(__SSE__) || defined(_M_X64)) && !defined(LBVH_NO_SIMD)
+
+//! \brief Tests a ray against the four child boxes of a node with SSE.
+template <>
+struct wide_box_test<float, 4> final {
+  //! Tests the child boxes of a node.
+  //! See the portable version for details.
+  static std::uint32_t intersect(const wide_node<float, 4>& n, const accel_ray<float>& accel_r, float* tmin) noexcept {
+
+    const float* bounds[6] { n.min_x, n.min_y, n.min_z, n.max_x, n.max_y, n.max_z };
+
+    auto rcp_x = _mm_set1_ps(accel_r.rcp_dir.x);
+    auto rcp_y = _mm_set1_ps(accel_r.rcp_dir.y);
+    auto rcp_z = _mm_set1_ps(accel_r.rcp_dir.z);
+
+    auto pos_x = _mm_set1_ps(accel_r.inv_pos.x);
+    auto pos_y = _mm_set1_ps(accel_r.inv_pos.y);
+    auto pos_z = _mm_set1_ps(accel_r.inv_pos.z);
+
+    auto near_x = _mm_add_ps(_mm_mul_ps(_mm_load_ps(bounds[accel_r.octants[0]]), rcp_x), pos_x);
+    auto near_y = _mm_add_ps(_mm_mul_ps(_mm_load_ps(bounds[accel_r.octants[1]]), rcp_y), pos_y);
+    auto near_z = _mm_add_ps(_mm_mul_ps(_mm_load_ps(bounds[accel_r.octants[2]]), rcp_z), pos_z);
+
+    auto far_x = _mm_add_ps(_mm_mul_ps(_mm_load_ps(bounds[accel_r.inv_octants[0]]), rcp_x), pos_x);
+    auto far_y = _mm_add_ps(_mm_mul_ps(_mm_load_ps(bounds[accel_r.inv_octants[1]]), rcp_y), pos_y);
+    auto far_z = _mm_add_ps(_mm_mul_ps(_mm_load_ps(bounds[accel_r.inv_octants[2]]), rcp_z), pos_z);
+
+    auto tn = _mm_max_ps(_mm_max_ps(near_x, near_y), near_z);
+    auto tf = _mm_min_ps(_mm_set1_ps(accel_r.r.tmax), _mm_min_ps(_mm_min_ps(far_x, far_y), far_z));
+
+    _mm_storeu_ps(tmin, tn);
+
+    auto start = _mm_max_ps(_mm_setzero_ps(), _mm_set1_ps(accel_r.r.tmin));
+
+    return std::uint32_t(_mm_movemask_ps(_mm_cmpge_ps(tf, _mm_max_ps(start, tn))));
   }
+};
 
-  space_filling_curve(const space_filling_curve&) = delete;
-  space_filling_curve& operator = (const space_filling_curve&) = delete;
-private:
-  //! The entries of the space filling curve.
-  entry_vec entries;
+#endif
+
+#if defined(__AVX__) && !defined(LBVH_NO_SIMD)
+
+//! \brief Tests a ray against the eight child boxes of a node with AVX.
+template <>
+struct wide_box_test<float, 8> final {
+  //! Tests the child boxes of a node.
+  //! See the portable version for details.
+  static std::uint32_t intersect(const wide_node<float, 8>& n, const accel_ray<float>& accel_r, float* tmin) noexcept {
+
+    const float* bounds[6] { n.min_x, n.min_y, n.min_z, n.max_x, n.max_y, n.max_z };
+
+    auto rcp_x = _mm256_set1_ps(accel_r.rcp_dir.x);
+    auto rcp_y = _mm256_set1_ps(accel_r.rcp_dir.y);
+    auto rcp_z = _mm256_set1_ps(accel_r.rcp_dir.z);
+
+    auto pos_x = _mm256_set1_ps(accel_r.inv_pos.x);
+    auto pos_y = _mm256_set1_ps(accel_r.inv_pos.y);
+    auto pos_z = _mm256_set1_ps(accel_r.inv_pos.z);
+
+    auto near_x = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(bounds[accel_r.octants[0]]), rcp_x), pos_x);
+    auto near_y = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(bounds[accel_r.octants[1]]), rcp_y), pos_y);
+    auto near_z = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(bounds[accel_r.octants[2]]), rcp_z), pos_z);
+
+    auto far_x = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(bounds[accel_r.inv_octants[0]]), rcp_x), pos_x);
+    auto far_y = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(bounds[accel_r.inv_octants[1]]), rcp_y), pos_y);
+    auto far_z = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(bounds[accel_r.inv_octants[2]]), rcp_z), pos_z);
+
+    auto tn = _mm256_max_ps(_mm256_max_ps(near_x, near_y), near_z);
+    auto tf = _mm256_min_ps(_mm256_set1_ps(accel_r.r.tmax), _mm256_min_ps(_mm256_min_ps(far_x, far_y), far_z));
+
+    _mm256_storeu_ps(tmin, tn);
+
+    auto start = _mm256_max_ps(_mm256_setzero_ps(), _mm256_set1_ps(accel_r.r.tmin));
+
+    return std::uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(tf, _mm256_max_ps(start, tn), _CMP_GE_OQ)));
+  }
 };
 
-//! \brief Calculates the center of a floating-point bounding box.
+#endif
+
+//! Tests a box against all of the rays of a packet.
+//! The distances of all of the rays are computed in one loop
+//! without branches, so that it may be vectorized.
 //!
-//! \tparam scalar_type The type of the box vector components.
-//! In this function, this is a floating point type.
+//! \param box The box to test.
 //!
-//! \param box The box to get the center of.
+//! \param packet The rays to test the box against.
 //!
-//! \return The center point of the box.
-template <typename scalar_type, typename = std::enable_if_t<std::is_floating_point<scalar_type>::value>>
-auto center_of(const aabb<scalar_type>& box) noexcept {
-  return (box.min + box.max) * scalar_type(0.5);
-}
-
-//! \brief Calculates the center of a non-floating-point bounding box.
+//! \param inv_pos The negated ray positions, scaled by the reciprocal directions.
 //!
-//! \tparam scalar_type The type of the box vector components.
-//! In this function, this type would not be a floating point type.
+//! \param active The rays to test. Other rays are never reported as hits.
 //!
-//! \param box The box to get the center point of.
+//! \param tmin Receives the entry distance of each ray.
 //!
-//! \return The center point of the box.
-template <typename scalar_type, std::enable_if_t<!std::is_floating_point<scalar_type>::value>>
-auto center_of(const aabb<scalar_type>& box) noexcept {
-  return (box.min + box.max) / 2;
+//! \return A mask with one bit set for each active ray that hits the box.
+template <typename scalar_type, size_type count, typename mask_type>
+mask_type intersect_packet(const aabb<scalar_type>& box, const ray_packet<scalar_type, count>& packet, const vec_packet<scalar_type, 3, count>& inv_pos, mask_type active, scalar_type* tmin) noexcept {
+
+  bool hits[count];
+
+  for (size_type i = 0; i < count; i++) {
+
+    auto tx1 = (box.min.x * packet.rcp_dir[0][i]) + inv_pos[0][i];
+    auto tx2 = (box.max.x * packet.rcp_dir[0][i]) + inv_pos[0][i];
+    auto ty1 = (box.min.y * packet.rcp_dir[1][i]) + inv_pos[1][i];
+    auto ty2 = (box.max.y * packet.rcp_dir[1][i]) + inv_pos[1][i];
+    auto tz1 = (box.min.z * packet.rcp_dir[2][i]) + inv_pos[2][i];
+    auto tz2 = (box.max.z * packet.rcp_dir[2][i]) + inv_pos[2][i];
+
+    auto tn = max(max(min(tx1, tx2), min(ty1, ty2)), min(tz1, tz2));
+    auto tf = min(packet.tmax[i], min(min(max(tx1, tx2), max(ty1, ty2)), max(tz1, tz2)));
+
+    tmin[i] = tn;
+
+    hits[i] = tf >= max(max(scalar_type(0), packet.tmin[i]), tn);
+  }
+
+  mask_type mask = 0;
+
+  for (size_type i = 0; i < count; i++) {
+    mask |= mask_type(hits[i]) << i;
+  }
+
+  return mask & active;
 }
 
-//! \brief Gets an empty bounding box.
-//! An empty box has the property that any union this
+//! \brief Tests a box against all of the rays of a packet.
+//! This is specialized for float packets when the kernels
+//! of @ref cpu_simd_level are available.
+//!
+//! \tparam scalar_type The type used for vector components.
+//!
+//! \tparam count The number of rays in a packet.
+template <typename scalar_type, size_type count>
+struct packet_box_test final {
+  //! Tests a box against the rays of a packet.
+  //! See @ref intersect_packet for details.
+  template <typename mask_type>
+  static mask_type intersect(const aabb<scalar_type>& box, const ray_packet<scalar_type, count>& packet, const vec_packet<scalar_type, 3, count>& inv_pos, mask_type active, scalar_type* tmin) noexcept {
+    return intersect_packet(box, packet, inv_pos, active, tmin);
+  }
+};
+
+#ifdef LBVH_SIMD_DISPATCH
+
+//! \brief Tests a box against a packet of float rays with AVX2 or
+//! AVX-512, eight or sixteen rays at a time. Packets that aren't a
+//! multiple of eight, or CPUs without AVX2, use the portable loop.
+//!
+//! \tparam count The number of rays in a packet.
+template <size_type count>
+struct packet_box_test<float, count> final {
+  //! Tests a box against the rays of a packet.
+  //! See @ref intersect_packet for details.
+  template <typename mask_type>
+  static mask_type intersect(const aabb<float>& box, const ray_packet<float, count>& packet, const vec_packet<float, 3, count>& inv_pos, mask_type active, float* tmin) noexcept {
+
+    const float bounds[6] { box.min.x, box.min.y, box.min.z, box.max.x, box.max.y, box.max.z };
+
+    mask_type mask = 0;
+
+    switch (simd_level_for(count)) {
+      case simd_level::avx512:
+        for (size_type i = 0; i < count; i += avx512_kernels::width()) {
+          mask |= mask_type(avx512_kernels::box_test(bounds, &packet.rcp_dir.values[i], &inv_pos.values[i], count, packet.tmin + i, packet.tmax + i, tmin + i)) << i;
+        }
+        break;
+      case simd_level::avx2:
+        for (size_type i = 0; i < count; i += avx2_kernels::width()) {
+          mask |= mask_type(avx2_kernels::box_test(bounds, &packet.rcp_dir.values[i], &inv_pos.values[i], count, packet.tmin + i, packet.tmax + i, tmin + i)) << i;
+        }
+        break;
+      case simd_level::none:
+        return intersect_packet(box, packet, inv_pos, active, tmin);
+    }
+
+    return mask & active;
+  }
+};
+
+#endif // LBVH_SIMD_DISPATCH
+
+//! \brief Describes the digits sorted by each pass of the radix sort.
+struct radix_digit final {
+  //! The number of bits in one digit.
+  static constexpr size_type bits() noexcept {
+    return 11;
+  }
+  //! The number of values that one digit can have.
+  static constexpr size_type size() noexcept {
+    return size_type(1) << bits();
+  }
+  //! Extracts a digit from a code.
+  //!
+  //! \param code The code to get the digit of.
+  //!
+  //! \param shift The bit position of the digit.
+  //!
+  //! \return The value of the digit.
+  template <typename code_type>
+  static constexpr size_type of(code_type code, size_type shift) noexcept {
+    return size_type(code >> shift) & (size() - 1);
+  }
+};
+
+//! \brief Counts the digits of the entries in each block,
+//! for one pass of the radix sort. Can be called by the
+//! scheduler from many threads.
+//!
+//! \tparam entry_type The type of the entries being sorted.
+template <typename entry_type>
+class radix_count_kernel final {
+public:
+  //! Constructs a new radix count kernel.
+  //!
+  //! \param e The entries to count the digits of.
+  //!
+  //! \param c The number of entries.
+  //!
+  //! \param h The histograms to fill, one per block.
+  //!
+  //! \param bc The number of blocks the entries are split into.
+  //!
+  //! \param s The bit position of the digit being counted.
+  constexpr radix_count_kernel(const entry_type* e, size_type c, size_type* h, size_type bc, size_type s) noexcept
+    : entries(e), count(c), histograms(h), block_count(bc), shift(s) {}
+  //! Counts the digits of the blocks in the given work division.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto block_range = loop_range(div, block_count);
+
+    for (auto b = block_range.begin; b < block_range.end; b++) {
+
+      auto* histogram = histograms + (b * radix_digit::size());
+
+      std::fill(histogram, histogram + radix_digit::size(), size_type(0));
+
+      auto range = loop_range(work_division { b, block_count, b }, count);
+
+      for (auto i = range.begin; i < range.end; i++) {
+        histogram[radix_digit::of(entries[i].code, shift)]++;
+      }
+    }
+  }
+private:
+  //! The entries to count the digits of.
+  const entry_type* entries;
+  //! The number of entries.
+  size_type count;
+  //! The histograms of each block.
+  size_type* histograms;
+  //! The number of blocks.
+  size_type block_count;
+  //! The bit position of the digit.
+  size_type shift;
+};
+
+//! \brief Moves the entries of each block to their sorted
+//! position, for one pass of the radix sort. Can be called
+//! by the scheduler from many threads.
+//!
+//! \tparam entry_type The type of the entries being sorted.
+template <typename entry_type>
+class radix_scatter_kernel final {
+public:
+  //! Constructs a new radix scatter kernel.
+  //!
+  //! \param in The entries to be moved.
+  //!
+  //! \param out The array receiving the moved entries.
+  //!
+  //! \param c The number of entries.
+  //!
+  //! \param o The output offsets of each digit, for each block.
+  //!
+  //! \param bc The number of blocks the entries are split into.
+  //!
+  //! \param s The bit position of the digit being sorted.
+  constexpr radix_scatter_kernel(const entry_type* in, entry_type* out, size_type c, size_type* o, size_type bc, size_type s) noexcept
+    : input(in), output(out), count(c), offsets(o), block_count(bc), shift(s) {}
+  //! Moves the blocks of the given work division.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto block_range = loop_range(div, block_count);
+
+    for (auto b = block_range.begin; b < block_range.end; b++) {
+
+      auto* block_offsets = offsets + (b * radix_digit::size());
+
+      auto range = loop_range(work_division { b, block_count, b }, count);
+
+      for (auto i = range.begin; i < range.end; i++) {
+        output[block_offsets[radix_digit::of(input[i].code, shift)]++] = input[i];
+      }
+    }
+  }
+private:
+  //! The entries being moved.
+  const entry_type* input;
+  //! The array receiving the entries.
+  entry_type* output;
+  //! The number of entries.
+  size_type count;
+  //! The output offsets of each block.
+  size_type* offsets;
+  //! The number of blocks.
+  size_type block_count;
+  //! The bit position of the digit.
+  size_type shift;
+};
+
+//! \brief Sorts entries by their code with a parallel LSD radix sort.
+//! The entries are split into one block per thread. Each pass counts
+//! the digits of every block, turns the counts into output offsets and
+//! then moves the blocks to their sorted positions. The sort is stable.
+//!
+//! \param entries The entries to sort.
+//!
+//! \param scratch The buffer to move the entries into on every other pass.
+//! It's resized to fit the entries, and may be swapped with @p entries,
+//! so both must use the same memory resource.
+//!
+//! \param scheduler The scheduler to run the passes on.
+template <typename entry_type, typename task_scheduler>
+void radix_sort(pmr::vector<entry_type>& entries, pmr::vector<entry_type>& scratch, task_scheduler& scheduler) {
+
+  using code_type = decltype(entry_type::code);
+
+  auto count = entries.size();
+  if (count < 2) {
+    return;
+  }
+
+  auto block_count = scheduler.max_threads();
+
+  scratch.resize(count);
+
+  pmr::vector<size_type> histograms(block_count * radix_digit::size(), entries.get_allocator());
+
+  auto* input = entries.data();
+  auto* output = scratch.data();
+
+  for (size_type shift = 0; shift < (sizeof(code_type) * 8); shift += radix_digit::bits()) {
+
+    radix_count_kernel<entry_type> count_kern(input, count, histograms.data(), block_count, shift);
+
+    scheduler(count_kern);
+
+    // Convert the counts into offsets, ordered
+    // by digit first and by block second.
+
+    size_type offset = 0;
+
+    bool same_digit = false;
+
+    for (size_type d = 0; (d < radix_digit::size()) && !same_digit; d++) {
+
+      auto digit_begin = offset;
+
+      for (size_type b = 0; b < block_count; b++) {
+
+        auto& h = histograms[(b * radix_digit::size()) + d];
+
+        auto digit_count = h;
+
+        h = offset;
+
+        offset += digit_count;
+      }
+
+      same_digit = ((offset - digit_begin) == count);
+    }
+
+    if (same_digit) {
+      // Every entry has the same digit,
+      // so this pass wouldn't move anything.
+      continue;
+    }
+
+    radix_scatter_kernel<entry_type> scatter_kern(input, output, count, histograms.data(), block_count, shift);
+
+    scheduler(scatter_kern);
+
+    std::swap(input, output);
+  }
+
+  if (input != entries.data()) {
+    entries.swap(scratch);
+  }
+}
+
+//! \brief Copies values from one array to another, in the order
+//! given by an index array. Can be called by the scheduler from many threads.
+//!
+//! \tparam value_type The type of the values being copied.
+//!
+//! \tparam index_type The type of the indices.
+template <typename value_type, typename index_type>
+class gather_kernel final {
+public:
+  //! Constructs a new gather kernel.
+  //!
+  //! \param in The values to copy from.
+  //!
+  //! \param out The array receiving the values.
+  //!
+  //! \param idx The index in @p in of each value of @p out.
+  //! If this is null, the values are copied in order.
+  //!
+  //! \param c The number of values to copy.
+  constexpr gather_kernel(const value_type* in, value_type* out, const index_type* idx, size_type c) noexcept
+    : input(in), output(out), indices(idx), count(c) {}
+  //! Copies the values of the given work division.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) {
+
+    auto range = loop_range(div, count);
+
+    if (!indices) {
+      std::copy(input + range.begin, input + range.end, output + range.begin);
+      return;
+    }
+
+    for (auto i = range.begin; i < range.end; i++) {
+      output[i] = input[indices[i]];
+    }
+  }
+private:
+  //! The values being copied.
+  const value_type* input;
+  //! The array receiving the values.
+  value_type* output;
+  //! The source index of each value.
+  const index_type* indices;
+  //! The number of values.
+  size_type count;
+};
+
+//! \brief Moves the values of an array into the order given by a permutation.
+//! Value @p i of the reordered array is value @p indices[i] of the original one.
+//!
+//! \param values The values to reorder.
+//!
+//! \param indices The permutation to apply.
+//!
+//! \param count The number of values.
+//!
+//! \param scheduler The scheduler to distribute the copies with.
+//!
+//! \param resource The memory resource to allocate the temporary copy from.
+template <typename value_type, typename index_type, typename task_scheduler>
+void permute(value_type* values, const index_type* indices, size_type count, task_scheduler& scheduler, pmr::memory_resource* resource) {
+
+  pmr::vector<value_type> scratch(count, resource);
+
+  gather_kernel<value_type, index_type> gather_kern(values, scratch.data(), indices, count);
+
+  scheduler(gather_kern);
+
+  gather_kernel<value_type, index_type> copy_kern(scratch.data(), values, nullptr, count);
+
+  scheduler(copy_kern);
+}
+
+//! \brief Replaces each value of an array with the sum of the values before it.
+//! The array is split into one block per thread. The blocks are summed in
+//! parallel, the block sums are scanned and then each block is scanned in parallel.
+//!
+//! \param values The values to scan.
+//!
+//! \param count The number of values.
+//!
+//! \param scheduler The scheduler to distribute the work with.
+//!
+//! \param resource The memory resource to allocate the block sums from.
+//!
+//! \return The sum of all the values.
+template <typename value_type, typename task_scheduler>
+value_type exclusive_scan(value_type* values, size_type count, task_scheduler& scheduler, pmr::memory_resource* resource) {
+
+  auto block_count = scheduler.max_threads();
+
+  pmr::vector<value_type> block_sums(block_count, resource);
+
+  auto sum_blocks = [](const work_division& div, const value_type* in, size_type n, value_type* sums, size_type blocks) {
+    auto block_range = loop_range(div, blocks);
+    for (auto b = block_range.begin; b < block_range.end; b++) {
+      auto range = loop_range(work_division { b, blocks, b }, n);
+      value_type sum = 0;
+      for (auto i = range.begin; i < range.end; i++) {
+        sum += in[i];
+      }
+      sums[b] = sum;
+    }
+  };
+
+  scheduler(sum_blocks, values, count, block_sums.data(), block_count);
+
+  value_type total = 0;
+
+  for (auto& sum : block_sums) {
+    auto block_sum = sum;
+    sum = total;
+    total += block_sum;
+  }
+
+  auto scan_blocks = [](const work_division& div, value_type* out, size_type n, const value_type* offsets, size_type blocks) {
+    auto block_range = loop_range(div, blocks);
+    for (auto b = block_range.begin; b < block_range.end; b++) {
+      auto range = loop_range(work_division { b, blocks, b }, n);
+      auto offset = offsets[b];
+      for (auto i = range.begin; i < range.end; i++) {
+        auto value = out[i];
+        out[i] = offset;
+        offset += value;
+      }
+    }
+  };
+
+  scheduler(scan_blocks, values, count, block_sums.data(), block_count);
+
+  return total;
+}
+
+//! \brief This class represents a space filling curve.
+//!
+//! \tparam code_type The type used for units of the curve.
+template <typename code_type>
+class space_filling_curve final {
+public:
+  //! Represents a single entry within the curve table.
+  struct entry final {
+    //! Let's make the code and the primitive index the same size
+    //! by using this type definition.
+    using index_type = typename associated_types<sizeof(code_type)>::uint_type;
+    //! The code at this point along the curve.
+    code_type code;
+    //! The index to the primitive associated with this point.
+    index_type primitive;
+  };
+  //! A type definition for a vector of entries.
+  using entry_vec = pmr::vector<entry>;
+  //! Constructs a space filling curve.
+  //! \param entries_ The entries to assign the curve.
+  space_filling_curve(entry_vec&& entries_) noexcept
+    : entries(std::move(entries_)) {}
+  //! Constructs a curve via move semantics.
+  space_filling_curve(space_filling_curve&& other) noexcept
+    : entries(std::move(other.entries)) {}
+  //! Sorts the space filling curve based on the code of each entry.
+  //! This is done with a parallel radix sort, unless LBVH_NO_RADIX_SORT
+  //! is defined, in which case a single threaded comparison sort is used.
+  //!
+  //! \param scheduler The scheduler to distribute the sorting work with.
+  //!
+  //! \param buffer The scratch buffer used by the radix sort.
+  template <typename task_scheduler>
+  void sort(task_scheduler& scheduler, entry_vec& buffer) {
+#ifndef LBVH_NO_RADIX_SORT
+    radix_sort(entries, buffer, scheduler);
+#else
+    (void)scheduler;
+    (void)buffer;
+    auto cmp = [](const entry& a, const entry& b) {
+      return a.code < b.code;
+    };
+    std::sort(entries.begin(), entries.end(), cmp);
+#endif
+  }
+  //! Indicates the number of entries in the space filling curve.
+  inline auto size() const noexcept {
+    return entries.size();
+  }
+  //! Accesses a specific entry within the space filling curve.
+  //! \param index The index of the entry to access.
+  inline const auto& operator [] (size_type index) const noexcept {
+    return entries[index];
+  }
+  //! Gets the primitive index of each entry, in curve order.
+  //!
+  //! \param scheduler The scheduler to distribute the copies with.
+  //!
+  //! \param indices Receives one primitive index per entry.
+  template <typename task_scheduler, typename index_type>
+  void primitive_indices(task_scheduler& scheduler, pmr::vector<index_type>& indices) const {
+
+    auto index_of = [](const work_division& div, const entry* in, index_type* out, size_type count) {
+      auto range = loop_range(div, count);
+      for (auto i = range.begin; i < range.end; i++) {
+        out[i] = index_type(in[i].primitive);
+      }
+    };
+
+    indices.resize(entries.size());
+
+    scheduler(index_of, entries.data(), indices.data(), entries.size());
+  }
+  //! Moves the entries out of the curve, so that
+  //! their memory can be used by the next curve.
+  //!
+  //! \return The entries of the curve.
+  entry_vec release() noexcept {
+    return std::move(entries);
+  }
+
+  space_filling_curve(const space_filling_curve&) = delete;
+  space_filling_curve& operator = (const space_filling_curve&) = delete;
+private:
+  //! The entries of the space filling curve.
+  entry_vec entries;
+};
+
+//! \brief Calculates the center of a floating-point bounding box.
+//!
+//! \tparam scalar_type The type of the box vector components.
+//! In this function, this is a floating point type.
+//!
+//! \param box The box to get the center of.
+//!
+//! \return The center point of the box.
+template <typename scalar_type, typename = std::enable_if_t<std::is_floating_point<scalar_type>::value>>
+auto center_of(const aabb<scalar_type>& box) noexcept {
+  return (box.min + box.max) * scalar_type(0.5);
+}
+
+//! \brief Calculates the center of a non-floating-point bounding box.
+//!
+//! \tparam scalar_type The type of the box vector components.
+//! In this function, this type would not be a floating point type.
+//!
+//! \param box The box to get the center point of.
+//!
+//! \return The center point of the box.
+template <typename scalar_type, std::enable_if_t<!std::is_floating_point<scalar_type>::value>>
+auto center_of(const aabb<scalar_type>& box) noexcept {
+  return (box.min + box.max) / 2;
+}
+
+//! \brief Gets an empty bounding box.
+//! An empty box has the property that any union this
 //! box has with another box is equal to the other box.
 //!
 //! \return An empty box.
@@ -1208,11 +4098,58 @@ auto size_of(const aabb<scalar_type>& box) noexcept {
   return box.max - box.min;
 }
 
-//! \brief This class is used for calculating the centroid boundaries in the scene.
+//! \brief Calculates the surface area of a bounding box.
+//! This is used by the surface area heuristic.
 //!
-//! \tparam scalar_type The scalar type of the bounding box to get.
+//! \param box The box to get the surface area of.
 //!
-//! \tparam primitive_type The type of primitive in the scene.
+//! \return The surface area of the box.
+template <typename scalar_type>
+scalar_type surface_area(const aabb<scalar_type>& box) noexcept {
+  auto size = size_of(box);
+  return 2 * ((size.x * size.y) + (size.y * size.z) + (size.z * size.x));
+}
+
+//! \brief Bounds a box after it's moved by an affine transformation.
+//! Each component of the result is the sum of the smallest and
+//! largest products of a matrix row with the box, as done by Arvo.
+//!
+//! \return The smallest box containing @p box, transformed by @p t.
+template <typename scalar_type>
+auto transform_box(const transform<scalar_type>& t, const aabb<scalar_type>& box) noexcept {
+
+  scalar_type in_min[3] { box.min.x, box.min.y, box.min.z };
+  scalar_type in_max[3] { box.max.x, box.max.y, box.max.z };
+
+  scalar_type out_min[3];
+  scalar_type out_max[3];
+
+  for (size_type i = 0; i < 3; i++) {
+
+    out_min[i] = t.m[i][3];
+    out_max[i] = t.m[i][3];
+
+    for (size_type j = 0; j < 3; j++) {
+
+      auto a = t.m[i][j] * in_min[j];
+      auto b = t.m[i][j] * in_max[j];
+
+      out_min[i] += min(a, b);
+      out_max[i] += max(a, b);
+    }
+  }
+
+  return aabb<scalar_type> {
+    { out_min[0], out_min[1], out_min[2] },
+    { out_max[0], out_max[1], out_max[2] }
+  };
+}
+
+//! \brief This class is used for calculating the centroid boundaries in the scene.
+//!
+//! \tparam scalar_type The scalar type of the bounding box to get.
+//!
+//! \tparam primitive_type The type of primitive in the scene.
 //!
 //! \tparam aabb_converter Calculates the bounding box of a primitive.
 template <typename scalar_type, typename primitive_type, typename aabb_converter>
@@ -1230,7 +4167,8 @@ public:
   //!
   //! \param thb The array of boxes per thread. Each thread
   //! will find a box for a certain portion of the scene. This
-  //! array should have as many boxes as there are threads.
+  //! array should have as many boxes as there are threads,
+  //! each initialized to an empty box.
   centroid_bounds_kernel(const primitive_type* p, size_type c, const aabb_converter& cvt, box_type* thb)
     : primitives(p), count(c), converter(cvt), thread_boxes(thb) {
   }
@@ -1252,7 +4190,7 @@ public:
       box = union_of(box, center_of(converter(primitives[i])));
     }
 
-    thread_boxes[div.idx] = box;
+    thread_boxes[div.thread] = union_of(thread_boxes[div.thread], box);
   }
 private:
   //! The array of primitives to get the bounding box of.
@@ -1266,6 +4204,93 @@ private:
   box_type* thread_boxes;
 };
 
+//! \brief This class is used for computing the bounding box of each
+//! primitive, while also calculating the centroid boundaries in the scene.
+//!
+//! \tparam scalar_type The scalar type of the bounding boxes.
+//!
+//! \tparam primitive_type The type of primitive in the scene.
+//!
+//! \tparam aabb_converter Calculates the bounding box of a primitive.
+template <typename scalar_type, typename primitive_type, typename aabb_converter>
+class box_cache_kernel final {
+public:
+  //! A type definition for the boxes computed by this class.
+  using box_type = aabb<scalar_type>;
+  //! Constructs a new box cache kernel.
+  //!
+  //! \param p The array of primitives to get the boxes of.
+  //!
+  //! \param c The number of primitives in the array.
+  //!
+  //! \param cvt The primitive to bounding box converter.
+  //!
+  //! \param b The array receiving the box of each primitive.
+  //!
+  //! \param thb The array of centroid boxes per thread, as in @ref centroid_bounds_kernel.
+  box_cache_kernel(const primitive_type* p, size_type c, const aabb_converter& cvt, box_type* b, box_type* thb)
+    : primitives(p), count(c), converter(cvt), boxes(b), thread_boxes(thb) {
+  }
+  //! Runs the kernel.
+  //!
+  //! \param div Given by the scheduler to indicate which
+  //! portion of the scene this call should get the boxes of.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    auto box = get_empty_aabb<scalar_type>();
+
+    for (size_type i = range.begin; i < range.end; i++) {
+      boxes[i] = converter(primitives[i]);
+      box = union_of(box, center_of(boxes[i]));
+    }
+
+    thread_boxes[div.thread] = union_of(thread_boxes[div.thread], box);
+  }
+private:
+  //! The array of primitives to get the boxes of.
+  const primitive_type* primitives;
+  //! The number of primitives in the primitive array.
+  size_type count;
+  //! The primitive to bounding box converter.
+  const aabb_converter& converter;
+  //! The array receiving the primitive boxes.
+  box_type* boxes;
+  //! The array of centroid boxes, each box allocated
+  //! for a thread.
+  box_type* thread_boxes;
+};
+
+//! \brief A box converter for primitives that are boxes themselves.
+//! This is used to build from precomputed primitive boxes.
+//!
+//! \tparam scalar_type The scalar type of the box vectors.
+template <typename scalar_type>
+struct box_identity final {
+  //! Gets the box of a primitive box.
+  //!
+  //! \return The box passed to this function.
+  inline const aabb<scalar_type>& operator () (const aabb<scalar_type>& box) const noexcept {
+    return box;
+  }
+};
+
+//! \brief A box converter for instances.
+//! This is used to build a top level BVH over instances.
+//!
+//! \tparam scalar_type The scalar type of the box vectors.
+template <typename scalar_type>
+struct instance_box final {
+  //! Gets the box of an instance.
+  //!
+  //! \return The root box of the instanced BVH, moved into the scene.
+  template <typename primitive_type>
+  auto operator () (const instance<scalar_type, primitive_type>& inst) const noexcept {
+    return transform_box(inst.object_to_world, (*inst.blas)[0].box);
+  }
+};
+
 //! \brief Used to get the domain of Morton coordinates,
 //! based on the size of the type being used.
 template <size_type type_size>
@@ -1467,14 +4492,33 @@ public:
   //! \return A space filling curve with Morton codes.
   template <typename primitive, typename aabb_converter>
   curve_type operator () (const primitive* primitives, size_type count, const aabb_converter& converter) {
-
-    using entry_vec = typename curve_type::entry_vec;
-
-    using box_type = aabb<scalar_type>;
+    return (*this)(primitives, count, converter, get_centroid_bounds(primitives, count, converter));
+  }
+  //! Calculates the box containing the center of every primitive box.
+  //!
+  //! \param primitives The array of primitives to get the bounds of.
+  //!
+  //! \param count The number of primitives in the primitive array.
+  //!
+  //! \param converter The primitive to bounding box converter.
+  //!
+  //! \return The centroid bounds of the primitives.
+  template <typename primitive, typename aabb_converter>
+  aabb<scalar_type> get_centroid_bounds(const primitive* primitives, size_type count, const aabb_converter& converter) {
+    pmr::vector<aabb<scalar_type>> thread_boxes;
+    return get_centroid_bounds(primitives, count, converter, thread_boxes);
+  }
+  //! Calculates the box containing the center of every primitive box.
+  //!
+  //! \param thread_boxes Receives the centroid bounds found by each thread.
+  //!
+  //! \return The centroid bounds of the primitives.
+  template <typename primitive, typename aabb_converter>
+  aabb<scalar_type> get_centroid_bounds(const primitive* primitives, size_type count, const aabb_converter& converter, pmr::vector<aabb<scalar_type>>& thread_boxes) {
 
     using centroid_bounds_kernel_type = centroid_bounds_kernel<scalar_type, primitive, aabb_converter>;
 
-    std::vector<box_type> thread_boxes(scheduler.max_threads());
+    thread_boxes.assign(scheduler.max_threads(), get_empty_aabb<scalar_type>());
 
     centroid_bounds_kernel_type scene_bounds_kern(primitives, count, converter, thread_boxes.data());
 
@@ -1486,7 +4530,30 @@ public:
       centroid_bounds = union_of(centroid_bounds, th_box);
     }
 
-    entry_vec entries(count);
+    return centroid_bounds;
+  }
+  //! Converts a set of primitives into a space filling curve,
+  //! with centroid bounds that have already been calculated.
+  //!
+  //! \param centroid_bounds The box containing the center of every primitive box.
+  //!
+  //! \return A space filling curve with Morton codes.
+  template <typename primitive, typename aabb_converter>
+  curve_type operator () (const primitive* primitives, size_type count, const aabb_converter& converter, const aabb<scalar_type>& centroid_bounds) {
+    return (*this)(primitives, count, converter, centroid_bounds, typename curve_type::entry_vec());
+  }
+  //! Converts a set of primitives into a space filling curve,
+  //! reusing the memory of a previous curve.
+  //!
+  //! \param centroid_bounds The box containing the center of every primitive box.
+  //!
+  //! \param entries The vector to put the curve into. Its contents are overwritten.
+  //!
+  //! \return A space filling curve with Morton codes.
+  template <typename primitive, typename aabb_converter>
+  curve_type operator () (const primitive* primitives, size_type count, const aabb_converter& converter, const aabb<scalar_type>& centroid_bounds, typename curve_type::entry_vec&& entries) {
+
+    entries.resize(count);
 
     morton_curve_kernel<scalar_type, primitive> curve_kernel(primitives, entries.data(), count);
 
@@ -1496,6 +4563,70 @@ public:
   }
 };
 
+//! \brief The buffers that a @ref builder keeps between builds.
+//! Rebuilding a BVH of about the same size then reuses their memory
+//! instead of allocating and clearing new buffers every time.
+//! Copies of the scratch buffers start out empty.
+//!
+//! \tparam scalar_type The scalar type of the builder.
+template <typename scalar_type>
+struct build_scratch final {
+  //! A type definition for a node index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! A type definition for the curve entries.
+  using entry_vec = typename space_filling_curve<typename associated_types<sizeof(scalar_type)>::uint_type>::entry_vec;
+  //! The memory resource of the builder.
+  pmr::memory_resource* resource;
+  //! The entries of the Morton curve.
+  entry_vec entries;
+  //! The second buffer used when sorting the curve.
+  entry_vec sort_buffer;
+  //! The primitive boxes, when they're cached.
+  pmr::vector<aabb<scalar_type>> boxes;
+  //! The centroid bounds found by each thread.
+  pmr::vector<aabb<scalar_type>> thread_boxes;
+  //! The parent of each node.
+  pmr::vector<index_type> parents;
+  //! The number of children of each node that are visited bottom up.
+  pmr::vector<std::uint8_t> child_counts;
+  //! The visit counter of each node for the bottom up passes.
+  //! These are reset by the passes themselves, so they're
+  //! all zero again once a pass is done.
+  pmr::vector<std::atomic<std::uint32_t>> visits;
+  //! Constructs empty scratch buffers.
+  //!
+  //! \param r The memory resource to allocate the buffers from.
+  explicit build_scratch(pmr::memory_resource* r)
+    : resource(r), entries(r), sort_buffer(r), boxes(r),
+      thread_boxes(r), parents(r), child_counts(r), visits(r) {}
+  //! Constructs empty scratch buffers, since copying them is of no use.
+  build_scratch(const build_scratch& other) : build_scratch(other.resource) {}
+  //! Moves the scratch buffers of another builder.
+  build_scratch(build_scratch&&) = default;
+  //! Keeps the buffers as they are, since copying them is of no use.
+  build_scratch& operator = (const build_scratch&) noexcept {
+    return *this;
+  }
+  //! Keeps the buffers as they are, since the
+  //! memory resources of the two may differ.
+  build_scratch& operator = (build_scratch&&) noexcept {
+    return *this;
+  }
+  //! Makes sure that there is a zeroed visit counter for each node.
+  //!
+  //! \param count The number of nodes.
+  //!
+  //! \return A pointer to the first visit counter.
+  std::atomic<std::uint32_t>* visits_for(size_type count) {
+    if (visits.size() < count) {
+      // The counters can't be moved, so the new ones are swapped in.
+      pmr::vector<std::atomic<std::uint32_t>> grown(count, resource);
+      visits.swap(grown);
+    }
+    return visits.data();
+  }
+};
+
 //! \brief Represents a division of an internal LBVH node.
 struct node_division final {
   //! The first index of the division.
@@ -1526,344 +4657,3571 @@ struct node_division final {
 template <typename code_type>
 node_division divide_node(const space_filling_curve<code_type>& table, size_type node_index) noexcept {
 
-  // Used as the return value of the delta operator.
-  using delta_type = typename associated_types<sizeof(code_type)>::int_type;
+  // Used as the return value of the delta operator.
+  using delta_type = typename associated_types<sizeof(code_type)>::int_type;
+
+  // The type used for offsets.
+  using offset_type = typename associated_types<sizeof(code_type)>::int_type;
+
+  // Calculates upper bits, or returns -1
+  // if 'k' is out of bounds. Appears in the
+  // LBVH paper as 'δ' (lower case delta)
+  auto calc_delta = [&table](offset_type j, offset_type k) -> delta_type {
+
+    if ((k < 0) || (k >= offset_type(table.size()))) {
+      // Suggested by the paper for out of bounds 'k'
+      return -1;
+    }
+
+    auto l_code = table[size_type(j)].code;
+    auto r_code = table[size_type(k)].code;
+
+    using clz_input_type = typename associated_types<sizeof(code_type)>::uint_type;
+
+    if (l_code == r_code) {
+      // Suggested by the paper in
+      // case the code are equal.
+      return clz(clz_input_type(j ^ k)) + delta_type(sizeof(code_type) * 8);
+    } else {
+      return clz(clz_input_type(l_code ^ r_code));
+    }
+  };
+
+  // It's easier in this function to regard
+  // all indices as signed offset types.
+  auto i = offset_type(node_index);
+
+  auto table_size = offset_type(table.size());
+
+  auto d = sign(calc_delta(i, i + 1) - calc_delta(i, i - 1));
+
+  auto delta_min = calc_delta(i, i - d);
+
+  offset_type l_max = 128;
+
+  while (true) {
+
+    auto k = i + (l_max * d);
+
+    if (k >= table_size) {
+      break;
+    }
+
+    if (!(calc_delta(i, k) > delta_min)) {
+      break;
+    }
+
+    l_max *= 4;
+  }
+
+  offset_type l = 0;
+
+  for (offset_type div = 2; true; div *= 2) {
+
+    auto t = l_max / div;
+
+    auto k = i + ((l + t) * d);
+
+    if (calc_delta(i, k) > delta_min) {
+      l += t;
+    }
+
+    if (t == 1) {
+      break;
+    }
+  }
+
+  auto j = i + (l * d);
+
+  auto delta_node = calc_delta(i, j);
+
+  offset_type s = 0;
+
+  for (offset_type div = 2; true; div *= 2) {
+
+    auto t = ceil_div(l, div);
+
+    auto k = i + ((s + t) * d);
+
+    if (calc_delta(i, k) > delta_node) {
+      s += t;
+    }
+
+    if (div >= l) {
+      break;
+    }
+  }
+
+  auto gamma = i + (s * d) + min(d, delta_type(0));
+
+  return node_division {
+    size_type(i),
+    size_type(j),
+    size_type(gamma)
+  };
+}
+
+//! \brief Used for building the BVH nodes.
+//! Can be called by the scheduler from many threads.
+//!
+//! \tparam code_type The type of code contained by the space filling curve.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+template <typename code_type, typename scalar_type>
+class builder_kernel final {
+public:
+  //! A type definition for a space filling curve.
+  using curve_type = space_filling_curve<code_type>;
+  //! A type definition for a node type.
+  using node_type = node<scalar_type>;
+  //! A type definition for a node index.
+  using index_type = typename node_type::index_type;
+  //! Constructs a new builder kernel.
+  //! \param c The curve containing the codes to build the nodes with.
+  //! \param n The allocated node array to put the node data into.
+  //! \param p The array receiving the parent index of each node.
+  //! \param l The primitive index to give the leaf at each curve position.
+  //! If this is null, leaves are given their curve position.
+  constexpr builder_kernel(const curve_type& c, node_type* n, index_type* p, const index_type* l) noexcept
+    : curve(c), nodes(n), parents(p), leaf_indices(l) {}
+  //! Calls the kernel to build a certain portion of the BVH nodes.
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, curve.size() - 1);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      auto node_div = divide_node(curve, i);
+
+      auto l_is_leaf = (node_div.min() == (node_div.split + 0));
+      auto r_is_leaf = (node_div.max() == (node_div.split + 1));
+
+      nodes[i].left  = l_is_leaf ? node_type::make_leaf(leaf_index(node_div.split + 0)) : index_type(node_div.split + 0);
+      nodes[i].right = r_is_leaf ? node_type::make_leaf(leaf_index(node_div.split + 1)) : index_type(node_div.split + 1);
+
+      if (!l_is_leaf) {
+        parents[node_div.split + 0] = index_type(i);
+      }
+
+      if (!r_is_leaf) {
+        parents[node_div.split + 1] = index_type(i);
+      }
+    }
+  }
+private:
+  //! Gets the primitive index of a leaf.
+  //! \param position The position of the leaf along the curve.
+  inline size_type leaf_index(size_type position) const noexcept {
+    return leaf_indices ? size_type(leaf_indices[position]) : position;
+  }
+  //! This is the space filling curve used to determine
+  //! the range and split of each node that this kernel will build.
+  const curve_type& curve;
+  //! A pointer to the node array being constructed.
+  node_type* nodes;
+  //! A pointer to the parent indices of the nodes.
+  index_type* parents;
+  //! The primitive index of each leaf, or null
+  //! if leaves are given their curve position.
+  const index_type* leaf_indices;
+};
+
+//! \brief Finds the nodes of a radix tree that span more than one
+//! Morton cluster, for @ref build_method::hybrid. Can be called
+//! by the scheduler from many threads.
+//!
+//! \tparam code_type The type of code contained by the space filling curve.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+template <typename code_type, typename scalar_type>
+class cluster_mark_kernel final {
+public:
+  //! A type definition for a space filling curve.
+  using curve_type = space_filling_curve<code_type>;
+  //! A type definition for a node index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! Constructs a new cluster mark kernel.
+  //!
+  //! \param c The curve that the radix tree was built from.
+  //!
+  //! \param t Receives one for each node that spans more than one cluster, zero otherwise.
+  //!
+  //! \param pc Receives the number of primitives below each node.
+  //!
+  //! \param n The number of nodes.
+  //!
+  //! \param s The number of trailing code bits that clusters don't have to share.
+  constexpr cluster_mark_kernel(const curve_type& c, std::uint8_t* t, index_type* pc, size_type n, size_type s) noexcept
+    : curve(c), top(t), primitive_counts(pc), count(n), shift(s) {}
+  //! Marks the nodes of the given work division.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      auto node_div = divide_node(curve, i);
+
+      // The curve is sorted, so the ends of the
+      // range are enough to tell if it spans clusters.
+
+      auto first_cluster = curve[node_div.min()].code >> shift;
+      auto last_cluster = curve[node_div.max()].code >> shift;
+
+      top[i] = (first_cluster != last_cluster) ? 1 : 0;
+
+      primitive_counts[i] = index_type(node_div.max() - node_div.min() + 1);
+    }
+  }
+private:
+  //! The curve that the radix tree was built from.
+  const curve_type& curve;
+  //! Receives whether or not each node spans more than one cluster.
+  std::uint8_t* top;
+  //! Receives the number of primitives below each node.
+  index_type* primitive_counts;
+  //! The number of nodes.
+  size_type count;
+  //! The number of trailing code bits that clusters don't have to share.
+  size_type shift;
+};
+
+//! \brief Builds the top levels of a BVH over a set of subtrees
+//! with a binned surface area heuristic, for @ref build_method::hybrid.
+//!
+//! The number of subtrees is small compared to the number of primitives,
+//! so this is done on a single thread.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+template <typename scalar_type>
+class top_level_builder final {
+public:
+  //! A type definition for a node type.
+  using node_type = node<scalar_type>;
+  //! A type definition for a node index.
+  using index_type = typename node_type::index_type;
+  //! A type definition for a bounding box.
+  using box_type = aabb<scalar_type>;
+  //! A subtree that the top levels are built over.
+  struct item final {
+    //! The child index of the subtree, as stored in its parent.
+    index_type child;
+    //! The box of the subtree.
+    box_type box;
+    //! The center of the subtree box.
+    vec3<scalar_type> center;
+    //! The number of primitives in the subtree.
+    index_type primitive_count;
+  };
+  //! The number of bins used to find a split.
+  static constexpr size_type bin_count = 16;
+  //! The depth at which the builder falls back to median splits,
+  //! so that the tree stays shallow enough to be traversed.
+  static constexpr size_type max_depth = 32;
+  //! Constructs a new top level builder.
+  //!
+  //! \param n The nodes of the BVH.
+  //!
+  //! \param p The parent index of each node.
+  //!
+  //! \param s The node indices to put the top levels into, the first being the root.
+  //! There must be one less of these than there are items.
+  //!
+  //! \param i The subtrees to build the top levels over.
+  //!
+  //! \param c The number of subtrees.
+  //!
+  //! \param r The memory resource to allocate the task stack from.
+  constexpr top_level_builder(node_type* n, index_type* p, const index_type* s, item* i, size_type c, pmr::memory_resource* r) noexcept
+    : nodes(n), parents(p), slots(s), items(i), item_count(c), resource(r) {}
+  //! Builds the top levels.
+  void operator () () {
+
+    pmr::vector<task> tasks(resource);
+
+    tasks.push_back(task { 0, item_count, slots[0], 0 });
+
+    size_type next_slot = 1;
+
+    while (!tasks.empty()) {
+
+      auto t = tasks.back();
+
+      tasks.pop_back();
+
+      auto mid = split(t);
+
+      auto make_child = [this, &tasks, &next_slot, &t](size_type begin, size_type end) {
+
+        if ((end - begin) == 1) {
+
+          auto child = items[begin].child;
+
+          if (!node_type::is_leaf(child)) {
+            parents[child] = t.node;
+          }
+
+          return child;
+        }
+
+        auto slot = slots[next_slot++];
+
+        parents[slot] = t.node;
+
+        tasks.push_back(task { begin, end, slot, t.depth + 1 });
+
+        return slot;
+      };
+
+      auto& n = nodes[t.node];
+
+      n.left = make_child(t.begin, mid);
+      n.right = make_child(mid, t.end);
+    }
+  }
+private:
+  //! A range of items to build a node over.
+  struct task final {
+    //! The first item of the range.
+    size_type begin;
+    //! The non-inclusive last item of the range.
+    size_type end;
+    //! The index of the node to build.
+    index_type node;
+    //! The depth of the node.
+    size_type depth;
+  };
+  //! Gets one component of a vector.
+  static scalar_type component(const vec3<scalar_type>& v, size_type axis) noexcept {
+    return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+  }
+  //! Fits the box of a node and splits its items into two groups.
+  //!
+  //! \return The index of the first item in the second group.
+  size_type split(const task& t) {
+
+    auto box = get_empty_aabb<scalar_type>();
+
+    auto centroid_bounds = get_empty_aabb<scalar_type>();
+
+    for (auto i = t.begin; i < t.end; i++) {
+      box = union_of(box, items[i].box);
+      centroid_bounds = union_of(centroid_bounds, items[i].center);
+    }
+
+    nodes[t.node].box = box;
+
+    auto extent = size_of(centroid_bounds);
+
+    size_type axis = 0;
+
+    if (extent.y > component(extent, axis)) {
+      axis = 1;
+    }
+
+    if (extent.z > component(extent, axis)) {
+      axis = 2;
+    }
+
+    auto axis_min = component(centroid_bounds.min, axis);
+
+    auto axis_extent = component(extent, axis);
+
+    auto median_split = [this, &t, axis]() {
+      auto mid = t.begin + ((t.end - t.begin) / 2);
+      auto cmp = [axis](const item& a, const item& b) {
+        return component(a.center, axis) < component(b.center, axis);
+      };
+      std::nth_element(items + t.begin, items + mid, items + t.end, cmp);
+      return mid;
+    };
+
+    if (!(axis_extent > 0) || (t.depth >= max_depth)) {
+      return median_split();
+    }
+
+    auto bin_scale = scalar_type(bin_count) / axis_extent;
+
+    auto bin_of = [axis, axis_min, bin_scale](const item& it) {
+      auto b = size_type((component(it.center, axis) - axis_min) * bin_scale);
+      return min(b, bin_count - 1);
+    };
+
+    box_type bin_boxes[bin_count];
+    size_type bin_primitives[bin_count] {};
+    size_type bin_items[bin_count] {};
+
+    for (auto& bin_box : bin_boxes) {
+      bin_box = get_empty_aabb<scalar_type>();
+    }
+
+    for (auto i = t.begin; i < t.end; i++) {
+      auto b = bin_of(items[i]);
+      bin_boxes[b] = union_of(bin_boxes[b], items[i].box);
+      bin_primitives[b] += items[i].primitive_count;
+      bin_items[b]++;
+    }
+
+    // The cost of putting every bin after 'b' on the right side.
+
+    scalar_type right_costs[bin_count] {};
+    size_type right_items[bin_count] {};
+
+    auto right_box = get_empty_aabb<scalar_type>();
+    size_type right_primitives = 0;
+    size_type right_item_count = 0;
+
+    for (auto b = bin_count - 1; b > 0; b--) {
+      right_box = union_of(right_box, bin_boxes[b]);
+      right_primitives += bin_primitives[b];
+      right_item_count += bin_items[b];
+      right_costs[b - 1] = surface_area(right_box) * scalar_type(right_primitives);
+      right_items[b - 1] = right_item_count;
+    }
+
+    auto left_box = get_empty_aabb<scalar_type>();
+    size_type left_primitives = 0;
+    size_type left_item_count = 0;
+
+    auto best_cost = std::numeric_limits<scalar_type>::infinity();
+    auto best_bin = bin_count;
+
+    for (size_type b = 0; (b + 1) < bin_count; b++) {
+
+      left_box = union_of(left_box, bin_boxes[b]);
+      left_primitives += bin_primitives[b];
+      left_item_count += bin_items[b];
+
+      if ((left_item_count == 0) || (right_items[b] == 0)) {
+        continue;
+      }
+
+      auto cost = (surface_area(left_box) * scalar_type(left_primitives)) + right_costs[b];
+
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_bin = b;
+      }
+    }
+
+    if (best_bin == bin_count) {
+      return median_split();
+    }
+
+    auto on_left = [&bin_of, best_bin](const item& it) {
+      return bin_of(it) <= best_bin;
+    };
+
+    return size_type(std::partition(items + t.begin, items + t.end, on_left) - items);
+  }
+  //! The nodes of the BVH.
+  node_type* nodes;
+  //! The parent index of each node.
+  index_type* parents;
+  //! The node indices to put the top levels into.
+  const index_type* slots;
+  //! The subtrees to build the top levels over.
+  item* items;
+  //! The number of subtrees.
+  size_type item_count;
+  //! The memory resource for the task stack.
+  pmr::memory_resource* resource;
+};
+
+//! \brief Gets the parent index used for the root node.
+//!
+//! \tparam index_type The type used for node indices.
+template <typename index_type>
+inline constexpr index_type no_parent() noexcept {
+  return std::numeric_limits<index_type>::max();
+}
+
+//! \brief The child count given to nodes that a
+//! @ref bottom_up_kernel shouldn't visit.
+inline constexpr std::uint8_t unvisited_node() noexcept {
+  return std::numeric_limits<std::uint8_t>::max();
+}
+
+//! \brief Counts the children of a node that aren't leaves.
+template <typename node_type>
+inline constexpr std::uint32_t internal_child_count(const node_type& n) noexcept {
+  return std::uint32_t(!n.left_is_leaf()) + std::uint32_t(!n.right_is_leaf());
+}
+
+//! \brief Visits the internal nodes of a BVH from the bottom up.
+//! Can be called by the scheduler from many threads.
+//!
+//! The nodes whose children are both leaves are visited first.
+//! Every other node is visited by the thread that finishes the last
+//! of its internal children, which it learns from the visit counter
+//! of the node. A node is therefore always visited after all of its
+//! descendants, and no node is visited twice.
+//!
+//! The number of internal children of each node is counted before
+//! the nodes are visited, which allows the visitor to change the
+//! topology below the node it's visiting. Only counting some of the
+//! children, and giving the other nodes @ref unvisited_node, limits
+//! the visit to the ancestors of a set of nodes.
+//!
+//! \tparam index_type The type used for node indices.
+//!
+//! \tparam visitor_type The function object called for each node index.
+template <typename index_type, typename visitor_type>
+class bottom_up_kernel final {
+public:
+  //! Constructs a new bottom up kernel.
+  //!
+  //! \param p The index of the parent of each node.
+  //!
+  //! \param cc The number of internal children of each node.
+  //!
+  //! \param v The visit counter of each node, all initialized to zero.
+  //! Each counter is reset by the last child to arrive, so they're all
+  //! zero again after the pass and may be used for the next one.
+  //!
+  //! \param c The number of nodes.
+  //!
+  //! \param vis The function object to call for each node.
+  constexpr bottom_up_kernel(const index_type* p, const std::uint8_t* cc, std::atomic<std::uint32_t>* v, size_type c, const visitor_type& vis) noexcept
+    : parents(p), child_counts(cc), visits(v), count(c), visitor(vis) {}
+  //! Starts climbing from the nodes in the given work division.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      if (child_counts[i] != 0) {
+        continue;
+      }
+
+      auto index = index_type(i);
+
+      for (;;) {
+
+        visitor(size_type(index));
+
+        auto parent = parents[index];
+        if (parent == no_parent<index_type>()) {
+          break;
+        }
+
+        // The last child to arrive carries on with the parent.
+        // The counter also makes the boxes written by the other
+        // child visible to this thread.
+
+        auto arrivals = visits[parent].fetch_add(1, std::memory_order_acq_rel) + 1;
+
+        if (arrivals < child_counts[parent]) {
+          break;
+        }
+
+        visits[parent].store(0, std::memory_order_relaxed);
+
+        index = parent;
+      }
+    }
+  }
+private:
+  //! The parent index of each node.
+  const index_type* parents;
+  //! The number of internal children of each node.
+  const std::uint8_t* child_counts;
+  //! The visit counter of each node.
+  std::atomic<std::uint32_t>* visits;
+  //! The number of nodes.
+  size_type count;
+  //! The function object to call for each node.
+  visitor_type visitor;
+};
+
+//! \brief Describes the subtree below a node,
+//! for deciding which subtrees to collapse into leaves.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+template <typename scalar_type>
+struct subtree_info final {
+  //! A type definition for a primitive index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! The surface area heuristic cost of the subtree,
+  //! taking the collapsing decisions below it into account.
+  scalar_type cost;
+  //! The index of the first primitive in the subtree.
+  index_type first;
+  //! The number of primitives in the subtree.
+  index_type count;
+  //! Whether or not the subtree is cheaper as a single leaf.
+  bool collapse;
+};
+
+//! \brief The parameters used to decide which subtrees to collapse.
+//!
+//! \tparam scalar_type The scalar type of the costs.
+template <typename scalar_type>
+struct collapse_params final {
+  //! The cost of traversing a node.
+  scalar_type traversal_cost;
+  //! The cost of intersecting a primitive.
+  scalar_type intersection_cost;
+  //! The maximum number of primitives in a leaf.
+  size_type max_leaf_size;
+};
+
+//! \brief Fits the box of a node to the boxes of its children.
+//! This is meant to be the visitor of a @ref bottom_up_kernel.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+//!
+//! \tparam primitive_type The type of primitive in the scene.
+//!
+//! \tparam aabb_converter Calculates the bounding box of a primitive.
+template <typename scalar_type, typename primitive_type, typename aabb_converter>
+class fit_visitor final {
+public:
+  //! A type definition for a node type.
+  using node_type = node<scalar_type>;
+  //! A type definition for a bounding box.
+  using box_type = aabb<scalar_type>;
+  //! A type definition for the subtree information.
+  using info_type = subtree_info<scalar_type>;
+  //! Constructs a new fit visitor.
+  //!
+  //! \param n The nodes to fit the boxes of.
+  //!
+  //! \param p The primitives that the leaves point to.
+  //!
+  //! \param cvt The primitive to bounding box converter.
+  //!
+  //! \param i If not null, receives the subtree information of each
+  //! node, so that the subtrees may be collapsed after the fit.
+  //!
+  //! \param cp The parameters used to decide which subtrees to collapse.
+  constexpr fit_visitor(node_type* n, const primitive_type* p, const aabb_converter& cvt,
+                        info_type* i = nullptr, const collapse_params<scalar_type>& cp = {}) noexcept
+    : nodes(n), primitives(p), converter(cvt), infos(i), params(cp) {}
+  //! Fits the box of a node.
+  //!
+  //! \param index The index of the node to fit.
+  void operator () (size_type index) const noexcept {
+
+    auto& node = nodes[index];
+
+    auto left_box = node.left_is_leaf()
+      ? leaf_box(node.left_leaf_index(), node.left_leaf_count())
+      : nodes[node.left].box;
+
+    auto right_box = node.right_is_leaf()
+      ? leaf_box(node.right_leaf_index(), node.right_leaf_count())
+      : nodes[node.right].box;
+
+    node.box = union_of(left_box, right_box);
+
+    if (infos) {
+      infos[index] = merge(node,
+                           child_info(node.left, node.left_is_leaf(), node.left_leaf_index(), node.left_leaf_count(), left_box),
+                           child_info(node.right, node.right_is_leaf(), node.right_leaf_index(), node.right_leaf_count(), right_box));
+    }
+  }
+private:
+  //! Gets the box of the primitives in a leaf.
+  box_type leaf_box(size_type first, size_type count) const noexcept {
+
+    auto box = converter(primitives[first]);
+
+    for (size_type i = 1; i < count; i++) {
+      box = union_of(box, converter(primitives[first + i]));
+    }
+
+    return box;
+  }
+  //! Gets the subtree information of a child.
+  info_type child_info(size_type child, bool is_leaf, size_type first, size_type count, const box_type& box) const noexcept {
+
+    if (!is_leaf) {
+      return infos[child];
+    }
+
+    return info_type {
+      params.intersection_cost * scalar_type(count) * surface_area(box),
+      typename info_type::index_type(first),
+      typename info_type::index_type(count),
+      true
+    };
+  }
+  //! Combines the subtree information of two children.
+  info_type merge(const node_type& n, const info_type& l, const info_type& r) const noexcept {
+
+    auto area = surface_area(n.box);
+
+    auto count = l.count + r.count;
+
+    auto internal_cost = (params.traversal_cost * area) + l.cost + r.cost;
+
+    auto leaf_cost = params.intersection_cost * scalar_type(count) * area;
+
+    auto collapse = (count <= params.max_leaf_size) && (leaf_cost <= internal_cost);
+
+    return info_type {
+      collapse ? leaf_cost : internal_cost,
+      min(l.first, r.first),
+      count,
+      collapse
+    };
+  }
+  //! The nodes being fitted.
+  node_type* nodes;
+  //! The primitives that the leaves point to.
+  const primitive_type* primitives;
+  //! The primitive to bounding box converter.
+  const aabb_converter& converter;
+  //! The subtree information of each node, if it's being recorded.
+  info_type* infos;
+  //! The parameters used to decide which subtrees to collapse.
+  collapse_params<scalar_type> params;
+};
+
+//! \brief Finds the nodes that remain after collapsing subtrees.
+//! Can be called by the scheduler from many threads.
+//!
+//! A node remains if neither it nor any of its ancestors is collapsed.
+//! Only ancestors with few enough primitives may be collapsed, so
+//! each node only has to look a few levels up the tree.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+template <typename scalar_type>
+class collapse_mark_kernel final {
+public:
+  //! A type definition for a node index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! Constructs a new collapse mark kernel.
+  //!
+  //! \param i The subtree information of each node.
+  //!
+  //! \param p The parent index of each node.
+  //!
+  //! \param k Receives one for each remaining node and zero for the others.
+  //!
+  //! \param c The number of nodes.
+  //!
+  //! \param m The maximum number of primitives in a leaf.
+  constexpr collapse_mark_kernel(const subtree_info<scalar_type>* i, const index_type* p, index_type* k, size_type c, size_type m) noexcept
+    : infos(i), parents(p), kept(k), count(c), max_leaf_size(m) {}
+  //! Marks the nodes of the given work division.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+      kept[i] = is_kept(i) ? 1 : 0;
+    }
+  }
+private:
+  //! Indicates whether or not a node remains.
+  bool is_kept(size_type index) const noexcept {
+
+    for (;;) {
+
+      if (infos[index].collapse) {
+        return false;
+      }
+
+      if (infos[index].count > max_leaf_size) {
+        return true;
+      }
+
+      auto parent = parents[index];
+      if (parent == no_parent<index_type>()) {
+        return true;
+      }
+
+      index = parent;
+    }
+  }
+  //! The subtree information of each node.
+  const subtree_info<scalar_type>* infos;
+  //! The parent index of each node.
+  const index_type* parents;
+  //! Receives whether or not each node remains.
+  index_type* kept;
+  //! The number of nodes.
+  size_type count;
+  //! The maximum number of primitives in a leaf.
+  size_type max_leaf_size;
+};
+
+//! \brief Copies the remaining nodes into a compacted node array,
+//! turning collapsed children into leaves. Can be called by the
+//! scheduler from many threads.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+template <typename scalar_type>
+class collapse_kernel final {
+public:
+  //! A type definition for a node type.
+  using node_type = node<scalar_type>;
+  //! A type definition for a node index.
+  using index_type = typename node_type::index_type;
+  //! Constructs a new collapse kernel.
+  //!
+  //! \param in The nodes before collapsing.
+  //!
+  //! \param out The array receiving the remaining nodes.
+  //!
+  //! \param i The subtree information of each node.
+  //!
+  //! \param ni The index of each remaining node in the output array.
+  //!
+  //! \param c The number of nodes before collapsing.
+  //!
+  //! \param oc The number of remaining nodes.
+  constexpr collapse_kernel(const node_type* in, node_type* out, const subtree_info<scalar_type>* i, const index_type* ni, size_type c, size_type oc) noexcept
+    : input(in), output(out), infos(i), new_indices(ni), count(c), output_count(oc) {}
+  //! Copies the nodes of the given work division.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      auto next = ((i + 1) < count) ? size_type(new_indices[i + 1]) : output_count;
+      if (next == new_indices[i]) {
+        continue;
+      }
+
+      const auto& in = input[i];
+
+      auto& out = output[new_indices[i]];
+
+      out.box = in.box;
+      out.left = in.left_is_leaf() ? in.left : remap(in.left);
+      out.right = in.right_is_leaf() ? in.right : remap(in.right);
+    }
+  }
+private:
+  //! Gets the new child index of an internal node.
+  index_type remap(index_type child) const noexcept {
+
+    const auto& info = infos[child];
+
+    if (info.collapse) {
+      return node_type::make_leaf(info.first, info.count);
+    }
+
+    return new_indices[child];
+  }
+  //! The nodes before collapsing.
+  const node_type* input;
+  //! The array receiving the remaining nodes.
+  node_type* output;
+  //! The subtree information of each node.
+  const subtree_info<scalar_type>* infos;
+  //! The index of each remaining node in the output array.
+  const index_type* new_indices;
+  //! The number of nodes before collapsing.
+  size_type count;
+  //! The number of remaining nodes.
+  size_type output_count;
+};
+
+//! \brief Restructures the treelet below a node into the topology
+//! with the lowest surface area heuristic cost, as described in
+//! "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies"
+//! by Karras and Aila. This is meant to be the visitor of a @ref bottom_up_kernel.
+//!
+//! A treelet is grown from a node by repeatedly expanding the treelet leaf
+//! with the largest surface area, until it has seven leaves. The best way
+//! to combine the leaves is then found for every subset of them, from the
+//! smallest subsets up, and the internal nodes of the treelet are reused
+//! to form the best topology. The boxes of the nodes are fitted on the way.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+//!
+//! \tparam primitive_type The type of primitive in the scene.
+//!
+//! \tparam aabb_converter Calculates the bounding box of a primitive.
+template <typename scalar_type, typename primitive_type, typename aabb_converter>
+class treelet_visitor final {
+public:
+  //! A type definition for a node type.
+  using node_type = node<scalar_type>;
+  //! A type definition for a node index.
+  using index_type = typename node_type::index_type;
+  //! A type definition for a bounding box.
+  using box_type = aabb<scalar_type>;
+  //! A type definition for the subtree information.
+  using info_type = subtree_info<scalar_type>;
+  //! The number of leaves in a treelet.
+  static constexpr size_type max_leaves = 7;
+  //! The number of leaf subsets of a treelet.
+  static constexpr size_type max_subsets = size_type(1) << max_leaves;
+  //! Constructs a new treelet visitor.
+  //!
+  //! \param n The nodes to restructure.
+  //!
+  //! \param p The parent index of each node.
+  //!
+  //! \param prims The primitives that the leaves point to.
+  //!
+  //! \param cvt The primitive to bounding box converter.
+  //!
+  //! \param i Receives the subtree information of each node.
+  //!
+  //! \param cp The costs used by the surface area heuristic.
+  //!
+  //! \param m The minimum number of primitives below a node for its treelet to be restructured.
+  constexpr treelet_visitor(node_type* n, index_type* p, const primitive_type* prims, const aabb_converter& cvt,
+                            info_type* i, const collapse_params<scalar_type>& cp, size_type m) noexcept
+    : nodes(n), parents(p), primitives(prims), converter(cvt), infos(i), params(cp), min_primitives(m) {}
+  //! Fits and restructures the treelet of a node.
+  //!
+  //! \param index The index of the treelet root.
+  void operator () (size_type index) const noexcept {
+
+    auto& node = nodes[index];
+
+    auto l = child_info(node.left);
+    auto r = child_info(node.right);
+
+    node.box = union_of(l.box, r.box);
+
+    auto area = surface_area(node.box);
+
+    infos[index] = info_type {
+      (params.traversal_cost * area) + l.info.cost + r.info.cost,
+      min(l.info.first, r.info.first),
+      l.info.count + r.info.count,
+      false
+    };
+
+    if (infos[index].count >= min_primitives) {
+      restructure(index_type(index));
+    }
+  }
+private:
+  //! A child of a node, or a leaf of a treelet.
+  struct child final {
+    //! The child index, as stored in the parent node.
+    index_type index;
+    //! The box of the child.
+    box_type box;
+    //! The subtree information of the child.
+    info_type info;
+  };
+  //! The state of a treelet while it's being optimized.
+  struct treelet final {
+    //! The leaves of the treelet.
+    child leaves[max_leaves];
+    //! The number of leaves in the treelet.
+    size_type leaf_count = 0;
+    //! The internal nodes of the treelet, which are reused for the new topology.
+    index_type internals[max_leaves - 1];
+    //! The number of internal nodes in the treelet.
+    size_type internal_count = 0;
+    //! The number of internal nodes that have been reused so far.
+    size_type used_internals = 0;
+    //! The box of each leaf subset.
+    box_type boxes[max_subsets];
+    //! The lowest cost of each leaf subset.
+    scalar_type costs[max_subsets];
+    //! The leaves that go to the left child of each leaf subset.
+    size_type splits[max_subsets];
+  };
+  //! Gets the box and subtree information of a child.
+  child child_info(index_type index) const noexcept {
+
+    if (!node_type::is_leaf(index)) {
+      return child { index, nodes[index].box, infos[index] };
+    }
+
+    auto first = node_type::leaf_index(index);
+    auto count = node_type::leaf_count(index);
+
+    auto box = converter(primitives[first]);
+
+    for (index_type i = 1; i < count; i++) {
+      box = union_of(box, converter(primitives[first + i]));
+    }
+
+    auto cost = params.intersection_cost * scalar_type(count) * surface_area(box);
+
+    return child { index, box, info_type { cost, first, count, false } };
+  }
+  //! Finds the best topology of the treelet below a node and applies it.
+  void restructure(index_type root) const noexcept {
+
+    treelet t;
+
+    t.internals[t.internal_count++] = root;
+    t.leaves[t.leaf_count++] = child_info(nodes[root].left);
+    t.leaves[t.leaf_count++] = child_info(nodes[root].right);
+
+    while (t.leaf_count < max_leaves) {
+
+      size_type largest = t.leaf_count;
+
+      scalar_type largest_area = 0;
+
+      for (size_type i = 0; i < t.leaf_count; i++) {
+
+        if (node_type::is_leaf(t.leaves[i].index)) {
+          continue;
+        }
+
+        auto area = surface_area(t.leaves[i].box);
+
+        if ((largest == t.leaf_count) || (area > largest_area)) {
+          largest = i;
+          largest_area = area;
+        }
+      }
+
+      if (largest == t.leaf_count) {
+        break;
+      }
+
+      auto expanded = t.leaves[largest].index;
+
+      t.internals[t.internal_count++] = expanded;
+      t.leaves[largest] = child_info(nodes[expanded].left);
+      t.leaves[t.leaf_count++] = child_info(nodes[expanded].right);
+    }
+
+    auto full_set = (size_type(1) << t.leaf_count) - 1;
+
+    for (size_type set = 1; set <= full_set; set++) {
+
+      auto lowest_bit = set & (~set + 1);
+
+      auto lowest_leaf = bit_index(lowest_bit);
+
+      if (set == lowest_bit) {
+        t.boxes[set] = t.leaves[lowest_leaf].box;
+        t.costs[set] = t.leaves[lowest_leaf].info.cost;
+        continue;
+      }
+
+      t.boxes[set] = union_of(t.boxes[set & ~lowest_bit], t.leaves[lowest_leaf].box);
+
+      // Only the partitions with the lowest leaf on the
+      // left are tried, since the others are mirror images.
+
+      auto best_cost = std::numeric_limits<scalar_type>::infinity();
+
+      size_type best_split = lowest_bit;
+
+      for (auto left = (set - 1) & set; left != 0; left = (left - 1) & set) {
+
+        if (!(left & lowest_bit)) {
+          continue;
+        }
+
+        auto cost = t.costs[left] + t.costs[set & ~left];
+
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_split = left;
+        }
+      }
+
+      t.costs[set] = (params.traversal_cost * surface_area(t.boxes[set])) + best_cost;
+      t.splits[set] = best_split;
+    }
+
+    if (!(t.costs[full_set] < infos[root].cost)) {
+      return;
+    }
+
+    emit(t, full_set);
+  }
+  //! Writes the best topology of a leaf subset into the nodes of the treelet.
+  //!
+  //! \return The child index of the subset.
+  index_type emit(treelet& t, size_type set) const noexcept {
+
+    if ((set & (set - 1)) == 0) {
+      return t.leaves[bit_index(set)].index;
+    }
+
+    auto index = t.internals[t.used_internals++];
+
+    auto left_set = t.splits[set];
+    auto right_set = set & ~left_set;
+
+    auto left = emit(t, left_set);
+    auto right = emit(t, right_set);
+
+    auto& n = nodes[index];
+    n.box = t.boxes[set];
+    n.left = left;
+    n.right = right;
+
+    if (!node_type::is_leaf(left)) {
+      parents[left] = index;
+    }
+
+    if (!node_type::is_leaf(right)) {
+      parents[right] = index;
+    }
+
+    const auto& l_info = node_type::is_leaf(left) ? leaf_info(t, left_set) : infos[left];
+    const auto& r_info = node_type::is_leaf(right) ? leaf_info(t, right_set) : infos[right];
+
+    infos[index] = info_type {
+      t.costs[set],
+      min(l_info.first, r_info.first),
+      l_info.count + r_info.count,
+      false
+    };
+
+    return index;
+  }
+  //! Gets the subtree information of a treelet leaf, given its one element subset.
+  static const info_type& leaf_info(const treelet& t, size_type set) noexcept {
+    return t.leaves[bit_index(set)].info;
+  }
+  //! Gets the index of the only bit set in a value.
+  static size_type bit_index(size_type bit) noexcept {
+    size_type index = 0;
+    while (bit > 1) {
+      bit >>= 1;
+      index++;
+    }
+    return index;
+  }
+  //! The nodes being restructured.
+  node_type* nodes;
+  //! The parent index of each node.
+  index_type* parents;
+  //! The primitives that the leaves point to.
+  const primitive_type* primitives;
+  //! The primitive to bounding box converter.
+  const aabb_converter& converter;
+  //! The subtree information of each node.
+  info_type* infos;
+  //! The costs used by the surface area heuristic.
+  collapse_params<scalar_type> params;
+  //! The minimum number of primitives below a node for its treelet to be restructured.
+  size_type min_primitives;
+};
+
+//! \brief Finds the position of the first leaf below each node
+//! in a depth first traversal. Can be called by the scheduler from many threads.
+//!
+//! Each node climbs to the root and adds up the primitives of
+//! the left siblings along the way.
+//!
+//! \tparam scalar_type The scalar type used by the node boxes.
+template <typename scalar_type>
+class leaf_offset_kernel final {
+public:
+  //! A type definition for a node type.
+  using node_type = node<scalar_type>;
+  //! A type definition for a node index.
+  using index_type = typename node_type::index_type;
+  //! Constructs a new leaf offset kernel.
+  //!
+  //! \param n The nodes of the BVH.
+  //!
+  //! \param p The parent index of each node.
+  //!
+  //! \param i The subtree information of each node.
+  //!
+  //! \param o Receives the position of the first leaf below each node.
+  //!
+  //! \param c The number of nodes.
+  constexpr leaf_offset_kernel(const node_type* n, const index_type* p, const subtree_info<scalar_type>* i, index_type* o, size_type c) noexcept
+    : nodes(n), parents(p), infos(i), offsets(o), count(c) {}
+  //! Finds the leaf offsets of the given work division.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      index_type offset = 0;
+
+      auto index = index_type(i);
+
+      for (;;) {
+
+        auto parent = parents[index];
+        if (parent == no_parent<index_type>()) {
+          break;
+        }
+
+        const auto& p = nodes[parent];
+
+        if (p.right == index) {
+          offset += p.left_is_leaf() ? p.left_leaf_count() : infos[p.left].count;
+        }
+
+        index = parent;
+      }
+
+      offsets[i] = offset;
+    }
+  }
+private:
+  //! The nodes of the BVH.
+  const node_type* nodes;
+  //! The parent index of each node.
+  const index_type* parents;
+  //! The subtree information of each node.
+  const subtree_info<scalar_type>* infos;
+  //! Receives the position of the first leaf below each node.
+  index_type* offsets;
+  //! The number of nodes.
+  size_type count;
+};
+
+//! \brief Finds the nearest neighbor of each cluster, for
+//! @ref build_method::ploc. Can be called by the scheduler from many threads.
+//!
+//! The distance between two clusters is the surface area of the box around
+//! both of them. Ties go to the neighbor that comes first, so that the
+//! closest pair of clusters always finds each other. A cluster that finds
+//! no neighbor with a finite distance, such as one with a NaN box, pairs up
+//! with the cluster next to it instead, so that every pass still merges.
+//!
+//! \tparam scalar_type The scalar type used by the cluster boxes.
+template <typename scalar_type>
+class neighbor_kernel final {
+public:
+  //! A type definition for a cluster index.
+  using index_type = typename node<scalar_type>::index_type;
+  //! Constructs a new neighbor kernel.
+  //!
+  //! \param b The box of each cluster.
+  //!
+  //! \param n Receives the index of the nearest neighbor of each cluster.
+  //!
+  //! \param c The number of clusters.
+  //!
+  //! \param r The number of clusters to search on either side of each cluster.
+  constexpr neighbor_kernel(const aabb<scalar_type>* b, index_type* n, size_type c, size_type r) noexcept
+    : boxes(b), neighbors(n), count(c), radius(r) {}
+  //! Finds the neighbors of the given work division.
+  //!
+  //! \param div The division of work this function call is responsible for.
+  void operator () (const work_division& div) noexcept {
+
+    auto range = loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      auto first = (i > radius) ? (i - radius) : 0;
+      auto last = min(i + radius + 1, count);
+
+      auto best_area = std::numeric_limits<scalar_type>::infinity();
+
+      auto best = count;
+
+      for (auto j = first; j < last; j++) {
+
+        if (j == i) {
+          continue;
+        }
+
+        auto area = surface_area(union_of(boxes[i], boxes[j]));
+
+        if (area < best_area) {
+          best_area = area;
+          best = j;
+        }
+      }
+
+      if (best == count) {
+        // Pairing up even and odd clusters makes the fallback
+        // neighbors mutual, so they're merged in this pass.
+        best = ((i ^ 1) < count) ? (i ^ 1) : (i - 1);
+      }
+
+      neighbors[i] = index_type(best);
+    }
+  }
+private:
+  //! The box of each cluster.
+  const aabb<scalar_type>* boxes;
+  //! Receives the nearest neighbor of each cluster.
+  index_type* neighbors;
+  //! The number of clusters.
+  size_type count;
+  //! The number of clusters to search on either side of each cluster.
+  size_type radius;
+};
+
+//! Used for traversing the BVH.
+//!
+//! \tparam scalar_type The floating point type to use in the traversal.
+//!
+//! \tparam max The maximum number of entries to allocate on the stack.
+template <typename scalar_type, size_type max>
+class traversal_stack final {
+public:
+  //! The type to be used for a node index.
+  using node_index_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+  //! Contains information regarding a ndoe
+  //! to be traversed.
+  struct entry final {
+    //! The index of the node to traverse.
+    node_index_type node_index;
+    //! The minimum scale at which the ray
+    //! hits this node.
+    scalar_type tmin;
+  };
+  //! Indicates the number of entries remaining
+  //! in the stack.
+  inline size_type remaining() const noexcept {
+    return pos;
+  }
+  //! Removes an entry from the stack.
+  auto pop() noexcept {
+    if (!pos) {
+      return entry { 0, std::numeric_limits<scalar_type>::infinity() };
+    }
+    return entries[--pos];
+  }
+  //! Pushes an item to the stack.
+  //! \param i The index of the node.
+  //! \param t The scale at which the ray intersects this node.
+  void push(size_type i, scalar_type t) noexcept {
+    if (pos < max) {
+      entries[pos++] = entry { node_index_type(i), t };
+    }
+  }
+private:
+  //! The position of the "stack pointer."
+  size_type pos = 0;
+  //! The array of entries to be filled.
+  entry entries[max];
+};
+
+//! \brief The stack used by a packet traversal, where each
+//! entry holds the rays that go on to visit a node.
+//!
+//! \tparam node_index_type The type of a node index.
+//!
+//! \tparam mask_type The type of a mask with one bit per ray.
+//!
+//! \tparam max The maximum number of entries to allocate on the stack.
+template <typename node_index_type, typename mask_type, size_type max>
+class packet_stack final {
+public:
+  //! A node to be traversed by some of the rays.
+  struct entry final {
+    //! The index of the node to traverse.
+    node_index_type node_index;
+    //! The rays that hit the box of the node.
+    mask_type mask;
+  };
+  //! Indicates the number of entries remaining
+  //! in the stack.
+  inline size_type remaining() const noexcept {
+    return pos;
+  }
+  //! Removes an entry from the stack.
+  auto pop() noexcept {
+    if (!pos) {
+      return entry { 0, 0 };
+    }
+    return entries[--pos];
+  }
+  //! Pushes an item to the stack.
+  //! \param i The index of the node.
+  //! \param mask The rays that visit the node.
+  void push(size_type i, mask_type mask) noexcept {
+    if (pos < max) {
+      entries[pos++] = entry { node_index_type(i), mask };
+    }
+  }
+private:
+  //! The position of the "stack pointer."
+  size_type pos = 0;
+  //! The array of entries to be filled.
+  entry entries[max];
+};
+
+//! \brief The header at the start of a file written by @ref save.
+struct bvh_file_header final {
+  //! Identifies the file as a BVH file.
+  char magic[4];
+  //! The version of the file layout.
+  std::uint32_t version;
+  //! The size of the scalar type the BVH was built with.
+  std::uint32_t scalar_size;
+  //! The size of a node, which is checked so that
+  //! a change to the node layout is noticed.
+  std::uint32_t node_size;
+  //! The number of nodes.
+  std::uint64_t node_count;
+  //! The offset of the first node from the start of the file.
+  std::uint64_t node_offset;
+  //! The number of entries in the primitive permutation.
+  std::uint64_t index_count;
+  //! The offset of the primitive permutation from the start of the file.
+  std::uint64_t index_offset;
+};
+
+//! The magic bytes at the start of a BVH file.
+inline const char* bvh_file_magic() noexcept {
+  return "LBVH";
+}
+
+//! The current version of the BVH file layout.
+inline constexpr std::uint32_t bvh_file_version() noexcept {
+  return 1;
+}
+
+//! The alignment of the arrays in a BVH file.
+inline constexpr std::uint64_t bvh_file_alignment() noexcept {
+  return 64;
+}
+
+//! Indicates whether the machine stores values in little endian order,
+//! which is the order that BVH files are written in.
+inline bool is_little_endian() noexcept {
+  std::uint32_t value = 1;
+  unsigned char first_byte = 0;
+  std::memcpy(&first_byte, &value, 1);
+  return first_byte == 1;
+}
+
+//! Walks a binary BVH from the root, nearest child first,
+//! until no node can hold a closer hit than @p closest.
+//!
+//! \param b The BVH to walk.
+//!
+//! \param accel_r The ray to walk the BVH with.
+//!
+//! \param closest The closest hit so far, which is
+//! updated by @p visit_leaf. Farther nodes are skipped.
+//!
+//! \param visit_leaf Called with the first primitive and
+//! the primitive count of each leaf that the ray may hit.
+template <typename scalar_type, typename closest_type, typename leaf_visitor>
+void traverse_closest(bvh_view<scalar_type> b, const accel_ray<scalar_type>& accel_r, const closest_type& closest, leaf_visitor& visit_leaf) {
+
+  using box_intersection_type = box_intersection<scalar_type>;
+
+  if (!b.size()) {
+    return;
+  }
+
+  traversal_stack<scalar_type, 128> stack;
+
+  stack.push(0, std::numeric_limits<scalar_type>::infinity());
+
+  while (stack.remaining()) {
+
+    auto entry = stack.pop();
+
+    if (closest < entry.tmin) {
+      // We've already got a closer intersection than
+      // what can be found at this node, we can skip this.
+      continue;
+    }
+
+    const auto& node = b[entry.node_index];
+
+    box_intersection_type left_box_isect;
+
+    if (node.left_is_leaf()) {
+      visit_leaf(node.left_leaf_index(), node.left_leaf_count());
+    } else {
+      left_box_isect = intersect(b[node.left].box, accel_r);
+    }
+
+    box_intersection_type right_box_isect;
+
+    if (node.right_is_leaf()) {
+      visit_leaf(node.right_leaf_index(), node.right_leaf_count());
+    } else {
+      right_box_isect = intersect(b[node.right].box, accel_r);
+    }
+
+    if (left_box_isect && right_box_isect) {
+      if (left_box_isect < right_box_isect) {
+        stack.push(node.right, right_box_isect.tmin);
+        stack.push(node.left,   left_box_isect.tmin);
+      } else {
+        stack.push(node.left,   left_box_isect.tmin);
+        stack.push(node.right, right_box_isect.tmin);
+      }
+    } else if (left_box_isect) {
+      stack.push(node.left, left_box_isect.tmin);
+    } else if (right_box_isect) {
+      stack.push(node.right, right_box_isect.tmin);
+    }
+  }
+}
+
+//! Lists the nodes of a BVH in depth first order,
+//! with the left child of each node right after it.
+//!
+//! \param nodes The nodes of the BVH, the first being the root.
+//!
+//! \param order Receives the index of each node, in depth first order.
+template <typename scalar_type, typename index_vec_type>
+void depth_first_order(const node<scalar_type>* nodes, index_vec_type& order) {
+
+  using node_type = node<scalar_type>;
+
+  index_vec_type stack(order.get_allocator());
+
+  stack.push_back(0);
+
+  while (!stack.empty()) {
+
+    auto index = stack.back();
+
+    stack.pop_back();
+
+    order.push_back(index);
+
+    if (!node_type::is_leaf(nodes[index].right)) {
+      stack.push_back(nodes[index].right);
+    }
+
+    if (!node_type::is_leaf(nodes[index].left)) {
+      stack.push_back(nodes[index].left);
+    }
+  }
+}
+
+//! Lists the nodes of a subtree in van Emde Boas order, down to a given depth.
+//!
+//! \param nodes The nodes of the BVH.
+//!
+//! \param root The root of the subtree.
+//!
+//! \param levels The number of levels of the subtree to list.
+//!
+//! \param order The list that the nodes are added to.
+//!
+//! \param frontier Receives the nodes right below the listed levels,
+//! which are left for the caller to list.
+template <typename scalar_type, typename index_vec_type>
+void van_emde_boas_order(const node<scalar_type>* nodes, typename index_vec_type::value_type root, size_type levels, index_vec_type& order, index_vec_type& frontier) {
+
+  using node_type = node<scalar_type>;
+
+  if (levels == 1) {
+
+    order.push_back(root);
+
+    for (auto child : { nodes[root].left, nodes[root].right }) {
+      if (!node_type::is_leaf(child)) {
+        frontier.push_back(child);
+      }
+    }
+
+    return;
+  }
+
+  auto top_levels = levels / 2;
+
+  index_vec_type middle(order.get_allocator());
+
+  van_emde_boas_order(nodes, root, top_levels, order, middle);
+
+  for (auto subtree_root : middle) {
+    van_emde_boas_order(nodes, subtree_root, levels - top_levels, order, frontier);
+  }
+}
+
+//! Lists the nodes of a BVH in van Emde Boas order.
+//!
+//! \param nodes The nodes of the BVH, the first being the root.
+//!
+//! \param count The number of nodes in the BVH.
+//!
+//! \param order Receives the index of each node, in van Emde Boas order.
+template <typename scalar_type, typename index_vec_type>
+void van_emde_boas_order(const node<scalar_type>* nodes, size_type count, index_vec_type& order) {
+
+  using node_type = node<scalar_type>;
+
+  using index_type = typename index_vec_type::value_type;
+
+  // Children come after their parents in depth first order,
+  // so going through it backwards finds the height of each node.
+
+  depth_first_order(nodes, order);
+
+  pmr::vector<size_type> heights(count, order.get_allocator().resource());
+
+  for (auto it = order.rbegin(); it != order.rend(); ++it) {
+
+    size_type height = 0;
+
+    for (auto child : { nodes[*it].left, nodes[*it].right }) {
+      if (!node_type::is_leaf(child)) {
+        height = std::max(height, heights[child]);
+      }
+    }
+
+    heights[*it] = height + 1;
+  }
+
+  order.clear();
+
+  index_vec_type frontier(order.get_allocator());
+
+  van_emde_boas_order(nodes, index_type(0), heights[0], order, frontier);
+}
+
+//! Makes a power of two by writing the exponent bits directly,
+//! which is quicker than calling std::ldexp for each decoded node.
+//!
+//! \param e The exponent, which must be within the range of normal
+//! single precision exponents so that it fits both scalar types.
+template <typename scalar_type>
+scalar_type power_of_two(int e) noexcept {
+
+  using uint_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+
+  constexpr int bias = std::numeric_limits<scalar_type>::max_exponent - 1;
+
+  constexpr int mantissa_bits = std::numeric_limits<scalar_type>::digits - 1;
+
+  auto bits = uint_type(e + bias) << mantissa_bits;
+
+  scalar_type value;
+
+  std::memcpy(&value, &bits, sizeof(value));
+
+  return value;
+}
+
+//! Walks a binary BVH from the root until a leaf reports a hit.
+//! Children are visited in the order they're stored in.
+//!
+//! \param b The BVH to walk.
+//!
+//! \param accel_r The ray to walk the BVH with. Boxes outside of its interval are skipped.
+//!
+//! \param visit_leaf Called with the first primitive and the primitive count of each
+//! leaf that the ray may hit. Returns true if one of the primitives was hit.
+//!
+//! \return True if a leaf reported a hit, false otherwise.
+template <typename scalar_type, typename leaf_visitor>
+bool traverse_any(bvh_view<scalar_type> b, const accel_ray<scalar_type>& accel_r, leaf_visitor& visit_leaf) {
+
+  if (!b.size()) {
+    return false;
+  }
+
+  traversal_stack<scalar_type, 128> stack;
+
+  stack.push(0, 0);
+
+  auto push_child = [&b, &accel_r, &stack](auto child) {
+    auto box_isect = intersect(b[child].box, accel_r);
+    if (box_isect) {
+      stack.push(child, box_isect.tmin);
+    }
+  };
+
+  while (stack.remaining()) {
+
+    const auto& node = b[stack.pop().node_index];
+
+    if (node.left_is_leaf()) {
+      if (visit_leaf(node.left_leaf_index(), node.left_leaf_count())) {
+        return true;
+      }
+    } else {
+      push_child(node.left);
+    }
+
+    if (node.right_is_leaf()) {
+      if (visit_leaf(node.right_leaf_index(), node.right_leaf_count())) {
+        return true;
+      }
+    } else {
+      push_child(node.right);
+    }
+  }
+
+  return false;
+}
+
+//! Walks a binary BVH from the root with a packet of rays.
+//! Each child box is tested against all of the rays that reached its
+//! parent, and the child is visited by the rays that hit it. Children
+//! are visited nearest first, as seen by one of the rays that hit both.
+//!
+//! \param b The BVH to walk.
+//!
+//! \param packet The rays to walk the BVH with.
+//!
+//! \param active The rays of the packet to use.
+//!
+//! \param is_culled Called with a ray and the distance at which it enters
+//! a box. Returns true if the ray already has a closer hit than that.
+//!
+//! \param visit_leaf Called with the first primitive, the primitive
+//! count and the mask of rays of each leaf that the rays may hit.
+template <typename scalar_type, size_type count, typename mask_type, typename cull_func, typename leaf_visitor>
+void traverse_packet_closest(bvh_view<scalar_type> b, const ray_packet<scalar_type, count>& packet, mask_type active, const cull_func& is_culled, leaf_visitor& visit_leaf) {
+
+  using node_type = node<scalar_type>;
+
+  using node_index_type = typename node_type::index_type;
+
+  if (!b.size() || !active) {
+    return;
+  }
+
+  auto inv_pos = vec_packet_ops<scalar_type, 3, count>::hadamard_mul(packet.pos, packet.rcp_dir) * scalar_type(-1);
+
+  auto test_child = [&b, &packet, &inv_pos, &is_culled](node_index_type child, mask_type mask, scalar_type* tmin) {
+
+    auto hits = packet_box_test<scalar_type, count>::intersect(b[child].box, packet, inv_pos, mask, tmin);
+
+    for (auto remaining = hits; remaining; remaining &= remaining - 1) {
+      auto lane = ctz(remaining);
+      if (is_culled(lane, tmin[lane])) {
+        hits &= ~(mask_type(1) << lane);
+      }
+    }
+
+    return hits;
+  };
+
+  packet_stack<node_index_type, mask_type, 128> stack;
+
+  stack.push(0, active);
+
+  while (stack.remaining()) {
+
+    auto entry = stack.pop();
+
+    const auto& node = b[entry.node_index];
+
+    scalar_type left_tmin[count];
+    scalar_type right_tmin[count];
+
+    mask_type left_mask = 0;
+    mask_type right_mask = 0;
+
+    if (node.left_is_leaf()) {
+      visit_leaf(node.left_leaf_index(), node.left_leaf_count(), entry.mask);
+    } else {
+      left_mask = test_child(node.left, entry.mask, left_tmin);
+    }
+
+    if (node.right_is_leaf()) {
+      visit_leaf(node.right_leaf_index(), node.right_leaf_count(), entry.mask);
+    } else {
+      right_mask = test_child(node.right, entry.mask, right_tmin);
+    }
+
+    if (left_mask && right_mask) {
+
+      auto lane = ctz(left_mask & right_mask ? (left_mask & right_mask) : entry.mask);
+
+      if (left_tmin[lane] < right_tmin[lane]) {
+        stack.push(node.right, right_mask);
+        stack.push(node.left,   left_mask);
+      } else {
+        stack.push(node.left,   left_mask);
+        stack.push(node.right, right_mask);
+      }
+    } else if (left_mask) {
+      stack.push(node.left, left_mask);
+    } else if (right_mask) {
+      stack.push(node.right, right_mask);
+    }
+  }
+}
+
+//! Walks a wide BVH from the root, nearest children first,
+//! until no node can hold a closer hit than @p closest.
+//!
+//! \param node_count The number of nodes in the BVH.
+//!
+//! \param node_at Called with a node index to get the
+//! @ref wide_node at that index, either by reference or decoded.
+//!
+//! \param accel_r The ray to walk the BVH with.
+//!
+//! \param closest The closest hit so far, which is
+//! updated by @p visit_leaf. Farther nodes are skipped.
+//!
+//! \param visit_leaf Called with the first primitive and
+//! the primitive count of each leaf that the ray may hit.
+template <typename scalar_type, size_type width, typename node_accessor, typename closest_type, typename leaf_visitor>
+void traverse_wide_closest(size_type node_count, const node_accessor& node_at, const accel_ray<scalar_type>& accel_r, const closest_type& closest, leaf_visitor& visit_leaf) {
+
+  using node_type = wide_node<scalar_type, width>;
+
+  using binary_node_type = node<scalar_type>;
+
+  if (!node_count) {
+    return;
+  }
+
+  traversal_stack<scalar_type, 64 * width> stack;
+
+  stack.push(0, -std::numeric_limits<scalar_type>::infinity());
+
+  while (stack.remaining()) {
+
+    auto entry = stack.pop();
+
+    if (closest < entry.tmin) {
+      continue;
+    }
+
+    const node_type& node = node_at(entry.node_index);
+
+    alignas(sizeof(scalar_type) * width) scalar_type tmin[width];
+
+    auto mask = wide_box_test<scalar_type, width>::intersect(node, accel_r, tmin);
+
+    // The children that were hit, sorted from farthest to nearest,
+    // so that the nearest one ends up on the top of the stack.
+
+    size_type hits[width];
+
+    size_type hit_count = 0;
+
+    for (size_type i = 0; i < width; i++) {
+
+      if (!(mask & (std::uint32_t(1) << i)) || (node.children[i] == node_type::empty_child())) {
+        continue;
+      }
+
+      auto j = hit_count++;
+
+      while ((j > 0) && (tmin[hits[j - 1]] < tmin[i])) {
+        hits[j] = hits[j - 1];
+        j--;
+      }
+
+      hits[j] = i;
+    }
+
+    for (size_type h = hit_count; h > 0; h--) {
+
+      auto i = hits[h - 1];
+
+      auto child = node.children[i];
+
+      if (!binary_node_type::is_leaf(child)) {
+        continue;
+      }
+
+      if (closest < tmin[i]) {
+        continue;
+      }
+
+      visit_leaf(binary_node_type::leaf_index(child), binary_node_type::leaf_count(child));
+    }
+
+    for (size_type h = 0; h < hit_count; h++) {
+
+      auto i = hits[h];
+
+      if (binary_node_type::is_leaf(node.children[i])) {
+        continue;
+      }
+
+      stack.push(node.children[i], tmin[i]);
+    }
+  }
+}
+
+//! Computes the order that a buffer of rays is traced in when
+//! @ref trace_options::sort_rays is set. Each ray gets a key made of the
+//! octant of its direction in the highest bits, then the Morton code of its
+//! origin and then, in the lowest bits, a coarser Morton code of its direction.
+//! The keys are sorted with the same radix sort as the Morton curve of a build.
+//!
+//! \param rays The rays to sort.
+//!
+//! \param count The number of rays.
+//!
+//! \param scheduler The scheduler to compute and sort the keys with.
+//!
+//! \param order Receives the index of each ray, in sorted order.
+template <typename scalar_type, typename task_scheduler, typename index_type>
+void sort_rays(const ray<scalar_type>* rays, size_type count, task_scheduler& scheduler, pmr::vector<index_type>& order) {
+
+  using code_type = typename associated_types<sizeof(scalar_type)>::uint_type;
+
+  using curve_type = space_filling_curve<code_type>;
+
+  using entry = typename curve_type::entry;
+
+  using box_type = aabb<scalar_type>;
+
+  pmr::vector<box_type> thread_boxes(scheduler.max_threads(), get_empty_aabb<scalar_type>());
+
+  auto bound_origins = [](const work_division& div, const ray<scalar_type>* r, box_type* boxes, size_type n) {
+
+    auto range = loop_range(div, n);
+
+    auto box = get_empty_aabb<scalar_type>();
+
+    for (auto i = range.begin; i < range.end; i++) {
+      box = union_of(box, r[i].pos);
+    }
+
+    boxes[div.thread] = union_of(boxes[div.thread], box);
+  };
+
+  scheduler(bound_origins, rays, thread_boxes.data(), count);
+
+  auto origin_bounds = get_empty_aabb<scalar_type>();
+
+  for (const auto& th_box : thread_boxes) {
+    origin_bounds = union_of(origin_bounds, th_box);
+  }
+
+  auto encode = [](const work_division& div, const ray<scalar_type>* r, entry* e, size_type n, box_type bounds) {
+
+    constexpr auto domain = morton_domain<sizeof(code_type)>::value();
+
+    // The Morton codes fill all but the three octant bits of a key.
+    // The direction gets a third of them, rounded down to whole levels.
+
+    constexpr size_type morton_bits = (sizeof(code_type) * 8) - 3;
+    constexpr size_type dir_bits = ((morton_bits / 3) / 3) * 3;
+    constexpr size_type pos_bits = ((morton_bits - dir_bits) / 3) * 3;
+    constexpr size_type code_bits = 3 * ((sizeof(code_type) == 4) ? 10 : 20);
+
+    using entry_index_type = typename entry::index_type;
+
+    morton_encoder<sizeof(code_type)> encoder;
+
+    auto bounds_size = size_of(bounds);
+
+    vec3<scalar_type> pos_scale {
+      domain / (bounds_size.x + scalar_type(1)),
+      domain / (bounds_size.y + scalar_type(1)),
+      domain / (bounds_size.z + scalar_type(1))
+    };
+
+    auto range = loop_range(div, n);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      const auto& dir = r[i].dir;
+
+      code_type octant = (code_type(dir.x < 0) << 2)
+                       | (code_type(dir.y < 0) << 1)
+                       | (code_type(dir.z < 0) << 0);
+
+      auto pos = hadamard_mul(r[i].pos - bounds.min, pos_scale);
+
+      auto pos_code = encoder(code_type(pos.x), code_type(pos.y), code_type(pos.z));
+
+      // The direction is scaled onto the faces of the unit cube,
+      // which keeps its length from changing its code.
+
+      auto dir_max = max(max(std::fabs(dir.x), std::fabs(dir.y)), std::fabs(dir.z));
+
+      auto dir_scale = (dir_max > 0) ? (scalar_type(domain - 1) / (2 * dir_max)) : scalar_type(0);
+
+      auto dir_code = encoder(code_type((dir.x * dir_scale) + scalar_type(domain - 1) / 2),
+                              code_type((dir.y * dir_scale) + scalar_type(domain - 1) / 2),
+                              code_type((dir.z * dir_scale) + scalar_type(domain - 1) / 2));
+
+      auto code = (octant << morton_bits)
+                | ((pos_code >> (code_bits - pos_bits)) << dir_bits)
+                | (dir_code >> (code_bits - dir_bits));
+
+      e[i] = entry { code, entry_index_type(i) };
+    }
+  };
+
+  typename curve_type::entry_vec entries(count, order.get_allocator().resource());
+
+  scheduler(encode, rays, entries.data(), count, origin_bounds);
+
+  curve_type curve(std::move(entries));
+
+  typename curve_type::entry_vec buffer(order.get_allocator().resource());
+
+  curve.sort(scheduler, buffer);
+
+  curve.primitive_indices(scheduler, order);
+}
+
+} // namespace detail
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::operator () (const primitive* primitives, size_type count, const aabb_converter& converter) -> bvh_type {
+
+  bvh_type b(scratch.resource);
+
+  rebuild(b, primitives, count, converter);
+
+  return b;
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::operator () (primitive* primitives, size_type count, const aabb_converter& converter) -> bvh_type {
+
+  bvh_type b(scratch.resource);
+
+  rebuild(b, primitives, count, converter);
+
+  return b;
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::rebuild(bvh_type& b, const primitive* primitives, size_type count, const aabb_converter& converter) {
+
+  check_count(count);
+
+  if (options.cache_boxes) {
+
+    auto& boxes = scratch.boxes;
+
+    boxes.resize(count);
+
+    auto centroid_bounds = cache_boxes(primitives, count, converter, boxes);
+
+    build(b, boxes.data(), count, detail::box_identity<scalar_type>(), centroid_bounds, keep_order);
+
+    return;
+  }
+
+  detail::morton_curve_builder<scalar_type, task_scheduler> curve_builder(scheduler);
+
+  auto centroid_bounds = curve_builder.get_centroid_bounds(primitives, count, converter, scratch.thread_boxes);
+
+  build(b, primitives, count, converter, centroid_bounds, keep_order);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::rebuild(bvh_type& b, primitive* primitives, size_type count, const aabb_converter& converter) {
+
+  check_count(count);
+
+  if (!options.reorder_primitives) {
+    rebuild(b, static_cast<const primitive*>(primitives), count, converter);
+    return;
+  }
+
+  auto reorder_primitives = [this, primitives](const index_vec& indices) {
+    detail::permute(primitives, indices.data(), indices.size(), scheduler, scratch.resource);
+    return true;
+  };
+
+  if (options.cache_boxes) {
+
+    auto& boxes = scratch.boxes;
+
+    boxes.resize(count);
+
+    auto centroid_bounds = cache_boxes(primitives, count, converter, boxes);
+
+    auto reorder_all = [this, &boxes, &reorder_primitives](const index_vec& indices) {
+      detail::permute(boxes.data(), indices.data(), indices.size(), scheduler, scratch.resource);
+      return reorder_primitives(indices);
+    };
+
+    build(b, boxes.data(), count, detail::box_identity<scalar_type>(), centroid_bounds, reorder_all);
+
+    return;
+  }
+
+  detail::morton_curve_builder<scalar_type, task_scheduler> curve_builder(scheduler);
+
+  auto centroid_bounds = curve_builder.get_centroid_bounds(static_cast<const primitive*>(primitives), count, converter, scratch.thread_boxes);
+
+  build(b, static_cast<const primitive*>(primitives), count, converter, centroid_bounds, reorder_primitives);
+}
+
+template <typename scalar_type, typename task_scheduler>
+auto builder<scalar_type, task_scheduler>::operator () (const box_type* boxes, size_type count) -> bvh_type {
+
+  check_count(count);
+
+  detail::box_identity<scalar_type> converter;
+
+  detail::morton_curve_builder<scalar_type, task_scheduler> curve_builder(scheduler);
+
+  auto centroid_bounds = curve_builder.get_centroid_bounds(boxes, count, converter, scratch.thread_boxes);
+
+  bvh_type b(scratch.resource);
+
+  build(b, boxes, count, converter, centroid_bounds, keep_order);
+
+  return b;
+}
+
+template <typename scalar_type, typename task_scheduler>
+void builder<scalar_type, task_scheduler>::check_count(size_type count) {
+  if (std::uint64_t(count) > (std::uint64_t(1) << node_type::leaf_index_bits())) {
+    throw std::length_error("lbvh::builder: too many primitives for the leaf index bits of a node");
+  }
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive>
+auto builder<scalar_type, task_scheduler>::operator () (const instance<scalar_type, primitive>* instances, size_type count) -> bvh_type {
+  return (*this)(instances, count, detail::instance_box<scalar_type>());
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter, typename reorder_func>
+void builder<scalar_type, task_scheduler>::build(bvh_type& out, const primitive* primitives, size_type count, const aabb_converter& converter, const box_type& centroid_bounds, reorder_func reorder) {
+
+  using curve_builder_type = detail::morton_curve_builder<scalar_type, task_scheduler>;
+
+  using code_type = typename curve_builder_type::code_type;
+
+  curve_builder_type curve_builder(scheduler);
+
+  auto curve = curve_builder(primitives, count, converter, centroid_bounds, std::move(scratch.entries));
+
+  curve.sort(scheduler, scratch.sort_buffer);
+
+  // The output keeps its memory, and every node and index is overwritten.
+
+  auto& primitive_indices = out.prim_indices;
+
+  curve.primitive_indices(scheduler, primitive_indices);
+
+  auto reordered = reorder(static_cast<const index_vec&>(primitive_indices));
+
+  auto& nodes = out.nodes;
+
+  nodes.resize(curve.size() - 1);
+
+  auto& parents = scratch.parents;
+
+  parents.resize(nodes.size());
+
+  if (!parents.empty()) {
+    parents[0] = detail::no_parent<index_type>();
+  }
+
+  auto leaf_indices = reordered ? nullptr : primitive_indices.data();
+
+  auto clustered = (options.method == build_method::ploc);
+
+  auto hybrid = (options.method == build_method::hybrid);
+
+  if (clustered && !nodes.empty()) {
+    cluster_nodes(nodes, parents, primitives, converter, leaf_indices);
+  } else {
+    detail::builder_kernel<code_type, scalar_type> builder_kern(curve, nodes.data(), parents.data(), leaf_indices);
+    scheduler(builder_kern);
+  }
+
+  if (hybrid && !nodes.empty()) {
+    fit_boxes(nodes, parents, primitives, converter);
+    rebuild_top_levels(nodes, parents, curve, primitives, converter);
+  }
+
+  scratch.entries = curve.release();
+
+  // Clustering and rebuilding the top levels fit the boxes along the way.
+
+  auto fitted = clustered || hybrid;
+
+  auto max_leaf_size = std::min(options.max_leaf_size, node_type::max_leaf_size());
+
+  auto collapse = reordered && (max_leaf_size >= 2) && !nodes.empty();
+
+  auto optimize = (options.optimization_passes > 0) && !nodes.empty();
+
+  // Everything but the plain radix tree changes the topology, after
+  // which the leaves no longer visit the reordered primitives in order.
+
+  auto relink = reordered && (fitted || optimize) && !nodes.empty();
+
+  if (!collapse && !optimize && !relink) {
+
+    if (!fitted) {
+      fit_boxes(nodes, parents, primitives, converter);
+    }
+
+    lay_out_nodes(nodes);
+
+    return;
+  }
+
+  pmr::vector<detail::subtree_info<scalar_type>> infos(nodes.size(), scratch.resource);
+
+  if (optimize) {
+    optimize_treelets(nodes, parents, primitives, converter, infos.data());
+  } else {
+    fit_boxes(nodes, parents, primitives, converter, infos.data());
+  }
+
+  if (relink) {
+    reorder_leaves(nodes, parents, infos, primitive_indices, reorder);
+  }
+
+  if (collapse) {
+
+    // The restructuring passes don't decide which subtrees to collapse.
+
+    if (optimize) {
+      fit_boxes(nodes, parents, primitives, converter, infos.data());
+    }
+
+    collapse_subtrees(nodes, parents, infos);
+  }
+
+  lay_out_nodes(nodes);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+auto builder<scalar_type, task_scheduler>::cache_boxes(const primitive* primitives, size_type count, const aabb_converter& converter, box_vec& boxes) -> box_type {
+
+  auto& thread_boxes = scratch.thread_boxes;
+
+  thread_boxes.assign(scheduler.max_threads(), detail::get_empty_aabb<scalar_type>());
+
+  detail::box_cache_kernel<scalar_type, primitive, aabb_converter> cache_kern(primitives, count, converter, boxes.data(), thread_boxes.data());
+
+  scheduler(cache_kern);
+
+  auto centroid_bounds = detail::get_empty_aabb<scalar_type>();
+
+  for (const auto& th_box : thread_boxes) {
+    centroid_bounds = detail::union_of(centroid_bounds, th_box);
+  }
+
+  return centroid_bounds;
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::fit_boxes(node_vec& nodes, const index_vec& parents, const primitive* primitives, const aabb_converter& converter, detail::subtree_info<scalar_type>* infos) {
+
+  using visitor_type = detail::fit_visitor<scalar_type, primitive, aabb_converter>;
+
+  detail::collapse_params<scalar_type> params {
+    scalar_type(options.traversal_cost),
+    scalar_type(options.intersection_cost),
+    std::min(options.max_leaf_size, node_type::max_leaf_size())
+  };
+
+  visitor_type visitor(nodes.data(), primitives, converter, infos, params);
+
+  visit_bottom_up(nodes, parents, visitor);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::optimize_treelets(node_vec& nodes, index_vec& parents, const primitive* primitives, const aabb_converter& converter, detail::subtree_info<scalar_type>* infos) {
+
+  using visitor_type = detail::treelet_visitor<scalar_type, primitive, aabb_converter>;
+
+  detail::collapse_params<scalar_type> params {
+    scalar_type(options.traversal_cost),
+    scalar_type(options.intersection_cost),
+    1
+  };
+
+  // Each pass doubles the size of the smallest subtree that gets
+  // restructured, so that the later passes only spend their time
+  // on the upper levels of the tree.
+
+  auto min_primitives = visitor_type::max_leaves;
+
+  for (size_type pass = 0; pass < options.optimization_passes; pass++) {
+
+    visitor_type visitor(nodes.data(), parents.data(), primitives, converter, infos, params, min_primitives);
+
+    visit_bottom_up(nodes, parents, visitor);
+
+    min_primitives *= 2;
+  }
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename reorder_func>
+void builder<scalar_type, task_scheduler>::reorder_leaves(node_vec& nodes, const index_vec& parents, pmr::vector<detail::subtree_info<scalar_type>>& infos, index_vec& primitive_indices, reorder_func& reorder) {
+
+  index_vec offsets(nodes.size(), scratch.resource);
+
+  detail::leaf_offset_kernel<scalar_type> offset_kern(nodes.data(), parents.data(), infos.data(), offsets.data(), nodes.size());
+
+  scheduler(offset_kern);
+
+  // The order is the current position of the primitive
+  // that goes to each position in depth first order.
+
+  index_vec order(primitive_indices.size(), scratch.resource);
+
+  using info_type = detail::subtree_info<scalar_type>;
+
+  auto relink = [](const work_division& div, node_type* n, info_type* inf, const index_type* offs, index_type* ord, size_type count) {
+
+    auto range = detail::loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      auto& node = n[i];
+
+      auto left_offset = offs[i];
+
+      inf[i].first = left_offset;
+
+      auto right_offset = left_offset + (node.left_is_leaf() ? node.left_leaf_count() : inf[node.left].count);
+
+      if (node.left_is_leaf()) {
+        for (index_type j = 0; j < node.left_leaf_count(); j++) {
+          ord[left_offset + j] = node.left_leaf_index() + j;
+        }
+        node.left = node_type::make_leaf(left_offset, node.left_leaf_count());
+      }
+
+      if (node.right_is_leaf()) {
+        for (index_type j = 0; j < node.right_leaf_count(); j++) {
+          ord[right_offset + j] = node.right_leaf_index() + j;
+        }
+        node.right = node_type::make_leaf(right_offset, node.right_leaf_count());
+      }
+    }
+  };
+
+  scheduler(relink, nodes.data(), infos.data(), offsets.data(), order.data(), nodes.size());
+
+  detail::permute(primitive_indices.data(), order.data(), order.size(), scheduler, scratch.resource);
+
+  reorder(static_cast<const index_vec&>(order));
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::cluster_nodes(node_vec& nodes, index_vec& parents, const primitive* primitives, const aabb_converter& converter, const index_type* leaf_indices) {
+
+  auto count = nodes.size() + 1;
+
+  // Each cluster is a child index, which is either
+  // a leaf or a node that has already been merged.
+
+  index_vec clusters(count, scratch.resource);
+  index_vec next_clusters(count, scratch.resource);
+
+  box_vec boxes(count, scratch.resource);
+  box_vec next_boxes(count, scratch.resource);
+
+  auto init_clusters = [](const work_division& div, const primitive* prims, const aabb_converter& cvt, const index_type* leaves, index_type* c, box_type* b, size_type n) {
+    auto range = detail::loop_range(div, n);
+    for (auto i = range.begin; i < range.end; i++) {
+      auto leaf_index = leaves ? size_type(leaves[i]) : i;
+      c[i] = node_type::make_leaf(leaf_index);
+      b[i] = cvt(prims[leaf_index]);
+    }
+  };
+
+  scheduler(init_clusters, primitives, converter, leaf_indices, clusters.data(), boxes.data(), count);
+
+  index_vec neighbors(count, scratch.resource);
+  index_vec merge_offsets(count, scratch.resource);
+  index_vec keep_offsets(count, scratch.resource);
+
+  // A pair of mutual neighbors is merged into the cluster with the
+  // lower index, and the cluster with the higher index is removed.
+
+  auto mark = [](const work_division& div, const index_type* nb, index_type* merges, index_type* keeps, size_type n) {
+    auto range = detail::loop_range(div, n);
+    for (auto i = range.begin; i < range.end; i++) {
+      auto mutual = (nb[nb[i]] == i);
+      merges[i] = (mutual && (i < nb[i])) ? 1 : 0;
+      keeps[i] = (mutual && (i > nb[i])) ? 0 : 1;
+    }
+  };
+
+  auto merge = [](const work_division& div, const index_type* nb, const index_type* merges, const index_type* keeps,
+                  const index_type* c, const box_type* b, index_type* next_c, box_type* next_b,
+                  node_type* n, index_type* p, size_type first_node, size_type cluster_count) {
+
+    auto range = detail::loop_range(div, cluster_count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      auto j = size_type(nb[i]);
+
+      auto mutual = (nb[j] == i);
+
+      if (mutual && (i > j)) {
+        continue;
+      }
+
+      auto cluster = c[i];
+
+      auto box = b[i];
+
+      if (mutual) {
+
+        auto node_index = index_type(first_node + merges[i]);
+
+        box = detail::union_of(box, b[j]);
+
+        n[node_index].box = box;
+        n[node_index].left = cluster;
+        n[node_index].right = c[j];
+
+        if (!node_type::is_leaf(cluster)) {
+          p[cluster] = node_index;
+        }
+
+        if (!node_type::is_leaf(c[j])) {
+          p[c[j]] = node_index;
+        }
+
+        cluster = node_index;
+      }
+
+      next_c[keeps[i]] = cluster;
+      next_b[keeps[i]] = box;
+    }
+  };
+
+  // The nodes are allocated from the back of the array,
+  // so that the last merge creates the root at index zero.
+
+  auto next_node = nodes.size();
+
+  while (count > 1) {
+
+    detail::neighbor_kernel<scalar_type> neighbor_kern(boxes.data(), neighbors.data(), count, std::max(options.search_radius, size_type(1)));
+
+    scheduler(neighbor_kern);
+
+    scheduler(mark, neighbors.data(), merge_offsets.data(), keep_offsets.data(), count);
+
+    auto merge_count = detail::exclusive_scan(merge_offsets.data(), count, scheduler, scratch.resource);
+
+    auto keep_count = detail::exclusive_scan(keep_offsets.data(), count, scheduler, scratch.resource);
+
+    next_node -= merge_count;
+
+    scheduler(merge, neighbors.data(), merge_offsets.data(), keep_offsets.data(),
+              clusters.data(), boxes.data(), next_clusters.data(), next_boxes.data(),
+              nodes.data(), parents.data(), next_node, count);
+
+    clusters.swap(next_clusters);
+
+    boxes.swap(next_boxes);
+
+    count = keep_count;
+  }
+
+  parents[0] = detail::no_parent<index_type>();
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename code_type, typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::rebuild_top_levels(node_vec& nodes, index_vec& parents, const detail::space_filling_curve<code_type>& curve, const primitive* primitives, const aabb_converter& converter) {
+
+  using top_builder_type = detail::top_level_builder<scalar_type>;
+
+  using item_type = typename top_builder_type::item;
+
+  size_type axis_bits = 0;
+
+  while ((size_type(1) << axis_bits) < detail::morton_domain<sizeof(code_type)>::value()) {
+    axis_bits++;
+  }
+
+  auto shift = 3 * (axis_bits - std::min(options.cluster_levels, axis_bits));
+
+  pmr::vector<std::uint8_t> top(nodes.size(), scratch.resource);
+
+  index_vec primitive_counts(nodes.size(), scratch.resource);
+
+  detail::cluster_mark_kernel<code_type, scalar_type> mark_kern(curve, top.data(), primitive_counts.data(), nodes.size(), shift);
+
+  scheduler(mark_kern);
+
+  // The subtrees to build over are the children of the
+  // top nodes that don't span more than one cluster.
+
+  auto is_item = [](const std::uint8_t* t, index_type child) {
+    return node_type::is_leaf(child) || !t[child];
+  };
+
+  index_vec slot_offsets(nodes.size(), scratch.resource);
+
+  index_vec item_offsets(nodes.size(), scratch.resource);
+
+  auto count_items = [is_item](const work_division& div, const node_type* n, const std::uint8_t* t, index_type* slot_offs, index_type* item_offs, size_type count) {
+    auto range = detail::loop_range(div, count);
+    for (auto i = range.begin; i < range.end; i++) {
+      slot_offs[i] = t[i];
+      item_offs[i] = t[i] ? (index_type(is_item(t, n[i].left)) + index_type(is_item(t, n[i].right))) : 0;
+    }
+  };
+
+  scheduler(count_items, nodes.data(), top.data(), slot_offsets.data(), item_offsets.data(), nodes.size());
+
+  auto slot_count = detail::exclusive_scan(slot_offsets.data(), slot_offsets.size(), scheduler, scratch.resource);
+
+  auto item_count = detail::exclusive_scan(item_offsets.data(), item_offsets.size(), scheduler, scratch.resource);
+
+  if (slot_count == 0) {
+    return;
+  }
+
+  index_vec slots(slot_count, scratch.resource);
+
+  pmr::vector<item_type> items(item_count, scratch.resource);
+
+  auto gather_items = [is_item](const work_division& div, const node_type* n, const std::uint8_t* t, const index_type* counts,
+                                const index_type* slot_offs, const index_type* item_offs, index_type* s, item_type* it,
+                                const primitive* prims, const aabb_converter& cvt, size_type count) {
+
+    auto make_item = [n, counts, prims, &cvt](index_type child) {
+
+      if (!node_type::is_leaf(child)) {
+        return item_type { child, n[child].box, detail::center_of(n[child].box), counts[child] };
+      }
+
+      auto box = cvt(prims[node_type::leaf_index(child)]);
+
+      return item_type { child, box, detail::center_of(box), 1 };
+    };
+
+    auto range = detail::loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+
+      if (!t[i]) {
+        continue;
+      }
+
+      s[slot_offs[i]] = index_type(i);
+
+      auto item_index = item_offs[i];
+
+      if (is_item(t, n[i].left)) {
+        it[item_index++] = make_item(n[i].left);
+      }
+
+      if (is_item(t, n[i].right)) {
+        it[item_index++] = make_item(n[i].right);
+      }
+    }
+  };
+
+  scheduler(gather_items, nodes.data(), top.data(), primitive_counts.data(), slot_offsets.data(), item_offsets.data(),
+            slots.data(), items.data(), primitives, converter, nodes.size());
+
+  top_builder_type top_builder(nodes.data(), parents.data(), slots.data(), items.data(), items.size(), scratch.resource);
+
+  top_builder();
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::refit(bvh_type& b, const primitive* primitives, const aabb_converter& converter) {
+
+  if (b.nodes.empty()) {
+    return;
+  }
+
+  fit_boxes(b.nodes, find_parents(b.nodes), primitives, converter);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename primitive, typename aabb_converter>
+void builder<scalar_type, task_scheduler>::refit(bvh_type& b, const primitive* primitives, const aabb_converter& converter, const index_type* changed, size_type changed_count) {
+
+  using visitor_type = detail::fit_visitor<scalar_type, primitive, aabb_converter>;
+
+  auto& nodes = b.nodes;
+
+  if (nodes.empty() || !changed_count) {
+    return;
+  }
+
+  auto parents = find_parents(nodes);
+
+  // The node that holds the leaf of each primitive. The owners are sized from
+  // the leaves, since a BVH constructed from its nodes has no permutation.
+
+  std::atomic<size_type> primitive_count { 0 };
+
+  auto find_primitive_count = [](const work_division& div, const node_type* n, std::atomic<size_type>* total, size_type count) {
+    size_type leaf_end = 0;
+    auto range = detail::loop_range(div, count);
+    for (auto i = range.begin; i < range.end; i++) {
+      for (auto child : { n[i].left, n[i].right }) {
+        if (node_type::is_leaf(child)) {
+          leaf_end = std::max(leaf_end, size_type(node_type::leaf_index(child) + node_type::leaf_count(child)));
+        }
+      }
+    }
+    auto value = total->load(std::memory_order_relaxed);
+    while ((value < leaf_end) && !total->compare_exchange_weak(value, leaf_end, std::memory_order_relaxed)) {
+    }
+  };
+
+  scheduler(find_primitive_count, nodes.data(), &primitive_count, nodes.size());
+
+  index_vec owners(primitive_count.load(), scratch.resource);
+
+  auto find_owners = [](const work_division& div, const node_type* n, index_type* o, size_type count) {
+    auto range = detail::loop_range(div, count);
+    for (auto i = range.begin; i < range.end; i++) {
+      for (auto child : { n[i].left, n[i].right }) {
+        if (!node_type::is_leaf(child)) {
+          continue;
+        }
+        for (index_type j = 0; j < node_type::leaf_count(child); j++) {
+          o[node_type::leaf_index(child) + j] = index_type(i);
+        }
+      }
+    }
+  };
+
+  scheduler(find_owners, nodes.data(), owners.data(), nodes.size());
+
+  // Each changed primitive marks its ancestors, until
+  // it reaches one that's been marked by another primitive.
+
+  pmr::vector<std::atomic<std::uint8_t>> dirty(nodes.size(), scratch.resource);
+
+  auto mark = [](const work_division& div, const index_type* c, const index_type* o, const index_type* p, std::atomic<std::uint8_t>* d, size_type count) {
+    auto range = detail::loop_range(div, count);
+    for (auto i = range.begin; i < range.end; i++) {
+      auto index = o[c[i]];
+      while ((index != detail::no_parent<index_type>()) && !d[index].exchange(1, std::memory_order_relaxed)) {
+        index = p[index];
+      }
+    }
+  };
+
+  scheduler(mark, changed, owners.data(), parents.data(), dirty.data(), changed_count);
+
+  pmr::vector<std::uint8_t> child_counts(nodes.size(), scratch.resource);
+
+  auto count_dirty = [](const work_division& div, const node_type* n, const std::atomic<std::uint8_t>* d, std::uint8_t* counts, size_type count) {
+
+    auto is_dirty = [d](index_type child) {
+      return !node_type::is_leaf(child) && d[child].load(std::memory_order_relaxed);
+    };
+
+    auto range = detail::loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+      if (!d[i].load(std::memory_order_relaxed)) {
+        counts[i] = detail::unvisited_node();
+      } else {
+        counts[i] = std::uint8_t(std::uint8_t(is_dirty(n[i].left)) + std::uint8_t(is_dirty(n[i].right)));
+      }
+    }
+  };
+
+  scheduler(count_dirty, nodes.data(), dirty.data(), child_counts.data(), nodes.size());
+
+  visitor_type visitor(nodes.data(), primitives, converter);
+
+  visit_bottom_up(parents, child_counts, visitor);
+}
+
+template <typename scalar_type, typename task_scheduler>
+auto builder<scalar_type, task_scheduler>::find_parents(const node_vec& nodes) -> index_vec {
+
+  index_vec parents(nodes.size(), scratch.resource);
+
+  auto link = [](const work_division& div, const node_type* n, index_type* p, size_type count) {
+    auto range = detail::loop_range(div, count);
+    for (auto i = range.begin; i < range.end; i++) {
+      if (!n[i].left_is_leaf()) {
+        p[n[i].left] = index_type(i);
+      }
+      if (!n[i].right_is_leaf()) {
+        p[n[i].right] = index_type(i);
+      }
+    }
+  };
+
+  scheduler(link, nodes.data(), parents.data(), nodes.size());
+
+  if (!parents.empty()) {
+    parents[0] = detail::no_parent<index_type>();
+  }
+
+  return parents;
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename visitor_type>
+void builder<scalar_type, task_scheduler>::visit_bottom_up(const node_vec& nodes, const index_vec& parents, const visitor_type& visitor) {
+
+  auto& child_counts = scratch.child_counts;
+
+  child_counts.resize(nodes.size());
+
+  auto count_children = [](const work_division& div, const node_type* n, std::uint8_t* counts, size_type count) {
+    auto range = detail::loop_range(div, count);
+    for (auto i = range.begin; i < range.end; i++) {
+      counts[i] = std::uint8_t(detail::internal_child_count(n[i]));
+    }
+  };
+
+  scheduler(count_children, nodes.data(), child_counts.data(), nodes.size());
+
+  visit_bottom_up(parents, child_counts, visitor);
+}
+
+template <typename scalar_type, typename task_scheduler>
+template <typename visitor_type>
+void builder<scalar_type, task_scheduler>::visit_bottom_up(const index_vec& parents, const pmr::vector<std::uint8_t>& child_counts, const visitor_type& visitor) {
+
+  auto* visits = scratch.visits_for(parents.size());
+
+  detail::bottom_up_kernel<index_type, visitor_type> kern(parents.data(), child_counts.data(), visits, parents.size(), visitor);
+
+  scheduler(kern);
+}
+
+template <typename scalar_type, typename task_scheduler>
+void builder<scalar_type, task_scheduler>::collapse_subtrees(node_vec& nodes, const index_vec& parents, pmr::vector<detail::subtree_info<scalar_type>>& infos) {
+
+  // The root stays a node, even if the whole scene fits into a leaf.
+
+  infos[0].collapse = false;
+
+  auto max_leaf_size = std::min(options.max_leaf_size, node_type::max_leaf_size());
+
+  index_vec new_indices(nodes.size(), scratch.resource);
+
+  detail::collapse_mark_kernel<scalar_type> mark_kern(infos.data(), parents.data(), new_indices.data(), nodes.size(), max_leaf_size);
+
+  scheduler(mark_kern);
+
+  auto output_count = detail::exclusive_scan(new_indices.data(), new_indices.size(), scheduler, scratch.resource);
+
+  node_vec output(output_count, nodes.get_allocator());
+
+  detail::collapse_kernel<scalar_type> collapse_kern(nodes.data(), output.data(), infos.data(), new_indices.data(), nodes.size(), output_count);
+
+  scheduler(collapse_kern);
+
+  nodes.swap(output);
+}
+
+template <typename scalar_type, typename task_scheduler>
+void builder<scalar_type, task_scheduler>::lay_out_nodes(node_vec& nodes) {
+
+  if ((options.layout == node_layout::build_order) || (nodes.size() < 2)) {
+    return;
+  }
+
+  // The old index of each node, in the new order.
+
+  index_vec order(scratch.resource);
+
+  order.reserve(nodes.size());
+
+  if (options.layout == node_layout::depth_first) {
+    detail::depth_first_order(nodes.data(), order);
+  } else {
+    detail::van_emde_boas_order(nodes.data(), nodes.size(), order);
+  }
+
+  index_vec new_indices(nodes.size(), scratch.resource);
+
+  auto invert = [](const work_division& div, const index_type* o, index_type* n, size_type count) {
+    auto range = detail::loop_range(div, count);
+    for (auto i = range.begin; i < range.end; i++) {
+      n[o[i]] = index_type(i);
+    }
+  };
+
+  scheduler(invert, order.data(), new_indices.data(), nodes.size());
+
+  node_vec output(nodes.size(), nodes.get_allocator());
+
+  auto move_nodes = [](const work_division& div, const node_type* in, node_type* out, const index_type* o, const index_type* n, size_type count) {
+
+    auto move_child = [n](index_type child) {
+      return node_type::is_leaf(child) ? child : n[child];
+    };
+
+    auto range = detail::loop_range(div, count);
+
+    for (auto i = range.begin; i < range.end; i++) {
+      const auto& old_node = in[o[i]];
+      out[i].box = old_node.box;
+      out[i].left = move_child(old_node.left);
+      out[i].right = move_child(old_node.right);
+    }
+  };
+
+  scheduler(move_nodes, nodes.data(), output.data(), order.data(), new_indices.data(), nodes.size());
+
+  nodes.swap(output);
+}
+
+template <typename scalar_type, typename primitive_type, typename intersection_type>
+template <typename intersector_type>
+intersection_type traverser<scalar_type, primitive_type, intersection_type>::operator () (const ray_type& ray, const intersector_type& intersector) const noexcept {
+
+  intersection_type closest;
+
+  auto intersect_leaf = [this, &closest, &intersector, &ray](auto first, auto count) {
+    for (decltype(first) i = 0; i < count; i++) {
+      auto isect = intersector(primitives[first + i], ray);
+      isect.primitive = first + i;
+      if (detail::in_interval(isect, ray) && (isect < closest)) {
+        closest = isect;
+      }
+    }
+  };
+
+  detail::traverse_closest(bvh_, detail::make_accel_ray(ray), closest, intersect_leaf);
+
+  return closest;
+}
+
+template <typename scalar_type, typename primitive_type, typename intersection_type>
+template <typename intersector_type>
+bool traverser<scalar_type, primitive_type, intersection_type>::occluded(const ray_type& ray, const intersector_type& intersector) const noexcept {
+
+  auto hit_leaf = [this, &intersector, &ray](auto first, auto count) {
+    for (decltype(first) i = 0; i < count; i++) {
+      if (detail::in_interval(intersector(primitives[first + i], ray), ray)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  return detail::traverse_any(bvh_, detail::make_accel_ray(ray), hit_leaf);
+}
+
+template <typename scalar_type, size_type count, typename primitive_type, typename intersection_type>
+template <typename intersector_type>
+void packet_traverser<scalar_type, count, primitive_type, intersection_type>::operator () (const packet_type& packet, mask_type active, const intersector_type& intersector, intersection_type* closest) const noexcept {
+
+  for (size_type i = 0; i < count; i++) {
+    closest[i] = intersection_type();
+  }
+
+  auto is_culled = [closest](size_type lane, scalar_type tmin) {
+    return closest[lane] < tmin;
+  };
+
+  auto intersect_leaf = [this, closest, &intersector, &packet](auto first, auto primitive_count, mask_type mask) {
+
+    for (; mask; mask &= mask - 1) {
+
+      auto lane = detail::ctz(mask);
+
+      auto r = packet.get(lane);
+
+      for (decltype(first) i = 0; i < primitive_count; i++) {
+        auto isect = intersector(primitives[first + i], r);
+        isect.primitive = first + i;
+        if (detail::in_interval(isect, r) && (isect < closest[lane])) {
+          closest[lane] = isect;
+        }
+      }
+    }
+  };
+
+  detail::traverse_packet_closest(bvh_, packet, active, is_culled, intersect_leaf);
+}
+
+template <typename scalar_type, size_type width>
+template <typename primitive, typename aabb_converter>
+wide_bvh<scalar_type, width>::wide_bvh(const bvh<scalar_type>& b, const primitive* primitives, const aabb_converter& converter)
+  : prim_indices(b.primitive_indices().begin(), b.primitive_indices().end()) {
+
+  using binary_node_type = node<scalar_type>;
+
+  if (!b.size()) {
+    return;
+  }
+
+  auto box_of = [&b, primitives, &converter](index_type child) {
+
+    if (!binary_node_type::is_leaf(child)) {
+      return b[child].box;
+    }
+
+    auto first = binary_node_type::leaf_index(child);
+    auto count = binary_node_type::leaf_count(child);
+
+    auto box = converter(primitives[first]);
+
+    for (index_type i = 1; i < count; i++) {
+      box = detail::union_of(box, converter(primitives[first + i]));
+    }
+
+    return box;
+  };
+
+  if (width == 2) {
+
+    // Every binary node has exactly two children, so each one is
+    // moved into the wide node at the same index. This keeps the
+    // node layout that the binary BVH was built with.
+
+    nodes.resize(b.size());
+
+    for (size_type i = 0; i < b.size(); i++) {
+      nodes[i].children[0] = b[i].left;
+      nodes[i].children[1] = b[i].right;
+      nodes[i].set_box(0, box_of(b[i].left));
+      nodes[i].set_box(1, box_of(b[i].right));
+    }
+
+    return;
+  }
+
+  // Each entry is a binary node along with the wide node that takes its place.
+
+  struct pending final {
+    index_type binary_index;
+    index_type wide_index;
+  };
+
+  std::vector<pending> queue;
+
+  queue.reserve(b.size());
+
+  nodes.reserve(b.size());
+
+  queue.push_back(pending { 0, 0 });
+
+  nodes.emplace_back();
+
+  for (size_type q = 0; q < queue.size(); q++) {
+
+    auto current = queue[q];
+
+    index_type children[width];
+
+    aabb<scalar_type> boxes[width];
+
+    size_type child_count = 0;
+
+    const auto& root = b[current.binary_index];
+
+    children[child_count] = root.left;
+    boxes[child_count++] = box_of(root.left);
+
+    children[child_count] = root.right;
+    boxes[child_count++] = box_of(root.right);
+
+    while (child_count < width) {
+
+      auto largest = child_count;
+
+      scalar_type largest_area = 0;
+
+      for (size_type i = 0; i < child_count; i++) {
+
+        if (binary_node_type::is_leaf(children[i])) {
+          continue;
+        }
+
+        auto area = detail::surface_area(boxes[i]);
+
+        if ((largest == child_count) || (area > largest_area)) {
+          largest = i;
+          largest_area = area;
+        }
+      }
+
+      if (largest == child_count) {
+        break;
+      }
+
+      const auto& opened = b[children[largest]];
+
+      children[largest] = opened.left;
+      boxes[largest] = box_of(opened.left);
+
+      children[child_count] = opened.right;
+      boxes[child_count++] = box_of(opened.right);
+    }
+
+    node_type wide;
+
+    for (size_type i = 0; i < width; i++) {
+
+      if (i >= child_count) {
+        wide.children[i] = node_type::empty_child();
+        wide.set_box(i, detail::get_empty_aabb<scalar_type>());
+        continue;
+      }
+
+      wide.set_box(i, boxes[i]);
+
+      if (binary_node_type::is_leaf(children[i])) {
+        wide.children[i] = children[i];
+        continue;
+      }
+
+      wide.children[i] = index_type(nodes.size());
+
+      queue.push_back(pending { children[i], index_type(nodes.size()) });
+
+      nodes.emplace_back();
+    }
+
+    nodes[current.wide_index] = wide;
+  }
+}
+
+template <typename scalar_type, size_type width, typename primitive_type, typename intersection_type>
+template <typename intersector_type>
+intersection_type wide_traverser<scalar_type, width, primitive_type, intersection_type>::operator () (const ray_type& ray, const intersector_type& intersector) const noexcept {
+
+  intersection_type closest;
+
+  auto intersect_leaf = [this, &closest, &intersector, &ray](auto first, auto count) {
+    for (decltype(first) k = 0; k < count; k++) {
+      auto isect = intersector(primitives[first + k], ray);
+      isect.primitive = first + k;
+      if (detail::in_interval(isect, ray) && (isect < closest)) {
+        closest = isect;
+      }
+    }
+  };
+
+  auto node_at = [this](size_type index) -> const wide_node<scalar_type, width>& {
+    return bvh_[index];
+  };
+
+  detail::traverse_wide_closest<scalar_type, width>(bvh_.size(), node_at, detail::make_accel_ray(ray), closest, intersect_leaf);
+
+  return closest;
+}
+
+template <typename scalar_type, size_type width, typename quant_type>
+auto quantized_node<scalar_type, width, quant_type>::encode(const wide_node_type& n, index_type child_base, index_type leaf_base) noexcept -> quantized_node {
+
+  using binary_node_type = node<scalar_type>;
+
+  quantized_node q;
+
+  const scalar_type* mins[3] { n.min_x, n.min_y, n.min_z };
+  const scalar_type* maxs[3] { n.max_x, n.max_y, n.max_z };
+
+  quant_type* q_mins[3] { q.min_x, q.min_y, q.min_z };
+  quant_type* q_maxs[3] { q.max_x, q.max_y, q.max_z };
+
+  for (size_type axis = 0; axis < 3; axis++) {
+
+    auto lo = std::numeric_limits<scalar_type>::max();
+    auto hi = std::numeric_limits<scalar_type>::lowest();
+
+    for (size_type i = 0; i < width; i++) {
+      if (n.children[i] != wide_node_type::empty_child()) {
+        lo = std::min(lo, mins[axis][i]);
+        hi = std::max(hi, maxs[axis][i]);
+      }
+    }
+
+    if (lo > hi) {
+      lo = 0;
+      hi = 0;
+    }
+
+    // The smallest power of two that fits the extent into the
+    // quantized range. The division may round down, which is
+    // corrected by checking the decoded end of the grid.
+
+    int e = 0;
+
+    std::frexp((hi - lo) / scalar_type(max_quant()), &e);
+
+    e = std::max(e, std::numeric_limits<float>::min_exponent);
+
+    while ((lo + scalar_type(max_quant()) * detail::power_of_two<scalar_type>(e)) < hi) {
+      e++;
+    }
+
+    auto scale = detail::power_of_two<scalar_type>(e);
+
+    q.origin[axis] = lo;
+    q.exponent[axis] = std::int8_t(e);
+
+    auto decode_value = [lo, scale](quant_type value) {
+      return lo + scalar_type(value) * scale;
+    };
+
+    auto clamp_quant = [](scalar_type value) {
+      return quant_type(std::min(std::max(value, scalar_type(0)), scalar_type(max_quant())));
+    };
+
+    for (size_type i = 0; i < width; i++) {
+
+      if (n.children[i] == wide_node_type::empty_child()) {
+        q_mins[axis][i] = max_quant();
+        q_maxs[axis][i] = 0;
+        continue;
+      }
+
+      auto q_min = clamp_quant(std::floor((mins[axis][i] - lo) / scale));
+      auto q_max = clamp_quant(std::ceil((maxs[axis][i] - lo) / scale));
+
+      // Undo any rounding in the subtraction above.
+
+      while ((q_min > 0) && (decode_value(q_min) > mins[axis][i])) {
+        q_min--;
+      }
+
+      while ((q_max < max_quant()) && (decode_value(q_max) < maxs[axis][i])) {
+        q_max++;
+      }
+
+      q_mins[axis][i] = q_min;
+      q_maxs[axis][i] = q_max;
+    }
+  }
+
+  q.child_base = child_base;
+  q.leaf_base = leaf_base;
+
+  for (size_type i = 0; i < width; i++) {
+    if (n.children[i] == wide_node_type::empty_child()) {
+      q.meta[i] = empty_meta();
+    } else if (binary_node_type::is_leaf(n.children[i])) {
+      q.meta[i] = leaf_meta(binary_node_type::leaf_count(n.children[i]));
+    } else {
+      q.meta[i] = internal_meta();
+    }
+  }
+
+  return q;
+}
+
+template <typename scalar_type, size_type width, typename quant_type>
+auto quantized_node<scalar_type, width, quant_type>::decode() const noexcept -> wide_node_type {
+
+  using binary_node_type = node<scalar_type>;
+
+  wide_node_type n;
+
+  const scalar_type scale[3] {
+    detail::power_of_two<scalar_type>(exponent[0]),
+    detail::power_of_two<scalar_type>(exponent[1]),
+    detail::power_of_two<scalar_type>(exponent[2])
+  };
+
+  for (size_type i = 0; i < width; i++) {
+    n.min_x[i] = origin[0] + scalar_type(min_x[i]) * scale[0];
+    n.min_y[i] = origin[1] + scalar_type(min_y[i]) * scale[1];
+    n.min_z[i] = origin[2] + scalar_type(min_z[i]) * scale[2];
+    n.max_x[i] = origin[0] + scalar_type(max_x[i]) * scale[0];
+    n.max_y[i] = origin[1] + scalar_type(max_y[i]) * scale[1];
+    n.max_z[i] = origin[2] + scalar_type(max_z[i]) * scale[2];
+  }
+
+  auto next_child = child_base;
+  auto next_leaf = leaf_base;
+
+  for (size_type i = 0; i < width; i++) {
+    if (meta[i] == empty_meta()) {
+      n.children[i] = wide_node_type::empty_child();
+      n.set_box(i, detail::get_empty_aabb<scalar_type>());
+    } else if (meta[i] == internal_meta()) {
+      n.children[i] = next_child++;
+    } else {
+      auto count = size_type(meta[i] & 0x7f) + 1;
+      n.children[i] = binary_node_type::make_leaf(next_leaf, count);
+      next_leaf += index_type(count);
+    }
+  }
+
+  return n;
+}
+
+template <typename scalar_type, size_type width, typename quant_type>
+quantized_bvh<scalar_type, width, quant_type>::quantized_bvh(const wide_bvh<scalar_type, width>& b)
+  : prim_indices(b.primitive_indices()) {
+
+  using binary_node_type = node<scalar_type>;
+
+  using wide_node_type = wide_node<scalar_type, width>;
+
+  if (!b.size()) {
+    return;
+  }
+
+  // The wide nodes in breadth first order. Each node appends
+  // its internal children and the primitives of its leaves
+  // as it's visited, so that they follow each other.
+
+  std::vector<index_type> order { 0 };
+
+  order.reserve(b.size());
+
+  nodes.resize(b.size());
 
-  // The type used for offsets.
-  using offset_type = typename associated_types<sizeof(code_type)>::int_type;
+  for (size_type i = 0; i < order.size(); i++) {
 
-  // Calculates upper bits, or returns -1
-  // if 'k' is out of bounds. Appears in the
-  // LBVH paper as 'δ' (lower case delta)
-  auto calc_delta = [&table](offset_type j, offset_type k) -> delta_type {
+    const auto& n = b[order[i]];
 
-    if ((k < 0) || (k >= offset_type(table.size()))) {
-      // Suggested by the paper for out of bounds 'k'
-      return -1;
+    auto child_base = index_type(order.size());
+    auto leaf_base = index_type(leaf_prims.size());
+
+    for (auto child : n.children) {
+
+      if (child == wide_node_type::empty_child()) {
+        continue;
+      }
+
+      if (!binary_node_type::is_leaf(child)) {
+        order.push_back(child);
+        continue;
+      }
+
+      for (index_type k = 0; k < binary_node_type::leaf_count(child); k++) {
+        leaf_prims.push_back(binary_node_type::leaf_index(child) + k);
+      }
     }
 
-    auto l_code = table[size_type(j)].code;
-    auto r_code = table[size_type(k)].code;
+    nodes[i] = node_type::encode(n, child_base, leaf_base);
+  }
+}
 
-    using clz_input_type = typename associated_types<sizeof(code_type)>::uint_type;
+template <typename scalar_type, size_type width, typename primitive_type, typename intersection_type, typename quant_type>
+template <typename intersector_type>
+intersection_type quantized_traverser<scalar_type, width, primitive_type, intersection_type, quant_type>::operator () (const ray_type& ray, const intersector_type& intersector) const noexcept {
 
-    if (l_code == r_code) {
-      // Suggested by the paper in
-      // case the code are equal.
-      return clz(clz_input_type(j ^ k)) + delta_type(sizeof(code_type) * 8);
-    } else {
-      return clz(clz_input_type(l_code ^ r_code));
+  intersection_type closest;
+
+  const auto* leaf_prims = bvh_.leaf_primitives().data();
+
+  auto intersect_leaf = [this, leaf_prims, &closest, &intersector, &ray](auto first, auto count) {
+    for (decltype(first) k = 0; k < count; k++) {
+      auto p = leaf_prims[first + k];
+      auto isect = intersector(primitives[p], ray);
+      isect.primitive = p;
+      if (detail::in_interval(isect, ray) && (isect < closest)) {
+        closest = isect;
+      }
     }
   };
 
-  // It's easier in this function to regard
-  // all indices as signed offset types.
-  auto i = offset_type(node_index);
+  auto node_at = [this](size_type index) {
+    return bvh_[index].decode();
+  };
 
-  auto table_size = offset_type(table.size());
+  detail::traverse_wide_closest<scalar_type, width>(bvh_.size(), node_at, detail::make_accel_ray(ray), closest, intersect_leaf);
 
-  auto d = sign(calc_delta(i, i + 1) - calc_delta(i, i - 1));
+  return closest;
+}
 
-  auto delta_min = calc_delta(i, i - d);
+template <typename scalar_type, typename primitive_type, typename intersection_type>
+instance_traverser<scalar_type, primitive_type, intersection_type>::instance_traverser(bvh_view<scalar_type> top, const instance_type* instances, size_type count)
+  : top_(top), instances_(instances), world_to_object(count) {
 
-  offset_type l_max = 128;
+  for (size_type i = 0; i < count; i++) {
+    world_to_object[i] = math::inverse(instances[i].object_to_world);
+  }
+}
 
-  while (true) {
+template <typename scalar_type, typename primitive_type, typename intersection_type>
+template <typename intersector_type>
+auto instance_traverser<scalar_type, primitive_type, intersection_type>::operator () (const ray_type& ray, const intersector_type& intersector) const noexcept -> result_type {
 
-    auto k = i + (l_max * d);
+  using blas_traverser_type = traverser<scalar_type, primitive_type, intersection_type>;
 
-    if (k >= table_size) {
-      break;
-    }
+  result_type closest;
 
-    if (!(calc_delta(i, k) > delta_min)) {
-      break;
-    }
+  auto intersect_instances = [this, &closest, &intersector, &ray](auto first, auto count) {
 
-    l_max *= 4;
-  }
+    for (decltype(first) i = 0; i < count; i++) {
 
-  offset_type l = 0;
+      const auto& inst = instances_[first + i];
 
-  for (offset_type div = 2; true; div *= 2) {
+      const auto& t = world_to_object[first + i];
 
-    auto t = l_max / div;
+      // The direction isn't normalized after the transform,
+      // so distances along the ray stay the same in object space.
+      // This also lets the ray end at the closest hit found so far,
+      // so that the instance is only searched for closer hits.
 
-    auto k = i + ((l + t) * d);
+      ray_type object_ray {
+        math::transform_point(t, ray.pos),
+        math::transform_vector(t, ray.dir),
+        ray.tmin,
+        closest.hit ? std::min(ray.tmax, closest.hit.distance) : ray.tmax
+      };
 
-    if (calc_delta(i, k) > delta_min) {
-      l += t;
-    }
+      auto isect = blas_traverser_type(*inst.blas, inst.primitives)(object_ray, intersector);
 
-    if (t == 1) {
-      break;
+      if (isect < closest.hit) {
+        closest.hit = isect;
+        closest.instance = first + i;
+      }
     }
-  }
+  };
 
-  auto j = i + (l * d);
+  detail::traverse_closest(top_, detail::make_accel_ray(ray), closest, intersect_instances);
 
-  auto delta_node = calc_delta(i, j);
+  return closest;
+}
 
-  offset_type s = 0;
+template <typename scalar_type, typename primitive_type, typename intersection_type, typename intersector_type, typename task_scheduler>
+void trace(typename detail::non_deduced<bvh_view<scalar_type>>::value_type b,
+           const primitive_type* primitives,
+           const ray<scalar_type>* rays,
+           size_type count,
+           intersection_type* hits,
+           const intersector_type& intersector,
+           task_scheduler scheduler,
+           const trace_options& options) {
 
-  for (offset_type div = 2; true; div *= 2) {
+  using traverser_type = traverser<scalar_type, primitive_type, intersection_type>;
 
-    auto t = ceil_div(l, div);
+  using order_type = typename associated_types<sizeof(scalar_type)>::uint_type;
 
-    auto k = i + ((s + t) * d);
+  auto chunk_size = options.chunk_size ? options.chunk_size : size_type(1);
 
-    if (calc_delta(i, k) > delta_node) {
-      s += t;
-    }
+  auto chunk_count = detail::ceil_div(count, chunk_size);
 
-    if (div >= l) {
-      break;
-    }
+  // When the rays are sorted, the chunks are taken from the sorted
+  // order and each hit is written back to the slot of its ray.
+
+  pmr::vector<order_type> order;
+
+  if (options.sort_rays) {
+    detail::sort_rays(rays, count, scheduler, order);
   }
 
-  auto gamma = i + (s * d) + min(d, delta_type(0));
+  std::atomic<size_type> next_chunk { 0 };
 
-  return node_division {
-    size_type(i),
-    size_type(j),
-    size_type(gamma)
+  auto trace_chunks = [](const work_division&, const traverser_type* t, const ray<scalar_type>* r, intersection_type* h, const order_type* o, const intersector_type* isector, std::atomic<size_type>* next, size_type n, size_type c_size, size_type c_count) {
+
+    for (;;) {
+
+      auto chunk = next->fetch_add(1, std::memory_order_relaxed);
+      if (chunk >= c_count) {
+        break;
+      }
+
+      auto begin = chunk * c_size;
+      auto end = std::min(begin + c_size, n);
+
+      if (o) {
+        for (auto i = begin; i < end; i++) {
+          h[o[i]] = (*t)(r[o[i]], *isector);
+        }
+      } else {
+        for (auto i = begin; i < end; i++) {
+          h[i] = (*t)(r[i], *isector);
+        }
+      }
+    }
   };
+
+  traverser_type t(b, primitives);
+
+  scheduler(trace_chunks, &t, rays, hits, order.empty() ? nullptr : order.data(), &intersector, &next_chunk, count, chunk_size, chunk_count);
 }
 
-//! \brief Used for building the BVH nodes.
-//! Can be called by the scheduler from many threads.
-//!
-//! \tparam code_type The type of code contained by the space filling curve.
-//!
-//! \tparam scalar_type The scalar type used by the node boxes.
-template <typename code_type, typename scalar_type>
-class builder_kernel final {
-public:
-  //! A type definition for a space filling curve.
-  using curve_type = space_filling_curve<code_type>;
-  //! A type definition for a node type.
+template <typename scalar_type>
+bool save(const bvh<scalar_type>& b, const char* path) {
+
   using node_type = node<scalar_type>;
-  //! Constructs a new builder kernel.
-  //! \param c The curve containing the codes to build the nodes with.
-  //! \param n The allocated node array to put the node data into.
-  constexpr builder_kernel(const curve_type& c, node_type* n) noexcept
-    : curve(c), nodes(n) {}
-  //! Calls the kernel to build a certain portion of the BVH nodes.
-  //! \param div The division of work this function call is responsible for.
-  void operator () (const work_division& div) noexcept {
 
-    using index_type = typename node_type::index_type;
+  using index_type = typename node_type::index_type;
 
-    auto range = loop_range(div, curve.size() - 1);
+  if (!detail::is_little_endian()) {
+    return false;
+  }
 
-    for (auto i = range.begin; i < range.end; i++) {
+  auto align = [](std::uint64_t offset) {
+    return detail::ceil_div(offset, detail::bvh_file_alignment()) * detail::bvh_file_alignment();
+  };
 
-      auto node_div = divide_node(curve, i);
+  detail::bvh_file_header header {};
 
-      auto l_is_leaf = (node_div.min() == (node_div.split + 0));
-      auto r_is_leaf = (node_div.max() == (node_div.split + 1));
+  std::memcpy(header.magic, detail::bvh_file_magic(), sizeof(header.magic));
 
-      auto l_mask = l_is_leaf ? highest_bit<index_type>() : 0;
-      auto r_mask = r_is_leaf ? highest_bit<index_type>() : 0;
+  header.version = detail::bvh_file_version();
+  header.scalar_size = std::uint32_t(sizeof(scalar_type));
+  header.node_size = std::uint32_t(sizeof(node_type));
+  header.node_count = b.size();
+  header.node_offset = align(sizeof(header));
+  header.index_count = b.primitive_indices().size();
+  header.index_offset = align(header.node_offset + (header.node_count * sizeof(node_type)));
 
-      nodes[i].left  = index_type((node_div.split + 0) | l_mask);
-      nodes[i].right = index_type((node_div.split + 1) | r_mask);
-    }
+  auto* file = std::fopen(path, "wb");
+  if (!file) {
+    return false;
   }
-private:
-  //! This is the space filling curve used to determine
-  //! the range and split of each node that this kernel will build.
-  const curve_type& curve;
-  //! A pointer to the node array being constructed.
-  node_type* nodes;
-};
 
-//! Used for traversing the BVH.
-//!
-//! \tparam scalar_type The floating point type to use in the traversal.
-//!
-//! \tparam max The maximum number of entries to allocate on the stack.
-template <typename scalar_type, size_type max>
-class traversal_stack final {
-public:
-  //! The type to be used for a node index.
-  using node_index_type = typename associated_types<sizeof(scalar_type)>::uint_type;
-  //! Contains information regarding a ndoe
-  //! to be traversed.
-  struct entry final {
-    //! The index of the node to traverse.
-    node_index_type node_index;
-    //! The minimum scale at which the ray
-    //! hits this node.
-    scalar_type tmin;
+  std::uint64_t position = 0;
+
+  auto write = [file, &position](const void* values, std::uint64_t size) {
+    position += size;
+    return !size || (std::fwrite(values, size_type(size), 1, file) == 1);
   };
-  //! Indicates the number of entries remaining
-  //! in the stack.
-  inline size_type remaining() const noexcept {
-    return pos;
-  }
-  //! Removes an entry from the stack.
-  auto pop() noexcept {
-    if (!pos) {
-      return entry { 0, std::numeric_limits<scalar_type>::infinity() };
-    }
-    return entries[--pos];
-  }
-  //! Pushes an item to the stack.
-  //! \param i The index of the node.
-  //! \param t The scale at which the ray intersects this node.
-  void push(size_type i, scalar_type t) noexcept {
-    if (pos < max) {
-      entries[pos++] = entry { node_index_type(i), t };
-    }
-  }
-private:
-  //! The position of the "stack pointer."
-  size_type pos = 0;
-  //! The array of entries to be filled.
-  entry entries[max];
-};
 
-} // namespace detail
+  auto pad_to = [&write, &position](std::uint64_t offset) {
+    const char zeros[detail::bvh_file_alignment()] {};
+    return write(zeros, offset - position);
+  };
 
-template <typename scalar_type, typename task_scheduler>
-template <typename primitive, typename aabb_converter>
-auto builder<scalar_type, task_scheduler>::operator () (const primitive* primitives, size_type count, const aabb_converter& converter) -> bvh_type {
+  auto written = write(&header, sizeof(header))
+              && pad_to(header.node_offset)
+              && write(b.size() ? &b[0] : nullptr, header.node_count * sizeof(node_type))
+              && pad_to(header.index_offset)
+              && write(b.primitive_indices().data(), header.index_count * sizeof(index_type));
 
-  using curve_builder_type = detail::morton_curve_builder<scalar_type, task_scheduler>;
+  auto closed = (std::fclose(file) == 0);
 
-  using code_type = typename curve_builder_type::code_type;
+  return written && closed;
+}
 
-  curve_builder_type curve_builder(scheduler);
+#ifndef LBVH_NO_MMAP
 
-  auto curve = curve_builder(primitives, count, converter);
+template <typename scalar_type>
+bool mapped_bvh<scalar_type>::open(const char* path) {
 
-  curve.sort();
+  using node_type = node<scalar_type>;
 
-  std::vector<node_type> node_vec(curve.size() - 1);
+  using index_type = typename node_type::index_type;
 
-  detail::builder_kernel<code_type, scalar_type> builder_kern(curve, node_vec.data());
+  using header_type = detail::bvh_file_header;
 
-  scheduler(builder_kern);
+  close();
 
-  fit_boxes(node_vec, primitives, converter);
+#ifdef _WIN32
 
-  return bvh_type(std::move(node_vec));
-}
+  auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
 
-template <typename scalar_type, typename task_scheduler>
-template <typename primitive, typename aabb_converter>
-void builder<scalar_type, task_scheduler>::fit_boxes(node_vec& nodes, const primitive* primitives, const aabb_converter& converter) {
+  LARGE_INTEGER file_size;
+
+  if (!GetFileSizeEx(file, &file_size) || (std::uint64_t(file_size.QuadPart) < sizeof(header_type))) {
+    CloseHandle(file);
+    return false;
+  }
 
-  std::vector<size_type> indices;
+  // The view keeps the mapping alive, so the handles aren't needed after this.
 
-  indices.reserve(nodes.size());
+  auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
 
-  indices.push_back(0);
+  CloseHandle(file);
 
-  for (size_type i = 0; i < indices.size(); i++) {
+  if (!mapping) {
+    return false;
+  }
 
-    auto j = indices[i];
+  auto* address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
 
-    if (!nodes[j].left_is_leaf()) {
-      indices.push_back(nodes[j].left);
-    }
+  CloseHandle(mapping);
 
-    if (!nodes[j].right_is_leaf()) {
-      indices.push_back(nodes[j].right);
-    }
+  if (!address) {
+    return false;
   }
 
-  for (size_type i = indices.size(); i > 0; i--) {
+  data_size = size_type(file_size.QuadPart);
 
-    auto j = indices[i - 1];
+#else // _WIN32
 
-    auto& node = nodes[j];
+  auto file = ::open(path, O_RDONLY);
+  if (file < 0) {
+    return false;
+  }
 
-    if (node.left_is_leaf()) {
-      node.box = converter(primitives[node.left_leaf_index()]);
-    } else {
-      node.box = nodes[node.left].box;
-    }
+  struct stat file_info;
 
-    if (node.right_is_leaf()) {
-      node.box = detail::union_of(node.box, converter(primitives[node.right_leaf_index()]));
-    } else {
-      node.box = detail::union_of(node.box, nodes[node.right].box);
-    }
+  if ((fstat(file, &file_info) != 0) || (std::uint64_t(file_info.st_size) < sizeof(header_type))) {
+    ::close(file);
+    return false;
   }
-}
 
-template <typename scalar_type, typename primitive_type, typename intersection_type>
-template <typename intersector_type>
-intersection_type traverser<scalar_type, primitive_type, intersection_type>::operator () (const ray_type& ray, const intersector_type& intersector) const noexcept {
+  // The mapping stays valid after the file is closed.
 
-  using box_intersection_type = detail::box_intersection<scalar_type>;
+  auto* address = mmap(nullptr, size_type(file_info.st_size), PROT_READ, MAP_SHARED, file, 0);
 
-  detail::traversal_stack<scalar_type, 128> stack;
+  ::close(file);
 
-  stack.push(0, std::numeric_limits<scalar_type>::infinity());
+  if (address == MAP_FAILED) {
+    return false;
+  }
 
-  auto accel_r = detail::make_accel_ray(ray);
+  data_size = size_type(file_info.st_size);
 
-  auto intersect_primitive = [](const auto& intersector_, const auto* p, auto index, const auto& r) {
-    auto isect = intersector_(p[index], r);
-    isect.primitive = index;
-    return isect;
-  };
+#endif // _WIN32
 
-  intersection_type closest;
+  data = address;
 
-  while (stack.remaining()) {
+  const auto* bytes = static_cast<const unsigned char*>(data);
 
-    auto entry = stack.pop();
+  header_type header;
 
-    if (closest < entry.tmin) {
-      // We've already got a closer intersection than
-      // what can be found at this node, we can skip this.
-      continue;
-    }
+  std::memcpy(&header, bytes, sizeof(header));
 
-    const auto& node = bvh_[entry.node_index];
+  auto fits = [this](std::uint64_t offset, std::uint64_t count, std::uint64_t value_size) {
+    return ((offset % detail::bvh_file_alignment()) == 0)
+        && (offset <= data_size)
+        && (count <= ((data_size - offset) / value_size));
+  };
 
-    box_intersection_type left_box_isect;
+  auto valid = (std::memcmp(header.magic, detail::bvh_file_magic(), sizeof(header.magic)) == 0)
+            && (header.version == detail::bvh_file_version())
+            && (header.scalar_size == sizeof(scalar_type))
+            && (header.node_size == sizeof(node_type))
+            && detail::is_little_endian()
+            && fits(header.node_offset, header.node_count, sizeof(node_type))
+            && fits(header.index_offset, header.index_count, sizeof(index_type));
+
+  if (!valid) {
+    close();
+    return false;
+  }
 
-    if (node.left_is_leaf()) {
-      auto left_isect = intersect_primitive(intersector, primitives, node.left_leaf_index(), ray);
-      if (left_isect < closest) {
-        closest = left_isect;
-      }
-    } else {
-      left_box_isect = detail::intersect(bvh_[node.left].box, accel_r);
-    }
+  view_ = bvh_view<scalar_type>(
+    reinterpret_cast<const node_type*>(bytes + header.node_offset),
+    size_type(header.node_count),
+    reinterpret_cast<const index_type*>(bytes + header.index_offset),
+    size_type(header.index_count));
 
-    box_intersection_type right_box_isect;
+  return true;
+}
 
-    if (node.right_is_leaf()) {
-      auto right_isect = intersect_primitive(intersector, primitives, node.right_leaf_index(), ray);
-      if (right_isect < closest) {
-        closest = right_isect;
-      }
-    } else {
-      right_box_isect = detail::intersect(bvh_[node.right].box, accel_r);
-    }
+template <typename scalar_type>
+void mapped_bvh<scalar_type>::close() noexcept {
 
-    if (left_box_isect && right_box_isect) {
-      if (left_box_isect < right_box_isect) {
-        stack.push(node.right, right_box_isect.tmin);
-        stack.push(node.left,   left_box_isect.tmin);
-      } else {
-        stack.push(node.left,   left_box_isect.tmin);
-        stack.push(node.right, right_box_isect.tmin);
-      }
-    } else if (left_box_isect) {
-      stack.push(node.left, left_box_isect.tmin);
-    } else if (right_box_isect) {
-      stack.push(node.right, right_box_isect.tmin);
-    }
+  if (data) {
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap(data, data_size);
+#endif
   }
 
-  return closest;
+  data = nullptr;
+  data_size = 0;
+  view_ = bvh_view<scalar_type>();
 }
 
+#endif // LBVH_NO_MMAP
+
 } // namespace lbvh
@@ -2,12 +2,18 @@
 
 #include "third-party/stb_image_write.h"
 
+#include <algorithm>
 #include <chrono>
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include <atomic>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
 namespace {
 
 //! Used for size values.
@@ -35,6 +41,9 @@ struct type_traits<float> {
   static constexpr const char* scene_path() noexcept {
     return "simplified-model-float.bin";
   }
+  static constexpr const char* bvh_path() noexcept {
+    return "test-bvh-float.bin";
+  }
   static constexpr const char* name() noexcept {
     return "float";
   }
@@ -48,6 +57,9 @@ struct type_traits<double> {
   static constexpr const char* scene_path() noexcept {
     return "simplified-model-double.bin";
   }
+  static constexpr const char* bvh_path() noexcept {
+    return "test-bvh-double.bin";
+  }
   static constexpr const char* name() noexcept {
     return "double";
   }
@@ -177,6 +189,10 @@ public:
   const auto* data() const noexcept {
     return triangles.data();
   }
+  //! Accesses the triangle data, so that it may be reordered.
+  auto* data() noexcept {
+    return triangles.data();
+  }
   //! Gets the number of triangles in the scene.
   size_type size() const noexcept {
     return triangles.size();
@@ -239,6 +255,33 @@ protected:
   }
 };
 
+//! A memory resource that counts the bytes allocated through it.
+class counting_resource final : public lbvh::pmr::memory_resource {
+  //! The resource that the allocations are passed on to.
+  lbvh::pmr::memory_resource* upstream = lbvh::pmr::new_delete_resource();
+  //! The total number of bytes allocated.
+  size_type allocated_bytes = 0;
+public:
+  //! Indicates the total number of bytes allocated.
+  size_type allocated() const noexcept {
+    return allocated_bytes;
+  }
+protected:
+  //! Counts an allocation and passes it on.
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+    allocated_bytes += bytes;
+    return upstream->allocate(bytes, alignment);
+  }
+  //! Passes a deallocation on.
+  void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+    upstream->deallocate(p, bytes, alignment);
+  }
+  //! Memory can only be freed by the resource that allocated it.
+  bool do_is_equal(const lbvh::pmr::memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+};
+
 //! Represents a simple RGB color.
 template <typename scalar_type>
 struct color final {
@@ -407,6 +450,157 @@ public:
       return test_results{};
     }
 
+    std::printf("  Validating wide BVH\n");
+
+    if (!check_wide_bvh<4>(bvh, s) || !check_wide_bvh<8>(bvh, s)) {
+      return test_results{};
+    }
+
+    std::printf("  Validating BVH with child boxes\n");
+
+    if (!check_child_box_bvh(bvh, s)) {
+      return test_results{};
+    }
+
+    std::printf("  Validating quantized BVH\n");
+
+    if (!check_quantized_bvh<std::uint8_t>(bvh, s) || !check_quantized_bvh<std::uint16_t>(bvh, s)) {
+      return test_results{};
+    }
+
+    std::printf("  Laying out nodes\n");
+
+    if (!check_node_layout(bvh, s, lbvh::node_layout::depth_first)) {
+      return test_results{};
+    }
+
+    if (!check_node_layout(bvh, s, lbvh::node_layout::van_emde_boas)) {
+      return test_results{};
+    }
+
+#ifndef LBVH_NO_THREADS
+
+    std::printf("  Building BVH with work stealing\n");
+
+    if (!check_work_stealing(s)) {
+      return test_results{};
+    }
+
+    std::printf("  Stealing around a slow division\n");
+
+    if (!check_slow_division()) {
+      return test_results{};
+    }
+
+#endif // LBVH_NO_THREADS
+
+    std::printf("  Constructing BVH from std::vector\n");
+
+    if (!check_std_vector_bvh(bvh)) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH with cached boxes\n");
+
+    if (!check_cached_boxes(bvh, s)) {
+      return test_results{};
+    }
+
+    std::printf("  Clustering boxes with infinite areas\n");
+
+    if (!check_ploc_infinite_areas()) {
+      return test_results{};
+    }
+
+    std::printf("  Checking the primitive limit\n");
+
+    if (!check_primitive_limit(s)) {
+      return test_results{};
+    }
+
+    std::printf("  Refitting BVH\n");
+
+    if (!check_refit(s)) {
+      return test_results{};
+    }
+
+    std::printf("  Rebuilding BVH\n");
+
+    if (!check_rebuild(s)) {
+      return test_results{};
+    }
+
+#ifndef LBVH_NO_MMAP
+
+    std::printf("  Saving and mapping BVH\n");
+
+    if (!check_mapped_bvh(bvh, s)) {
+      return test_results{};
+    }
+
+#endif // LBVH_NO_MMAP
+
+    std::printf("  Tracing occlusion rays\n");
+
+    if (!check_occlusion(bvh, s)) {
+      return test_results{};
+    }
+
+    std::printf("  Tracing rays with intervals\n");
+
+    if (!check_ray_intervals(bvh, s)) {
+      return test_results{};
+    }
+
+    std::printf("  Tracing a ray buffer\n");
+
+    if (!check_trace(bvh, s, false) || !check_trace(bvh, s, true)) {
+      return test_results{};
+    }
+
+    std::printf("  Sorting a buffer of bounce rays\n");
+
+    if (!check_sorted_trace(bvh, s)) {
+      return test_results{};
+    }
+
+    std::printf("  Tracing ray packets\n");
+
+    if (!check_packets<8>(bvh, s) || !check_packets<16>(bvh, s)) {
+      return test_results{};
+    }
+
+    std::printf("  Tracing instances\n");
+
+    if (!check_instances(bvh, s)) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH with reordered primitives\n");
+
+    if (!check_reordered_build(s, lbvh::build_method::radix_tree)) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH with clustering\n");
+
+    if (!check_reordered_build(s, lbvh::build_method::ploc)) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH with SAH top levels\n");
+
+    if (!check_reordered_build(s, lbvh::build_method::hybrid)) {
+      return test_results{};
+    }
+
+    std::printf("  Building BVH with each method and the default options\n");
+
+    if (!check_plain_build(bvh, s, lbvh::build_method::ploc, "clustered BVH")
+     || !check_plain_build(bvh, s, lbvh::build_method::hybrid, "BVH with SAH top levels")) {
+      return test_results{};
+    }
+
     if (opts.skip_rendering) {
       return test_results {
         build_secs
@@ -535,20 +729,24 @@ protected:
       }
     }
 
-    std::vector<size_type> leaf_counts(bvh.size() + 1);
+    std::vector<size_type> leaf_counts(bvh.primitive_indices().size());
 
     for (size_type i = 0; i < bvh.size(); i++) {
 
       if (bvh[i].left_is_leaf()) {
-        leaf_counts.at(bvh[i].left_leaf_index())++;
+        for (size_type j = 0; j < bvh[i].left_leaf_count(); j++) {
+          leaf_counts.at(bvh[i].left_leaf_index() + j)++;
+        }
       }
 
       if (bvh[i].right_is_leaf()) {
-        leaf_counts.at(bvh[i].right_leaf_index())++;
+        for (size_type j = 0; j < bvh[i].right_leaf_count(); j++) {
+          leaf_counts.at(bvh[i].right_leaf_index() + j)++;
+        }
       }
     }
 
-    for (size_type i = 0; i < bvh.size() + 1; i++) {
+    for (size_type i = 0; i < leaf_counts.size(); i++) {
       auto n = leaf_counts[i];
       if (n != 1) {
         std::printf("%s:%d: Leaf %lu was referenced %lu times.\n", __FILE__, __LINE__, i, n);
@@ -566,6 +764,1335 @@ protected:
       return check_volumes(bvh, errors_fatal);
     }
   }
+  //! Makes one of a fan of rays that start at the center of the root box
+  //! of a BVH and point all around it, slightly upwards. Most of the
+  //! checks that trace rays use these.
+  //!
+  //! \param bvh The BVH to place the ray in.
+  //!
+  //! \param i The index of the ray within the fan.
+  //!
+  //! \param n The number of rays in the fan.
+  //!
+  //! \return The ray at index @p i of the fan.
+  static ray_type make_probe_ray(const bvh_type& bvh, int i, int n) {
+
+    const auto& root_box = bvh[0].box;
+
+    auto phi = scalar_type(6.28318) * i / n;
+
+    return ray_type {
+      { (root_box.min.x + root_box.max.x) / 2, (root_box.min.y + root_box.max.y) / 2, (root_box.min.z + root_box.max.z) / 2 },
+      { std::cos(phi), scalar_type(0.25), std::sin(phi) }
+    };
+  }
+  //! Traces a fan of probe rays with two traversers and checks
+  //! that each ray hits the same primitive at the same distance.
+  //!
+  //! \param bvh The BVH to place the rays in.
+  //!
+  //! \param a The traverser to compare against.
+  //!
+  //! \param b The traverser being checked.
+  //!
+  //! \param what Describes what @p b traverses, for the error message.
+  //!
+  //! \param ray_count The number of rays in the fan.
+  //!
+  //! \return True if all hits match, false otherwise.
+  template <typename traverser_a, typename traverser_b>
+  static bool compare_hits(const bvh_type& bvh, const traverser_a& a, const traverser_b& b, const char* what, int ray_count = 64) {
+
+    intersector_type intersector;
+
+    for (int i = 0; i < ray_count; i++) {
+
+      auto r = make_probe_ray(bvh, i, ray_count);
+
+      auto hit_a = a(r, intersector);
+      auto hit_b = b(r, intersector);
+
+      if ((hit_a.distance != hit_b.distance) || (hit_a.primitive != hit_b.primitive)) {
+        std::printf("%s:%d: Ray %d hit differs for the %s.\n", __FILE__, __LINE__, i, what);
+        return false;
+      }
+    }
+
+    return true;
+  }
+  //! Checks that two BVHs have the same nodes and primitive indices.
+  //!
+  //! \param a The first BVH to compare.
+  //!
+  //! \param b The second BVH to compare.
+  //!
+  //! \param what Describes the first BVH in the error messages.
+  //!
+  //! \return True if they're the same, false otherwise.
+  static bool same_bvh(const bvh_type& a, const bvh_type& b, const char* what) {
+
+    if ((a.size() != b.size()) || (a.primitive_indices() != b.primitive_indices())) {
+      std::printf("%s:%d: %s differs in size or primitive order.\n", __FILE__, __LINE__, what);
+      return false;
+    }
+
+    for (size_type i = 0; i < a.size(); i++) {
+      if (std::memcmp(&a[i], &b[i], sizeof(a[i])) != 0) {
+        std::printf("%s:%d: Node %lu of %s differs.\n", __FILE__, __LINE__, i, what);
+        return false;
+      }
+    }
+
+    return true;
+  }
+#ifndef LBVH_NO_THREADS
+  //! Builds a BVH with the work stealing scheduler, validates it
+  //! and checks that it's the same as a single threaded build.
+  //!
+  //! \param s The scene to build the BVH for.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_work_stealing(const scene_type& s) {
+
+    // Many small divisions per thread, so that the
+    // divisions are stolen even with few threads.
+
+    lbvh::builder<scalar_type, lbvh::work_stealing_scheduler> stealing_builder(lbvh::work_stealing_scheduler(4, 64));
+
+    lbvh::builder<scalar_type, lbvh::single_thread_scheduler> single_builder;
+
+    auto stealing = stealing_builder(s.data(), s.size(), converter_type());
+
+    if (!check_bvh(stealing, true)) {
+      return false;
+    }
+
+    auto single = single_builder(s.data(), s.size(), converter_type());
+
+    return same_bvh(stealing, single, "BVH built with work stealing");
+  }
+  //! Runs a task with the work stealing scheduler where the first division
+  //! is much slower than the rest, and checks that every division runs once
+  //! and that the divisions left behind the slow one are stolen from its thread.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_slow_division() {
+
+    constexpr size_type thread_count = 4;
+
+    constexpr size_type per_thread = 16;
+
+    std::vector<std::atomic<int>> run_counts(thread_count * per_thread);
+
+    std::vector<size_type> threads(thread_count * per_thread);
+
+    std::vector<size_type> start_order(thread_count * per_thread);
+
+    std::atomic<size_type> next_start { 0 };
+
+    auto task = [&run_counts, &threads, &start_order, &next_start](const lbvh::work_division& div) {
+
+      start_order[div.idx] = next_start++;
+
+      if (div.idx == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+
+      run_counts[div.idx]++;
+
+      threads[div.idx] = div.thread;
+    };
+
+    lbvh::work_stealing_scheduler scheduler(thread_count, per_thread);
+
+    scheduler(task);
+
+    for (size_type i = 0; i < run_counts.size(); i++) {
+      if (run_counts[i] != 1) {
+        std::printf("%s:%d: Division %lu ran %d times.\n", __FILE__, __LINE__, i, int(run_counts[i]));
+        return false;
+      }
+    }
+
+    // While the slow division runs, the other threads should steal what's
+    // left of its range, so its thread has little to do once it's done.
+
+    size_type later_count = 0;
+
+    for (size_type i = 0; i < threads.size(); i++) {
+      later_count += ((threads[i] == threads[0]) && (start_order[i] > start_order[0])) ? 1 : 0;
+    }
+
+    if (later_count > (per_thread / 2)) {
+      std::printf("%s:%d: The thread with the slow division ran %lu divisions after it.\n", __FILE__, __LINE__, later_count);
+      return false;
+    }
+
+    return true;
+  }
+#endif // LBVH_NO_THREADS
+  //! Copies the nodes and primitive indices of a BVH into a @c std::vector
+  //! and checks that a BVH constructed from them is the same as the original.
+  //!
+  //! \param bvh The BVH to copy.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_std_vector_bvh(const bvh_type& bvh) {
+
+    std::vector<typename bvh_type::node_type> nodes(bvh.begin(), bvh.end());
+
+    std::vector<typename bvh_type::index_type> indices(bvh.primitive_indices().begin(), bvh.primitive_indices().end());
+
+    bvh_type copy(nodes, indices);
+
+    if (!same_bvh(copy, bvh, "BVH constructed from std::vector")) {
+      return false;
+    }
+
+    // The nodes alone leave the primitive indices empty.
+
+    bvh_type nodes_only(nodes);
+
+    if ((nodes_only.size() != bvh.size()) || std::memcmp(&nodes_only[0], &bvh[0], bvh.size() * sizeof(bvh[0])) || !nodes_only.primitive_indices().empty()) {
+      std::printf("%s:%d: BVH constructed from a std::vector of nodes differs.\n", __FILE__, __LINE__);
+      return false;
+    }
+
+    return true;
+  }
+  //! Builds BVHs from cached primitive boxes, with and without reordering
+  //! the primitives, and from an array of boxes. Each one is validated and
+  //! compared with the BVH built the default way.
+  //!
+  //! \param bvh The BVH built for the scene with the default options.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_cached_boxes(const bvh_type& bvh, const scene_type& s) {
+
+    lbvh::build_options options;
+    options.cache_boxes = true;
+
+    auto cached = builder_type(options)(s.data(), s.size(), converter_type());
+
+    if (!check_bvh(cached, true) || !same_bvh(cached, bvh, "BVH built with cached boxes")) {
+      return false;
+    }
+
+    // The cached boxes are moved along with the primitives,
+    // which should give the same result as reordering alone.
+
+    scene_type reordered(s);
+    scene_type reordered_cached(s);
+
+    options.reorder_primitives = true;
+
+    auto reordered_cached_bvh = builder_type(options)(reordered_cached.data(), reordered_cached.size(), converter_type());
+
+    options.cache_boxes = false;
+
+    auto reordered_bvh = builder_type(options)(reordered.data(), reordered.size(), converter_type());
+
+    if (!check_bvh(reordered_cached_bvh, true) || !same_bvh(reordered_cached_bvh, reordered_bvh, "Reordered BVH built with cached boxes")) {
+      return false;
+    }
+
+    if (std::memcmp(reordered.data(), reordered_cached.data(), s.size() * sizeof(primitive_type)) != 0) {
+      std::printf("%s:%d: Primitives were reordered differently with cached boxes.\n", __FILE__, __LINE__);
+      return false;
+    }
+
+    std::vector<box_type> boxes;
+
+    for (size_type i = 0; i < s.size(); i++) {
+      boxes.push_back(converter_type()(s.data()[i]));
+    }
+
+    auto from_boxes = builder_type()(boxes.data(), boxes.size());
+
+    return check_bvh(from_boxes, true) && same_bvh(from_boxes, bvh, "BVH built from boxes");
+  }
+  //! Clusters boxes so large that the surface area around any two of
+  //! them overflows, so that no cluster finds a neighbor at a finite
+  //! distance, and checks that the clustering still finishes with a
+  //! valid BVH.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_ploc_infinite_areas() {
+
+    auto half_size = std::numeric_limits<scalar_type>::max() / 4;
+
+    std::vector<box_type> boxes(37);
+
+    for (auto& box : boxes) {
+      box.min = lbvh::vec3<scalar_type> { -half_size, -half_size, -half_size };
+      box.max = lbvh::vec3<scalar_type> { half_size, half_size, half_size };
+    }
+
+    lbvh::build_options options;
+    options.method = lbvh::build_method::ploc;
+
+    auto bvh = builder_type(options)(boxes.data(), boxes.size());
+
+    return check_bvh(bvh, true);
+  }
+  //! Asks the builder for a BVH with one more primitive than a leaf
+  //! can point to, and checks that it refuses to build one. The count
+  //! is checked before any primitive is read, so the scene isn't
+  //! actually that large.
+  //!
+  //! \param s The scene to pass to the builder.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_primitive_limit(const scene_type& s) {
+
+    using node_type = typename bvh_type::node_type;
+
+    auto too_many = size_type((std::uint64_t(1) << node_type::leaf_index_bits()) + 1);
+
+    builder_type builder;
+
+    try {
+      builder(s.data(), too_many, converter_type());
+      std::printf("%s:%d: Built a BVH with %lu primitives.\n", __FILE__, __LINE__, too_many);
+      return false;
+    } catch (const std::length_error&) {
+    }
+
+    std::vector<box_type> boxes(1);
+
+    try {
+      builder(boxes.data(), too_many);
+      std::printf("%s:%d: Built a BVH with %lu boxes.\n", __FILE__, __LINE__, too_many);
+      return false;
+    } catch (const std::length_error&) {
+    }
+
+    return true;
+  }
+  //! Moves some of the primitives in a copy of the scene and
+  //! refits a BVH both fully and partially, checking that both
+  //! refits give the same boxes.
+  //!
+  //! \param s The scene to build the BVH for. It isn't modified.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_refit(const scene_type& s) {
+
+    scene_type moved(s);
+
+    builder_type builder;
+
+    auto full = builder(static_cast<const scene_type&>(moved).data(), moved.size(), converter_type());
+
+    auto partial = full;
+
+    // A BVH constructed from its nodes alone has no primitive permutation,
+    // so the partial refit has to find the primitive count from the leaves.
+
+    bvh_type nodes_only(std::vector<typename bvh_type::node_type>(full.begin(), full.end()));
+
+    std::vector<typename bvh_type::index_type> changed;
+
+    for (size_type i = 0; i < moved.size(); i += 97) {
+      for (auto& pos : moved.data()[i].pos) {
+        pos.x += scalar_type(0.5);
+      }
+      changed.emplace_back(i);
+    }
+
+    builder.refit(full, moved.data(), converter_type());
+
+    builder.refit(partial, moved.data(), converter_type(), changed.data(), changed.size());
+
+    builder.refit(nodes_only, moved.data(), converter_type(), changed.data(), changed.size());
+
+    for (size_type i = 0; i < full.size(); i++) {
+      if (std::memcmp(&full[i], &partial[i], sizeof(full[i])) != 0) {
+        std::printf("%s:%d: Partial refit of node %lu differs from a full refit.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+      if (std::memcmp(&full[i], &nodes_only[i], sizeof(full[i])) != 0) {
+        std::printf("%s:%d: Partial refit of node %lu differs without a primitive permutation.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+    }
+
+    return check_bvh(full, false);
+  }
+  //! Rebuilds a BVH in place, growing and then shrinking it,
+  //! and checks that it matches a BVH built from scratch.
+  //!
+  //! \param s The scene to build the BVH for.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_rebuild(const scene_type& s) {
+
+    builder_type builder;
+
+    auto half_count = s.size() / 2;
+
+    auto rebuilt = builder(s.data(), half_count, converter_type());
+
+    for (auto count : { s.size(), half_count }) {
+
+      builder.rebuild(rebuilt, s.data(), count, converter_type());
+
+      auto expected = builder_type()(s.data(), count, converter_type());
+
+      if ((rebuilt.size() != expected.size())
+       || (rebuilt.primitive_indices() != expected.primitive_indices())) {
+        std::printf("%s:%d: Rebuilt BVH differs in size from a new BVH.\n", __FILE__, __LINE__);
+        return false;
+      }
+
+      for (size_type i = 0; i < expected.size(); i++) {
+        if (std::memcmp(&rebuilt[i], &expected[i], sizeof(expected[i])) != 0) {
+          std::printf("%s:%d: Rebuilt node %lu differs from a new BVH.\n", __FILE__, __LINE__, i);
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+#ifndef LBVH_NO_MMAP
+  //! Saves a BVH to a file, maps the file back into
+  //! memory and checks that nothing has changed.
+  //!
+  //! \param bvh The BVH to save.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_mapped_bvh(const bvh_type& bvh, const scene_type& s) {
+
+    const auto* path = type_traits<scalar_type>::bvh_path();
+
+    if (!lbvh::save(bvh, path)) {
+      std::printf("%s:%d: Failed to save BVH to '%s'.\n", __FILE__, __LINE__, path);
+      return false;
+    }
+
+    lbvh::mapped_bvh<scalar_type> mapped;
+
+    auto opened = mapped.open(path);
+
+    std::remove(path);
+
+    if (!opened) {
+      std::printf("%s:%d: Failed to map BVH from '%s'.\n", __FILE__, __LINE__, path);
+      return false;
+    }
+
+    auto view = mapped.view();
+
+    const auto& indices = bvh.primitive_indices();
+
+    if ((view.size() != bvh.size())
+     || (view.primitive_count() != indices.size())
+     || !std::equal(indices.begin(), indices.end(), view.primitive_indices())) {
+      std::printf("%s:%d: Mapped BVH differs in size from the saved one.\n", __FILE__, __LINE__);
+      return false;
+    }
+
+    for (size_type i = 0; i < bvh.size(); i++) {
+      if (std::memcmp(&view[i], &bvh[i], sizeof(bvh[i])) != 0) {
+        std::printf("%s:%d: Mapped node %lu differs from the saved one.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+    }
+
+    // The traverser works the same on the mapped BVH.
+
+    traverser_type mapped_traverser(view, s.data());
+
+    traverser_type traverser(bvh, s.data());
+
+    return compare_hits(bvh, traverser, mapped_traverser, "mapped BVH");
+  }
+#endif // LBVH_NO_MMAP
+  //! Checks that occlusion queries agree with the closest hit
+  //! of each ray, for distances on either side of that hit.
+  //!
+  //! \param bvh The BVH to trace the rays through.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_occlusion(const bvh_type& bvh, const scene_type& s) {
+
+    using traverser_type = lbvh::traverser<scalar_type, primitive_type>;
+
+    traverser_type traverser(bvh, s.data());
+
+    intersector_type intersector;
+
+    for (int i = 0; i < 64; i++) {
+
+      auto r = make_probe_ray(bvh, i, 64);
+
+      auto closest = traverser(r, intersector);
+
+      if (traverser.occluded(r, intersector) != bool(closest)) {
+        std::printf("%s:%d: Occlusion of ray %d doesn't match its closest hit.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+
+      if (!closest) {
+        continue;
+      }
+
+      auto shadow_ray = r;
+
+      shadow_ray.tmax = closest.distance;
+
+      if (traverser.occluded(shadow_ray, intersector)) {
+        std::printf("%s:%d: Ray %d is occluded before its closest hit.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+
+      shadow_ray.tmax = closest.distance * scalar_type(1.001);
+
+      if (!traverser.occluded(shadow_ray, intersector)) {
+        std::printf("%s:%d: Ray %d isn't occluded past its closest hit.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+    }
+
+    const auto& root_box = bvh[0].box;
+
+    // A ray that starts outside of the scene and points away from it.
+
+    ray_type away {
+      { root_box.max.x + 1, root_box.max.y + 1, root_box.max.z + 1 },
+      { 1, 1, 1 }
+    };
+
+    if (traverser.occluded(away, intersector)) {
+      std::printf("%s:%d: Ray pointing away from the scene is occluded.\n", __FILE__, __LINE__);
+      return false;
+    }
+
+    return true;
+  }
+  //! Narrows the interval of each ray around its closest hit
+  //! and checks that the binary, wide and packet traversers all
+  //! skip the hits that fall outside of it.
+  //!
+  //! \param bvh The BVH to trace the rays through.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_ray_intervals(const bvh_type& bvh, const scene_type& s) {
+
+    using traverser_type = lbvh::traverser<scalar_type, primitive_type>;
+
+    using wide_traverser_type = lbvh::wide_traverser<scalar_type, 8, primitive_type>;
+
+    using packet_traverser_type = lbvh::packet_traverser<scalar_type, 8, primitive_type>;
+
+    lbvh::wide_bvh<scalar_type, 8> wide(bvh, s.data(), converter_type());
+
+    traverser_type traverser(bvh, s.data());
+
+    wide_traverser_type wide_traverser(wide, s.data());
+
+    packet_traverser_type packet_traverser(bvh, s.data());
+
+    intersector_type intersector;
+
+    // Each ray is traced before its closest hit, around it and past it.
+
+    auto trace_all = [&](const ray_type& r, lbvh::intersection<scalar_type>* hits) {
+
+      hits[0] = traverser(r, intersector);
+      hits[1] = wide_traverser(r, intersector);
+
+      typename packet_traverser_type::packet_type packet;
+
+      packet.set(0, r);
+
+      lbvh::intersection<scalar_type> packet_hits[8];
+
+      packet_traverser(packet, 1u, intersector, packet_hits);
+
+      hits[2] = packet_hits[0];
+    };
+
+    for (int i = 0; i < 64; i++) {
+
+      auto r = make_probe_ray(bvh, i, 64);
+
+      auto closest = traverser(r, intersector);
+
+      if (!closest) {
+        continue;
+      }
+
+      lbvh::intersection<scalar_type> hits[3];
+
+      auto before = r;
+
+      before.tmax = closest.distance * scalar_type(0.999);
+
+      trace_all(before, hits);
+
+      for (const auto& hit : hits) {
+        if (hit) {
+          std::printf("%s:%d: Ray %d hit something past its maximum distance.\n", __FILE__, __LINE__, i);
+          return false;
+        }
+      }
+
+      auto around = r;
+
+      around.tmin = closest.distance * scalar_type(0.999);
+      around.tmax = closest.distance * scalar_type(1.001);
+
+      trace_all(around, hits);
+
+      for (const auto& hit : hits) {
+        if ((hit.distance != closest.distance) || (hit.primitive != closest.primitive)) {
+          std::printf("%s:%d: Ray %d missed its closest hit within its interval.\n", __FILE__, __LINE__, i);
+          return false;
+        }
+      }
+
+      auto past = r;
+
+      past.tmin = closest.distance * scalar_type(1.001);
+
+      trace_all(past, hits);
+
+      for (const auto& hit : hits) {
+        if (hit && (hit.distance < past.tmin)) {
+          std::printf("%s:%d: Ray %d hit something before its minimum distance.\n", __FILE__, __LINE__, i);
+          return false;
+        }
+        if ((hit.distance != hits[0].distance) || (hit.primitive != hits[0].primitive)) {
+          std::printf("%s:%d: Ray %d hits differ between traversers past its closest hit.\n", __FILE__, __LINE__, i);
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+  //! Traces a buffer of rays with the batch API, in chunks that don't
+  //! divide the buffer evenly, and checks the hits against single rays.
+  //!
+  //! \param bvh The BVH to trace the rays through.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \param sort_rays Whether or not the rays are sorted before they're traced.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_trace(const bvh_type& bvh, const scene_type& s, bool sort_rays) {
+
+    using traverser_type = lbvh::traverser<scalar_type, primitive_type>;
+
+    traverser_type traverser(bvh, s.data());
+
+    intersector_type intersector;
+
+    const auto& root_box = bvh[0].box;
+
+    std::vector<ray_type> rays;
+
+    for (int i = 0; i < 1000; i++) {
+
+      auto phi = scalar_type(6.28318) * i / 1000;
+
+      rays.push_back(ray_type {
+        { (root_box.min.x + root_box.max.x) / 2, (root_box.min.y + root_box.max.y) / 2, (root_box.min.z + root_box.max.z) / 2 },
+        { std::cos(phi), scalar_type(0.5) * std::sin(phi * 7), std::sin(phi) }
+      });
+    }
+
+    std::vector<lbvh::intersection<scalar_type>> hits(rays.size());
+
+    lbvh::trace_options options;
+    options.chunk_size = 64;
+    options.sort_rays = sort_rays;
+
+    lbvh::trace(bvh, s.data(), rays.data(), rays.size(), hits.data(), intersector, lbvh::default_scheduler(), options);
+
+    for (size_type i = 0; i < rays.size(); i++) {
+
+      auto a = traverser(rays[i], intersector);
+
+      if ((a.distance != hits[i].distance) || (a.primitive != hits[i].primitive)) {
+        std::printf("%s:%d: Ray %lu of the buffer hit differs from a single ray.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+    }
+
+    return true;
+  }
+  //! Makes a shuffled buffer of bounce rays, which start at the hits of
+  //! a fan of rays and point every which way, and traces it with and
+  //! without sorting. Checks that the sorted order visits every ray
+  //! exactly once and that both give the hits of single rays.
+  //!
+  //! \param bvh The BVH to trace the rays through.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_sorted_trace(const bvh_type& bvh, const scene_type& s) {
+
+    using traverser_type = lbvh::traverser<scalar_type, primitive_type>;
+
+    using index_type = typename bvh_type::index_type;
+
+    traverser_type traverser(bvh, s.data());
+
+    intersector_type intersector;
+
+    std::mt19937 rng(1234);
+
+    std::uniform_real_distribution<scalar_type> dir_dist(-1, 1);
+
+    std::vector<ray_type> rays;
+
+    for (int i = 0; i < 1000; i++) {
+
+      auto primary = make_probe_ray(bvh, i, 1000);
+
+      auto hit = traverser(primary, intersector);
+      if (!hit) {
+        continue;
+      }
+
+      // The origin is left just in front of the surface. Every eighth ray
+      // points along the surface of an octant, to check the octant ties.
+
+      lbvh::vec3<scalar_type> pos {
+        primary.pos.x + (primary.dir.x * hit.distance * scalar_type(0.999)),
+        primary.pos.y + (primary.dir.y * hit.distance * scalar_type(0.999)),
+        primary.pos.z + (primary.dir.z * hit.distance * scalar_type(0.999))
+      };
+
+      lbvh::vec3<scalar_type> dir { dir_dist(rng), dir_dist(rng), dir_dist(rng) };
+
+      if ((i % 8) == 0) {
+        dir.y = 0;
+      }
+
+      rays.push_back(ray_type { pos, dir });
+    }
+
+    std::shuffle(rays.begin(), rays.end(), rng);
+
+    lbvh::default_scheduler scheduler;
+
+    lbvh::pmr::vector<index_type> order;
+
+    lbvh::detail::sort_rays(rays.data(), rays.size(), scheduler, order);
+
+    std::vector<int> visit_counts(rays.size());
+
+    for (auto index : order) {
+      visit_counts.at(index)++;
+    }
+
+    for (size_type i = 0; i < rays.size(); i++) {
+      if ((order.size() != rays.size()) || (visit_counts[i] != 1)) {
+        std::printf("%s:%d: Sorted order visits ray %lu %d times.\n", __FILE__, __LINE__, i, visit_counts[i]);
+        return false;
+      }
+    }
+
+    std::vector<lbvh::intersection<scalar_type>> unsorted_hits(rays.size());
+    std::vector<lbvh::intersection<scalar_type>> sorted_hits(rays.size());
+
+    lbvh::trace_options options;
+    options.chunk_size = 64;
+
+    lbvh::trace(bvh, s.data(), rays.data(), rays.size(), unsorted_hits.data(), intersector, scheduler, options);
+
+    options.sort_rays = true;
+
+    lbvh::trace(bvh, s.data(), rays.data(), rays.size(), sorted_hits.data(), intersector, scheduler, options);
+
+    for (size_type i = 0; i < rays.size(); i++) {
+
+      auto a = traverser(rays[i], intersector);
+
+      if ((a.distance != unsorted_hits[i].distance) || (a.primitive != unsorted_hits[i].primitive)
+       || (a.distance != sorted_hits[i].distance) || (a.primitive != sorted_hits[i].primitive)) {
+        std::printf("%s:%d: Bounce ray %lu of the buffer hit differs from a single ray.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+    }
+
+    return true;
+  }
+  //! Traces packets of rays and checks that each ray gets
+  //! the same hit as when it's traced on its own.
+  //!
+  //! \tparam packet_size The number of rays per packet. Float packets of eight
+  //! and sixteen rays go through the AVX2 or AVX-512 kernels, where available.
+  //!
+  //! \param bvh The BVH to trace the rays through.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \return True on success, false on failure.
+  template <size_type packet_size>
+  static bool check_packets(const bvh_type& bvh, const scene_type& s) {
+
+    using traverser_type = lbvh::traverser<scalar_type, primitive_type>;
+
+    using packet_traverser_type = lbvh::packet_traverser<scalar_type, packet_size, primitive_type>;
+
+    using packet_type = typename packet_traverser_type::packet_type;
+
+    traverser_type traverser(bvh, s.data());
+
+    packet_traverser_type packet_traverser(bvh, s.data());
+
+    intersector_type intersector;
+
+    int packet_count = int(64 / packet_size);
+
+    for (int p = 0; p < packet_count; p++) {
+
+      packet_type packet;
+
+      // The last packet is left partly empty.
+
+      int ray_count = int(packet_size) - ((p == (packet_count - 1)) ? 5 : 0);
+
+      for (int i = 0; i < ray_count; i++) {
+        packet.set(size_type(i), make_probe_ray(bvh, (p * int(packet_size)) + i, 64));
+      }
+
+      for (int i = ray_count; i < int(packet_size); i++) {
+        if ((packet.dir[0][i] != 0) || (packet.tmin[i] != 0) || (packet.tmax[i] != 0) || (packet.indices[i] != 0)) {
+          std::printf("%s:%d: Unused packet slot %d isn't zero.\n", __FILE__, __LINE__, i);
+          return false;
+        }
+      }
+
+      lbvh::intersection<scalar_type> hits[packet_size];
+
+      packet_traverser(packet, (1u << ray_count) - 1, intersector, hits);
+
+      for (int i = 0; i < int(packet_size); i++) {
+
+        if (i >= ray_count) {
+          if (hits[i]) {
+            std::printf("%s:%d: Empty slot %d of packet %d has a hit.\n", __FILE__, __LINE__, i, p);
+            return false;
+          }
+          continue;
+        }
+
+        auto a = traverser(packet.get(size_type(i)), intersector);
+
+        if ((a.distance != hits[i].distance) || (a.primitive != hits[i].primitive)) {
+          std::printf("%s:%d: Ray %d of packet %d hit differs from a single ray.\n", __FILE__, __LINE__, i, p);
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+  //! Places two instances of a BVH side by side, and a third one that
+  //! overlaps the first, and checks that tracing them gives the same
+  //! hits as tracing the BVH directly.
+  //!
+  //! \param bvh The BVH to instance.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_instances(const bvh_type& bvh, const scene_type& s) {
+
+    using instance_type = lbvh::instance<scalar_type, primitive_type>;
+
+    const auto& root_box = bvh[0].box;
+
+    auto offset = (root_box.max.x - root_box.min.x) * 2;
+
+    // The overlapping instance is hit along with the first one, so it
+    // only gives the right hits if each instance ends the ray at the
+    // closest hit found so far.
+
+    scalar_type offsets[3] { 0, offset, offset / 16 };
+
+    instance_type instances[3];
+
+    for (int k = 0; k < 3; k++) {
+      instances[k].object_to_world = lbvh::transform<scalar_type>::identity();
+      instances[k].object_to_world.m[0][3] = offsets[k];
+      instances[k].blas = &bvh;
+      instances[k].primitives = s.data();
+    }
+
+    builder_type builder;
+
+    auto top = builder(instances, 3);
+
+    lbvh::instance_traverser<scalar_type, primitive_type> instance_traverser(top, instances, 3);
+
+    traverser_type traverser(bvh, s.data());
+
+    intersector_type intersector;
+
+    using namespace lbvh::math;
+
+    auto center = (root_box.min + root_box.max) * scalar_type(0.5);
+
+    // The second half of the rays start inside of the shifted instance.
+
+    for (int i = 0; i < 64; i++) {
+
+      for (int j = 0; j < 16; j++) {
+
+        auto theta = scalar_type(3.14159) * (j + scalar_type(0.5)) / 16;
+        auto phi = scalar_type(6.28318) * (i % 32) / 32;
+
+        ray_type r {
+          { center.x + ((i < 32) ? scalar_type(0) : offset), center.y, center.z },
+          { std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi) }
+        };
+
+        lbvh::intersection<scalar_type> direct_hits[3];
+
+        lbvh::intersection<scalar_type> expected;
+
+        int expected_instance = 0;
+
+        for (int k = 0; k < 3; k++) {
+
+          ray_type r_shifted { { r.pos.x - offsets[k], r.pos.y, r.pos.z }, r.dir };
+
+          direct_hits[k] = traverser(r_shifted, intersector);
+
+          if (direct_hits[k] < expected) {
+            expected = direct_hits[k];
+            expected_instance = k;
+          }
+        }
+
+        auto isect = instance_traverser(r, intersector);
+
+        if (bool(isect) != bool(expected)) {
+          std::printf("%s:%d: Instanced ray %d, %d hit differs from the direct traversal.\n", __FILE__, __LINE__, i, j);
+          return false;
+        }
+
+        if (!expected) {
+          continue;
+        }
+
+        if ((isect.hit.distance == expected.distance)
+         && (isect.hit.primitive == expected.primitive)
+         && (isect.instance == decltype(isect.instance)(expected_instance))) {
+          continue;
+        }
+
+        // The box tests round their distances, so once the ray ends at a hit in
+        // one instance, a closer hit in another instance within a few ulps of it
+        // may be culled, just as it would be within a single BVH. Only that case
+        // is allowed, and the hit must still be the direct hit of its instance.
+
+        auto other_instance = int(isect.instance);
+
+        bool near_tie = (other_instance != expected_instance)
+                     && (other_instance >= 0) && (other_instance < 3)
+                     && (isect.hit.distance == direct_hits[other_instance].distance)
+                     && (isect.hit.primitive == direct_hits[other_instance].primitive)
+                     && (std::abs(isect.hit.distance - expected.distance) <= expected.distance * scalar_type(1e-5));
+
+        if (!near_tie) {
+          std::printf("%s:%d: Instanced ray %d, %d hit differs from the direct traversal.\n", __FILE__, __LINE__, i, j);
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+  //! Converts a BVH into a wide BVH, checks that every node and every
+  //! primitive is referenced exactly once and that it gives the same
+  //! hits as the binary BVH.
+  //!
+  //! \tparam width The number of children per wide node.
+  //!
+  //! \param bvh The binary BVH to convert.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \return True on success, false on failure.
+  template <size_type width>
+  static bool check_wide_bvh(const bvh_type& bvh, const scene_type& s) {
+
+    using wide_bvh_type = lbvh::wide_bvh<scalar_type, width>;
+
+    using node_type = typename bvh_type::node_type;
+
+    using traverser_type = lbvh::traverser<scalar_type, primitive_type>;
+
+    using wide_traverser_type = lbvh::wide_traverser<scalar_type, width, primitive_type>;
+
+    wide_bvh_type wide(bvh, s.data(), converter_type());
+
+    std::vector<size_type> node_counts(wide.size());
+
+    std::vector<size_type> leaf_counts(s.size());
+
+    for (size_type i = 0; i < wide.size(); i++) {
+
+      for (auto child : wide[i].children) {
+
+        if (child == wide_bvh_type::node_type::empty_child()) {
+          continue;
+        }
+
+        if (!node_type::is_leaf(child)) {
+          node_counts.at(child)++;
+          continue;
+        }
+
+        for (size_type j = 0; j < node_type::leaf_count(child); j++) {
+          leaf_counts.at(node_type::leaf_index(child) + j)++;
+        }
+      }
+    }
+
+    for (size_type i = 1; i < node_counts.size(); i++) {
+      if (node_counts[i] != 1) {
+        std::printf("%s:%d: Wide node %lu was counted %lu times.\n", __FILE__, __LINE__, i, node_counts[i]);
+        return false;
+      }
+    }
+
+    for (size_type i = 0; i < leaf_counts.size(); i++) {
+      if (leaf_counts[i] != 1) {
+        std::printf("%s:%d: Primitive %lu was referenced %lu times by the wide BVH.\n", __FILE__, __LINE__, i, leaf_counts[i]);
+        return false;
+      }
+    }
+
+    traverser_type traverser(bvh, s.data());
+
+    wide_traverser_type wide_traverser(wide, s.data());
+
+    return compare_hits(bvh, traverser, wide_traverser, "wide BVH");
+  }
+  //! Converts a BVH into one that keeps the child boxes in each node
+  //! and checks that it has the same topology and gives the same hits.
+  //!
+  //! \param bvh The binary BVH to convert.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_child_box_bvh(const bvh_type& bvh, const scene_type& s) {
+
+    using child_box_bvh_type = lbvh::wide_bvh<scalar_type, 2>;
+
+    using traverser_type = lbvh::traverser<scalar_type, primitive_type>;
+
+    using child_box_traverser_type = lbvh::wide_traverser<scalar_type, 2, primitive_type>;
+
+    child_box_bvh_type child_box_bvh(bvh, s.data(), converter_type());
+
+    if (child_box_bvh.size() != bvh.size()) {
+      std::printf("%s:%d: BVH with child boxes has %lu nodes instead of %lu.\n", __FILE__, __LINE__, child_box_bvh.size(), bvh.size());
+      return false;
+    }
+
+    for (size_type i = 0; i < bvh.size(); i++) {
+
+      const auto& n = child_box_bvh[i];
+
+      if ((n.children[0] != bvh[i].left) || (n.children[1] != bvh[i].right)) {
+        std::printf("%s:%d: Node %lu has different children.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+
+      auto left_box = n.box(0);
+      auto right_box = n.box(1);
+
+      if (!bvh[i].left_is_leaf() && std::memcmp(&bvh[bvh[i].left].box, &left_box, sizeof(left_box))) {
+        std::printf("%s:%d: Left box of node %lu differs.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+
+      if (!bvh[i].right_is_leaf() && std::memcmp(&bvh[bvh[i].right].box, &right_box, sizeof(right_box))) {
+        std::printf("%s:%d: Right box of node %lu differs.\n", __FILE__, __LINE__, i);
+        return false;
+      }
+    }
+
+    traverser_type traverser(bvh, s.data());
+
+    child_box_traverser_type child_box_traverser(child_box_bvh, s.data());
+
+    return compare_hits(bvh, traverser, child_box_traverser, "BVH with child boxes");
+  }
+  //! Quantizes an eight wide BVH and walks it along with the wide BVH,
+  //! checking that each decoded box encloses the original one, that the
+  //! leaves point to the same primitives and that rays hit the same primitives.
+  //!
+  //! \tparam quant_type The unsigned integer type of a quantized coordinate.
+  //!
+  //! \param bvh The binary BVH to convert.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \return True on success, false on failure.
+  template <typename quant_type>
+  static bool check_quantized_bvh(const bvh_type& bvh, const scene_type& s) {
+
+    using wide_bvh_type = lbvh::wide_bvh<scalar_type, 8>;
+
+    using quantized_bvh_type = lbvh::quantized_bvh<scalar_type, 8, quant_type>;
+
+    using traverser_type = lbvh::traverser<scalar_type, primitive_type>;
+
+    using quantized_traverser_type = lbvh::quantized_traverser<scalar_type, 8, primitive_type, lbvh::intersection<scalar_type>, quant_type>;
+
+    using node_type = typename bvh_type::node_type;
+
+    wide_bvh_type wide(bvh, s.data(), converter_type());
+
+    quantized_bvh_type quantized(wide);
+
+    if (quantized.size() != wide.size()) {
+      std::printf("%s:%d: Quantized BVH has %lu nodes instead of %lu.\n", __FILE__, __LINE__, quantized.size(), wide.size());
+      return false;
+    }
+
+    // Pairs of wide and quantized node indices, which are moved around by the quantized BVH.
+
+    std::vector<std::pair<size_type, size_type>> pending { { 0, 0 } };
+
+    while (!pending.empty()) {
+
+      auto wide_index = pending.back().first;
+      auto quantized_index = pending.back().second;
+
+      pending.pop_back();
+
+      if (quantized_index >= quantized.size()) {
+        std::printf("%s:%d: Quantized node index %lu is out of range.\n", __FILE__, __LINE__, quantized_index);
+        return false;
+      }
+
+      const auto& w = wide[wide_index];
+
+      auto decoded = quantized[quantized_index].decode();
+
+      for (size_type j = 0; j < 8; j++) {
+
+        auto a_child = w.children[j];
+        auto b_child = decoded.children[j];
+
+        if (a_child == wide_bvh_type::node_type::empty_child()) {
+          if (b_child != a_child) {
+            std::printf("%s:%d: Quantized node %lu has a child in empty slot %lu.\n", __FILE__, __LINE__, quantized_index, j);
+            return false;
+          }
+          continue;
+        }
+
+        if (node_type::is_leaf(a_child) != node_type::is_leaf(b_child)) {
+          std::printf("%s:%d: Quantized node %lu has a different child %lu.\n", __FILE__, __LINE__, quantized_index, j);
+          return false;
+        }
+
+        if (!node_type::is_leaf(a_child)) {
+          pending.emplace_back(a_child, b_child);
+        } else {
+
+          if (node_type::leaf_count(a_child) != node_type::leaf_count(b_child)) {
+            std::printf("%s:%d: Quantized leaf %lu of node %lu has a different size.\n", __FILE__, __LINE__, j, quantized_index);
+            return false;
+          }
+
+          for (size_type k = 0; k < node_type::leaf_count(a_child); k++) {
+            if (quantized.leaf_primitives().at(node_type::leaf_index(b_child) + k) != node_type::leaf_index(a_child) + k) {
+              std::printf("%s:%d: Quantized leaf %lu of node %lu points to another primitive.\n", __FILE__, __LINE__, j, quantized_index);
+              return false;
+            }
+          }
+        }
+
+        auto a = w.box(j);
+        auto b = decoded.box(j);
+
+        if ((b.min.x > a.min.x) || (b.min.y > a.min.y) || (b.min.z > a.min.z)
+         || (b.max.x < a.max.x) || (b.max.y < a.max.y) || (b.max.z < a.max.z)) {
+          std::printf("%s:%d: Quantized box %lu of node %lu doesn't enclose the original.\n", __FILE__, __LINE__, j, quantized_index);
+          return false;
+        }
+      }
+    }
+
+    traverser_type traverser(bvh, s.data());
+
+    quantized_traverser_type quantized_traverser(quantized, s.data());
+
+    return compare_hits(bvh, traverser, quantized_traverser, "quantized BVH");
+  }
+  //! Builds a BVH with another method and otherwise default options, so that
+  //! no optimization pass can repair its topology or boxes before it's checked.
+  //! It's validated and traced along with the radix tree built for the scene.
+  //!
+  //! \param bvh The radix tree BVH built with the default options.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \param method The build method to check.
+  //!
+  //! \param what Describes the BVH, for error messages.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_plain_build(const bvh_type& bvh, const scene_type& s, lbvh::build_method method, const char* what) {
+
+    lbvh::build_options options;
+    options.method = method;
+
+    auto built = builder_type(options)(s.data(), s.size(), converter_type());
+
+    if (!check_bvh(built, true)) {
+      std::printf("%s:%d: The %s isn't valid.\n", __FILE__, __LINE__, what);
+      return false;
+    }
+
+    traverser_type traverser(bvh, s.data());
+
+    traverser_type built_traverser(built, s.data());
+
+    return compare_hits(bvh, traverser, built_traverser, what);
+  }
+  //! Builds a BVH with its nodes in another order and checks that
+  //! it's still valid and that rays hit the same primitives.
+  //!
+  //! \param bvh A BVH built with the default options.
+  //!
+  //! \param s The scene that the BVH was built for.
+  //!
+  //! \param layout The order to store the nodes in.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_node_layout(const bvh_type& bvh, const scene_type& s, lbvh::node_layout layout) {
+
+    using traverser_type = lbvh::traverser<scalar_type, primitive_type>;
+
+    lbvh::build_options options;
+    options.layout = layout;
+
+    builder_type builder(options);
+
+    auto laid_out = builder(s.data(), s.size(), converter_type());
+
+    if (laid_out.size() != bvh.size()) {
+      std::printf("%s:%d: BVH has %lu nodes after the layout instead of %lu.\n", __FILE__, __LINE__, laid_out.size(), bvh.size());
+      return false;
+    }
+
+    if (!check_bvh(laid_out, true)) {
+      return false;
+    }
+
+    if (layout == lbvh::node_layout::depth_first) {
+      for (size_type i = 0; i < laid_out.size(); i++) {
+        if (!laid_out[i].left_is_leaf() && (laid_out[i].left != (i + 1))) {
+          std::printf("%s:%d: Left child of node %lu isn't the next node.\n", __FILE__, __LINE__, i);
+          return false;
+        }
+      }
+    }
+
+    traverser_type traverser(bvh, s.data());
+
+    traverser_type laid_out_traverser(laid_out, s.data());
+
+    return compare_hits(bvh, traverser, laid_out_traverser, "laid out BVH");
+  }
+  //! Builds a BVH that reorders a copy of the scene, restructures its
+  //! treelets and collapses subtrees into leaves, then validates the
+  //! BVH and its primitive permutation.
+  //!
+  //! \param s The scene to build the BVH for. It isn't modified.
+  //!
+  //! \param method The algorithm to build the tree with.
+  //!
+  //! \return True on success, false on failure.
+  static bool check_reordered_build(const scene_type& s, lbvh::build_method method) {
+
+    scene_type reordered(s);
+
+    lbvh::build_options options;
+    options.method = method;
+    options.reorder_primitives = true;
+    options.max_leaf_size = 8;
+    options.optimization_passes = 2;
+
+    // Everything the builder allocates should come from this
+    // resource, so the default resource is made to fail meanwhile,
+    // where the standard library lets it be replaced.
+
+    counting_resource resource;
+
+    builder_type builder(options, lbvh::default_scheduler(), &resource);
+
+#ifdef LBVH_HAS_MEMORY_RESOURCE
+    auto* default_resource = std::pmr::set_default_resource(std::pmr::null_memory_resource());
+#endif
+
+    auto bvh = builder(reordered.data(), reordered.size(), converter_type());
+
+#ifdef LBVH_HAS_MEMORY_RESOURCE
+    std::pmr::set_default_resource(default_resource);
+#endif
+
+    if (!resource.allocated()) {
+      std::printf("%s:%d: Builder did not allocate from its memory resource.\n", __FILE__, __LINE__);
+      return false;
+    }
+
+    if (!check_bvh(bvh, false)) {
+      return false;
+    }
+
+    const auto& indices = bvh.primitive_indices();
+
+    if (indices.size() != s.size()) {
+      std::printf("%s:%d: Permutation has %lu indices instead of %lu.\n", __FILE__, __LINE__, indices.size(), s.size());
+      return false;
+    }
+
+    std::vector<size_type> index_counts(s.size());
+
+    for (size_type i = 0; i < indices.size(); i++) {
+
+      auto original_index = size_type(indices[i]);
+
+      if ((original_index >= s.size()) || (index_counts[original_index]++ > 0)) {
+        std::printf("%s:%d: Index %lu is not part of a permutation.\n", __FILE__, __LINE__, original_index);
+        return false;
+      }
+
+      if (std::memcmp(&reordered.data()[i], &s.data()[original_index], sizeof(primitive_type)) != 0) {
+        std::printf("%s:%d: Primitive %lu was not moved from %lu.\n", __FILE__, __LINE__, i, original_index);
+        return false;
+      }
+    }
+
+    return true;
+  }
   //! Checks the volumes of a BVH,
   //! ensuring that all sub nodes have a volume that's smaller than their parent.
   //!